@@ -32,10 +32,8 @@
 #define SYS_WRITE 1
 #define SYS_OPEN 2
 #define SYS_CLOSE 3
-#define SYS_FORK 57
-#define SYS_EXECVE 59
-#define SYS_EXIT 60
 #define SYS_WAIT 61
+#define SYS_SPAWN 400
 #define STDIN 0
 #define STDOUT 1
 
@@ -57,12 +55,6 @@ static long syscall3(long num, long arg1, long arg2, long arg3) {
   return ret;
 }
 
-static long syscall0(long num) {
-  long ret;
-  __asm__ volatile("syscall" : "=a"(ret) : "a"(num) : "rcx", "r11", "memory");
-  return ret;
-}
-
 static long write(int fd, const void *buf, unsigned long count) {
   return syscall3(SYS_WRITE, fd, (long)buf, count);
 }
@@ -71,16 +63,8 @@ static long read(int fd, void *buf, unsigned long count) {
   return syscall3(SYS_READ, fd, (long)buf, count);
 }
 
-static void exit(int code) {
-  syscall1(SYS_EXIT, code);
-  while (1) {
-  }
-}
-
-static long fork(void) { return syscall0(SYS_FORK); }
-
-static long execve(const char *path, char *const argv[], char *const envp[]) {
-  return syscall3(SYS_EXECVE, (long)path, (long)argv, (long)envp);
+static long spawn(const char *path, char *const argv[], char *const envp[]) {
+  return syscall3(SYS_SPAWN, (long)path, (long)argv, (long)envp);
 }
 
 static long wait(int *status) { return syscall1(SYS_WAIT, (long)status); }
@@ -131,19 +115,13 @@ void _start(void) {
     argv[0] = path;
     argv[1] = 0;
 
-    long pid = fork();
-    if (pid == 0) {
-      execve(path, argv, 0);
-      print("execve failed (child)\n");
-      exit(1);
-    }
-
+    long pid = spawn(path, argv, 0);
     if (pid < 0) {
-      print("fork failed\n");
+      print("spawn failed\n");
       continue;
     }
 
-    print("fork ok, child running\n");
+    print("spawn ok, child running\n");
     int status = 0;
     while (wait(&status) < 0) {
     }
@@ -121,13 +121,15 @@ end_tag:
 multiboot2_header_end:
 
 
-.section .bss
+.section .boot.bss, "aw", @nobits
 .align 4096
 
 p4_table:
     .skip 4096
 p3_table:
     .skip 4096
+p3_high_table:
+    .skip 4096
 p2_table:
     .skip 4096
 p2_table_1:
@@ -136,13 +138,17 @@ p2_table_2:
     .skip 4096
 p2_table_3:
     .skip 4096
+p2_high_table:
+    .skip 4096
+p2_high_table_1:
+    .skip 4096
 
 stack_bottom:
     .skip 65536
 stack_top:
 
 
-.section .data
+.section .boot.data, "aw"
 .align 8
 
 multiboot_info_ptr:
@@ -185,7 +191,7 @@ fb_cursor_x:
 fb_cursor_y:
     .long 0                     
 
-.section .rodata
+.section .boot.rodata, "a"
 
 gdt64:
     .quad 0                                             /* Null descriptor */
@@ -445,7 +451,17 @@ font_8x8:
     .byte 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
 
 
-.section .text
+.section .bss
+.align 16
+
+/* The 64-bit kernel stack lives in the higher half with the rest of the
+ * kernel; the boot stack above is left behind with the identity map. */
+kernel_stack_bottom:
+    .skip 65536
+kernel_stack_top:
+
+
+.section .boot.text, "ax"
 .code32
 .global start
 
@@ -1432,17 +1448,61 @@ setup_page_tables:
     or eax, 0b11
     mov [p3_table + 24], eax
 
+    /* The same 4 GB again as the direct map at 0xFFFF800000000000 (PML4
+     * slot 256); the identity slot is dropped once the kernel is up. */
+    mov eax, offset p3_table
+    or eax, 0b11
+    mov [p4_table + 256 * 8], eax
+
+    /* Kernel image at 0xFFFFFFFF80000000: the first 2 GB through PML4
+     * slot 511, PDPT slots 510 and 511. It gets page directories of its
+     * own so later changes to either mapping stay out of the other. */
+    mov eax, offset p3_high_table
+    or eax, 0b11
+    mov [p4_table + 511 * 8], eax
+
+    mov eax, offset p2_high_table
+    or eax, 0b11
+    mov [p3_high_table + 510 * 8], eax
+
+    mov eax, offset p2_high_table_1
+    or eax, 0b11
+    mov [p3_high_table + 511 * 8], eax
+
     mov ecx, 0
 .Lmap_p2:
     mov eax, 0x200000           
     mul ecx
-    or eax, 0b10000011          
+    or eax, 0b110000011         /* present, writable, 2 MB, global */
     mov [p2_table + ecx * 8], eax
-    
+    cmp ecx, 1024
+    jae .Lmap_p2_next
+    mov [p2_high_table + ecx * 8], eax
+.Lmap_p2_next:
     inc ecx
     cmp ecx, 2048               
     jne .Lmap_p2
-    
+
+    /* With 1 GB pages (CPUID 0x80000001 EDX bit 26) the identity and direct
+     * maps use four PDPT entries and leave the page directories unused. */
+    push ebx
+    mov eax, 0x80000001
+    cpuid
+    pop ebx
+    test edx, (1 << 26)
+    jz .Lmap_done
+
+    mov ecx, 0
+.Lmap_p3:
+    mov eax, ecx
+    shl eax, 30
+    or eax, 0b110000011         /* present, writable, 1 GB, global */
+    mov [p3_table + ecx * 8], eax
+    inc ecx
+    cmp ecx, 4
+    jne .Lmap_p3
+
+.Lmap_done:
     ret
 
 
@@ -1485,8 +1545,12 @@ start64:
     mov rsi, [multiboot_info_ptr]
     mov edx, [selected_item]
 
+    /* Jump to the higher half: kmain and everything after it are linked at
+     * KERNEL_VMA and run on the high kernel stack. */
+    mov rsp, offset kernel_stack_top
     .extern kmain
-    call kmain
+    mov rax, offset kmain
+    call rax
 
     cli
     hlt
@@ -25,6 +25,7 @@
  */
 
 #include <kernel/drivers/acpi/acpi.h>
+#include <kernel/mmu.h>
 #include <kernel/multiboot2.h>
 #include <kernel/panic.h>
 #include <lib/com1.h>
@@ -106,7 +107,7 @@ static int validate_rsdp(acpi_rsdp_v1_t *rsdp) {
  */
 static acpi_rsdp_v1_t *scan_for_rsdp(u64 start, u64 end) {
   for (u64 addr = start; addr < end; addr += 16) {
-    acpi_rsdp_v1_t *candidate = (acpi_rsdp_v1_t *)addr;
+    acpi_rsdp_v1_t *candidate = phys_to_virt(addr);
     if (validate_rsdp(candidate) == 0) {
       return candidate;
     }
@@ -121,7 +122,7 @@ static acpi_rsdp_v1_t *scan_for_rsdp(u64 start, u64 end) {
  */
 static acpi_rsdp_v1_t *find_rsdp_bios(void) {
   /* Try EBDA first: segment stored at 0x040E */
-  u16 ebda_seg = *(u16 *)0x040E;
+  u16 ebda_seg = *(u16 *)phys_to_virt(0x040E);
   u64 ebda_addr = (u64)ebda_seg << 4;
   if (ebda_addr) {
     acpi_rsdp_v1_t *rsdp = scan_for_rsdp(ebda_addr, ebda_addr + 1024);
@@ -148,7 +149,7 @@ static void parse_rsdt(acpi_rsdt_t *rsdt) {
   com1_printf("[ACPI] RSDT has %u entries\n", num_entries);
 
   for (u32 i = 0; i < num_entries; i++) {
-    acpi_sdt_header_t *sdt = (acpi_sdt_header_t *)(u64)rsdt->entries[i];
+    acpi_sdt_header_t *sdt = phys_to_virt(rsdt->entries[i]);
     if (!sdt)
       continue;
 
@@ -178,7 +179,7 @@ static void parse_xsdt(acpi_xsdt_t *xsdt) {
   com1_printf("[ACPI] XSDT has %u entries\n", num_entries);
 
   for (u32 i = 0; i < num_entries; i++) {
-    acpi_sdt_header_t *sdt = (acpi_sdt_header_t *)xsdt->entries[i];
+    acpi_sdt_header_t *sdt = phys_to_virt(xsdt->entries[i]);
     if (!sdt)
       continue;
 
@@ -213,19 +214,19 @@ int acpi_init_from_rsdp(void *rsdp_ptr) {
     /* ACPI 2.0+ — prefer XSDT */
     acpi_rsdp_v2_t *rsdp2 = (acpi_rsdp_v2_t *)rsdp;
     if (rsdp2->xsdt_address) {
-      g_xsdt = (acpi_xsdt_t *)rsdp2->xsdt_address;
+      g_xsdt = phys_to_virt(rsdp2->xsdt_address);
       com1_printf("[ACPI] using XSDT at %p\n", (void *)rsdp2->xsdt_address);
       parse_xsdt(g_xsdt);
     } else {
       /* Fall back to RSDT */
-      g_rsdt = (acpi_rsdt_t *)(u64)rsdp->rsdt_address;
+      g_rsdt = phys_to_virt(rsdp->rsdt_address);
       com1_printf("[ACPI] XSDT null, using RSDT at %p\n",
                   (void *)(u64)rsdp->rsdt_address);
       parse_rsdt(g_rsdt);
     }
   } else {
     /* ACPI 1.0 — only RSDT */
-    g_rsdt = (acpi_rsdt_t *)(u64)rsdp->rsdt_address;
+    g_rsdt = phys_to_virt(rsdp->rsdt_address);
     com1_printf("[ACPI] using RSDT at %p\n", (void *)(u64)rsdp->rsdt_address);
     parse_rsdt(g_rsdt);
   }
@@ -285,7 +286,7 @@ acpi_sdt_header_t *acpi_find_table(const char *signature) {
   if (g_xsdt) {
     u32 n = (g_xsdt->header.length - sizeof(acpi_sdt_header_t)) / 8;
     for (u32 i = 0; i < n; i++) {
-      acpi_sdt_header_t *sdt = (acpi_sdt_header_t *)g_xsdt->entries[i];
+      acpi_sdt_header_t *sdt = phys_to_virt(g_xsdt->entries[i]);
       if (sdt && sig_match(sdt->signature, signature)) {
         return sdt;
       }
@@ -293,7 +294,7 @@ acpi_sdt_header_t *acpi_find_table(const char *signature) {
   } else if (g_rsdt) {
     u32 n = (g_rsdt->header.length - sizeof(acpi_sdt_header_t)) / 4;
     for (u32 i = 0; i < n; i++) {
-      acpi_sdt_header_t *sdt = (acpi_sdt_header_t *)(u64)g_rsdt->entries[i];
+      acpi_sdt_header_t *sdt = phys_to_virt(g_rsdt->entries[i]);
       if (sdt && sig_match(sdt->signature, signature)) {
         return sdt;
       }
@@ -75,3 +75,35 @@ void disk_write(disk_t *disk, u32 lba, u8 *buffer) {
     disk->write_sector(disk, lba, buffer);
   }
 }
+
+int disk_read_sectors(disk_t *disk, u32 lba, u32 count, u8 *buffer) {
+  if (!disk || lba + count > disk->total_sectors) {
+    return -1;
+  }
+  if (disk->read_sectors) {
+    return disk->read_sectors(disk, lba, count, buffer);
+  }
+  if (!disk->read_sector) {
+    return -1;
+  }
+  for (u32 i = 0; i < count; i++) {
+    disk->read_sector(disk, lba + i, buffer + i * disk->sector_size);
+  }
+  return 0;
+}
+
+int disk_write_sectors(disk_t *disk, u32 lba, u32 count, u8 *buffer) {
+  if (!disk || lba + count > disk->total_sectors) {
+    return -1;
+  }
+  if (disk->write_sectors) {
+    return disk->write_sectors(disk, lba, count, buffer);
+  }
+  if (!disk->write_sector) {
+    return -1;
+  }
+  for (u32 i = 0; i < count; i++) {
+    disk->write_sector(disk, lba + i, buffer + i * disk->sector_size);
+  }
+  return 0;
+}
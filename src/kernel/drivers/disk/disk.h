@@ -19,6 +19,10 @@ typedef struct disk {
 
   void (*read_sector)(struct disk *self, u32 lba, u8 *buffer);
   void (*write_sector)(struct disk *self, u32 lba, u8 *buffer);
+  /* Optional: count consecutive sectors in one command, 0 or -1 on error.
+   * Left NULL, disk_read_sectors/disk_write_sectors loop over one sector. */
+  int (*read_sectors)(struct disk *self, u32 lba, u32 count, u8 *buffer);
+  int (*write_sectors)(struct disk *self, u32 lba, u32 count, u8 *buffer);
 } disk_t;
 
 void disk_manager_init(void);
@@ -29,5 +33,7 @@ int disk_count(void);
 
 void disk_read(disk_t *disk, u32 lba, u8 *buffer);
 void disk_write(disk_t *disk, u32 lba, u8 *buffer);
+int disk_read_sectors(disk_t *disk, u32 lba, u32 count, u8 *buffer);
+int disk_write_sectors(disk_t *disk, u32 lba, u32 count, u8 *buffer);
 
 #endif
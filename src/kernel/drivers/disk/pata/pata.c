@@ -165,9 +165,15 @@ void pata_identify(unsigned short *target_buf) {
 
   void pata_disk_read(struct disk * self, u32 lba, u8 * buffer);
   void pata_disk_write(struct disk * self, u32 lba, u8 * buffer);
+  int pata_disk_read_sectors(struct disk * self, u32 lba, u32 count,
+                             u8 * buffer);
+  int pata_disk_write_sectors(struct disk * self, u32 lba, u32 count,
+                              u8 * buffer);
 
   pata_disk.read_sector = pata_disk_read;
   pata_disk.write_sector = pata_disk_write;
+  pata_disk.read_sectors = pata_disk_read_sectors;
+  pata_disk.write_sectors = pata_disk_write_sectors;
 
   int i = 0;
   const char *name = "pata0";
@@ -190,6 +196,86 @@ void pata_disk_write(struct disk *self, u32 lba, u8 *buffer) {
   pata_write_sector(lba, buffer);
 }
 
+int pata_disk_read_sectors(struct disk *self, u32 lba, u32 count,
+                           u8 *buffer) {
+  while (count) {
+    u32 chunk = count > PATA_MAX_SECTORS ? PATA_MAX_SECTORS : count;
+    if (pata_read_sectors(lba, chunk, buffer) != 0) {
+      return -1;
+    }
+    lba += chunk;
+    count -= chunk;
+    buffer += chunk * 512;
+  }
+  return 0;
+}
+
+int pata_disk_write_sectors(struct disk *self, u32 lba, u32 count,
+                            u8 *buffer) {
+  while (count) {
+    u32 chunk = count > PATA_MAX_SECTORS ? PATA_MAX_SECTORS : count;
+    if (pata_write_sectors(lba, chunk, buffer) != 0) {
+      return -1;
+    }
+    lba += chunk;
+    count -= chunk;
+    buffer += chunk * 512;
+  }
+  return 0;
+}
+
+static void pata_select(unsigned int lba, unsigned int count) {
+  outb(IDE_DRIVE_SEL, 0xE0 | ((lba >> 24) & 0x0F));
+  outb(IDE_FEATURES, 0x00);
+  outb(IDE_SEC_COUNT, (unsigned char)count); /* 0 means 256 */
+  outb(IDE_LBA_LOW, (unsigned char)lba);
+  outb(IDE_LBA_MID, (unsigned char)(lba >> 8));
+  outb(IDE_LBA_HIGH, (unsigned char)(lba >> 16));
+}
+
+/* One READ SECTORS command for count sectors; the drive raises DRQ once per
+ * sector. */
+int pata_read_sectors(unsigned int lba, unsigned int count,
+                      unsigned char *buffer) {
+  if (count == 0 || count > PATA_MAX_SECTORS ||
+      pata_wait_not_bsy(1000000) != 0) {
+    return -1;
+  }
+
+  pata_select(lba, count);
+  outb(IDE_COMMAND, IDE_CMD_READ);
+
+  for (unsigned int i = 0; i < count; i++) {
+    if (pata_wait_not_bsy(1000000) != 0 || pata_wait_drq(1000000) != 0) {
+      return -1;
+    }
+    insw(IDE_DATA, buffer + i * 512, 256);
+  }
+  return 0;
+}
+
+/* One WRITE SECTORS command and a single cache flush for count sectors. */
+int pata_write_sectors(unsigned int lba, unsigned int count,
+                       unsigned char *buffer) {
+  if (count == 0 || count > PATA_MAX_SECTORS ||
+      pata_wait_not_bsy(1000000) != 0) {
+    return -1;
+  }
+
+  pata_select(lba, count);
+  outb(IDE_COMMAND, IDE_CMD_WRITE);
+
+  for (unsigned int i = 0; i < count; i++) {
+    if (pata_wait_not_bsy(1000000) != 0 || pata_wait_drq(1000000) != 0) {
+      return -1;
+    }
+    outsw(IDE_DATA, buffer + i * 512, 256);
+  }
+
+  outb(IDE_COMMAND, 0xE7);
+  return pata_wait_not_bsy(1000000);
+}
+
 void pata_read_sector(unsigned int lba, unsigned char *buffer) {
   if (pata_wait_not_bsy(1000000) != 0) {
     if (buffer) {
@@ -47,8 +47,14 @@
 #define IDE_STATUS_DRQ 0x08 // Data Request
 #define IDE_STATUS_ERR 0x01 // Error
 
+#define PATA_MAX_SECTORS 256 // per READ/WRITE SECTORS command
+
 void pata_read_sector(unsigned int lba, unsigned char *buffer);
 void pata_write_sector(unsigned int lba, unsigned char *buffer);
+int pata_read_sectors(unsigned int lba, unsigned int count,
+                      unsigned char *buffer);
+int pata_write_sectors(unsigned int lba, unsigned int count,
+                       unsigned char *buffer);
 void pata_identify(unsigned short *target_buf);
 
 #endif
@@ -57,6 +57,26 @@ static void ramdisk_write_sector(disk_t *self, u32 lba, u8 *buffer) {
   memcpy(ram_start + offset, buffer, self->sector_size);
 }
 
+static int ramdisk_read_sectors(disk_t *self, u32 lba, u32 count,
+                                u8 *buffer) {
+  if (!self->private_data || lba + count > self->total_sectors) {
+    return -1;
+  }
+  memcpy(buffer, (u8 *)self->private_data + lba * self->sector_size,
+         count * self->sector_size);
+  return 0;
+}
+
+static int ramdisk_write_sectors(disk_t *self, u32 lba, u32 count,
+                                 u8 *buffer) {
+  if (!self->private_data || lba + count > self->total_sectors) {
+    return -1;
+  }
+  memcpy((u8 *)self->private_data + lba * self->sector_size, buffer,
+         count * self->sector_size);
+  return 0;
+}
+
 static disk_t ram_disk;
 
 void ramdisk_init(void *location, u32 size) {
@@ -69,6 +89,8 @@ void ramdisk_init(void *location, u32 size) {
   ram_disk.private_data = location;
   ram_disk.read_sector = ramdisk_read_sector;
   ram_disk.write_sector = ramdisk_write_sector;
+  ram_disk.read_sectors = ramdisk_read_sectors;
+  ram_disk.write_sectors = ramdisk_write_sectors;
 
   disk_register(&ram_disk);
 }
@@ -26,11 +26,17 @@
 
 #include <kernel/drivers/fs/chainFS/chainfs.h>
 #include <kernel/mmu.h>
+#include <kernel/vmalloc.h>
+#include <mlibc/arena.h>
 
 chainfs_t g_chainfs;
 u64 g_chainfs_phys = 0;
 #define ENTRIES_PER_BLOCK (CHAINFS_BLOCK_SIZE / sizeof(chainfs_file_entry_t))
 
+// Scratch for path components, reset after every lookup. Its first page
+// stays allocated, so resolving a path does not touch the page allocator.
+static arena_t chainfs_path_arena;
+
 int chainfs_init(disk_t *disk) {
   if (!disk) {
     com1_printf("ChainFS: init failed, disk is NULL\n");
@@ -471,7 +477,8 @@ int chainfs_write_file(const char *filename, const u8 *data, u32 size) {
     blocks_needed = 1;
   }
 
-  u32 *allocated_blocks = (u32 *)kmalloc(blocks_needed * sizeof(u32));
+  u32 *allocated_blocks =
+      (u32 *)kvmalloc(blocks_needed * sizeof(u32), KMEM_TAG_FS);
   if (!allocated_blocks) {
     com1_printf("ChainFS: Memory allocation failed\n");
     return -1;
@@ -479,7 +486,7 @@ int chainfs_write_file(const char *filename, const u8 *data, u32 size) {
 
   if (chainfs_find_free_blocks(blocks_needed, allocated_blocks) != 0) {
     com1_printf("ChainFS: Not enough free blocks\n");
-    kfree(allocated_blocks);
+    kvfree(allocated_blocks);
     return -1;
   }
 
@@ -535,7 +542,7 @@ int chainfs_write_file(const char *filename, const u8 *data, u32 size) {
 
   disk_write(g_chainfs.disk, entry_block, g_chainfs.sector_buffer);
 
-  kfree(allocated_blocks);
+  kvfree(allocated_blocks);
 
   com1_printf("ChainFS: Wrote %u bytes to '%s' using %u blocks\n", size,
               filename, blocks_needed);
@@ -587,32 +594,39 @@ static int read_entry_by_index(u32 index, chainfs_file_entry_t *entry,
   return 0;
 }
 
-// Helper function to split path into components
-static int split_path(const char *path, char components[][32],
-                      int max_components) {
+// Helper function to split path into components allocated from arena
+static int split_path(arena_t *arena, const char *path, char ***out) {
   int count = 0;
   int start = 0;
   int len = strlen(path);
 
+  // A component takes at least one character and a separator
+  char **components =
+      (char **)arena_alloc(arena, (len / 2 + 1) * sizeof(char *));
+  if (!components) {
+    return -1;
+  }
+
   // Skip leading slash
   if (len > 0 && path[0] == '/') {
     start = 1;
   }
 
-  for (int i = start; i <= len && count < max_components; i++) {
+  for (int i = start; i <= len; i++) {
     if (path[i] == '/' || path[i] == 0) {
       int comp_len = i - start;
       if (comp_len > 0 && comp_len < 31) {
-        for (int j = 0; j < comp_len; j++) {
-          components[count][j] = path[start + j];
+        components[count] = arena_strndup(arena, path + start, comp_len);
+        if (!components[count]) {
+          return -1;
         }
-        components[count][comp_len] = 0;
         count++;
       }
       start = i + 1;
     }
   }
 
+  *out = components;
   return count;
 }
 
@@ -642,12 +656,9 @@ int chainfs_find_in_directory(u32 dir_block, const char *name,
   return -1;
 }
 
-// Resolve full path to file/directory entry
-int chainfs_resolve_path(const char *path, chainfs_file_entry_t *entry,
-                         u32 *entry_block, u32 *entry_offset) {
-  char components[16][32];
-  int comp_count = split_path(path, components, 16);
-
+static int resolve_components(const char *path, char **components,
+                              int comp_count, chainfs_file_entry_t *entry,
+                              u32 *entry_block, u32 *entry_offset) {
   // Start from root or current directory
   u32 current_block = (path[0] == '/') ? g_chainfs.superblock.root_dir_block
                                        : g_chainfs.current_dir_block;
@@ -694,6 +705,20 @@ int chainfs_resolve_path(const char *path, chainfs_file_entry_t *entry,
   return -1;
 }
 
+// Resolve full path to file/directory entry
+int chainfs_resolve_path(const char *path, chainfs_file_entry_t *entry,
+                         u32 *entry_block, u32 *entry_offset) {
+  char **components = NULL;
+  int comp_count = split_path(&chainfs_path_arena, path, &components);
+  int result = -1;
+  if (comp_count >= 0) {
+    result = resolve_components(path, components, comp_count, entry,
+                                entry_block, entry_offset);
+  }
+  arena_reset(&chainfs_path_arena);
+  return result;
+}
+
 // Create directory
 int chainfs_mkdir(const char *path) {
   if (g_chainfs.superblock.magic != CHAINFS_MAGIC) {
@@ -27,6 +27,7 @@
 #include <kernel/drivers/keyboard/keyboard.h>
 #include <kernel/drivers/keyboard/ps2.h>
 #include <kernel/kshell/kshell.h>
+#include <kernel/pmm.h>
 #include <lib/com1.h>
 #include <mlibc/mlibc.h>
 
@@ -96,6 +97,7 @@ char keyboard_getchar_blocking() {
     if (kshell_try_open_if_requested()) {
       continue;
     }
+    pmm_zero_pool_refill();
     __asm__ volatile("hlt");
   }
   return c;
@@ -35,6 +35,7 @@
 #include <kernel/drivers/acpi/acpi.h>
 #include <kernel/drivers/power/pbutton.h>
 #include <kernel/drivers/power/power.h>
+#include <kernel/mmu.h>
 #include <kernel/panic.h>
 #include <lib/com1.h>
 #include <mlibc/mlibc.h>
@@ -85,7 +86,7 @@ static int parse_s5_from_dsdt(acpi_fadt_t *fadt) {
     return -1;
   }
 
-  acpi_sdt_header_t *dsdt = (acpi_sdt_header_t *)dsdt_addr;
+  acpi_sdt_header_t *dsdt = phys_to_virt(dsdt_addr);
 
   /* Validate DSDT signature */
   if (dsdt->signature[0] != 'D' || dsdt->signature[1] != 'S' ||
@@ -246,7 +247,7 @@ void power_reboot(void) {
       } else if (fadt->reset_reg.address_space == ACPI_GAS_SYSTEM_MEMORY) {
         com1_printf("[POWER] ACPI reset via MMIO 0x%x = 0x%x\n",
                     (u32)fadt->reset_reg.address, fadt->reset_value);
-        volatile u8 *reg = (volatile u8 *)fadt->reset_reg.address;
+        volatile u8 *reg = phys_to_virt(fadt->reset_reg.address);
         *reg = fadt->reset_value;
       }
 
@@ -28,6 +28,7 @@
 #include <kernel/drivers/tty.h>
 #include <kernel/drivers/vga.h>
 #include <kernel/drivers/video/drm/frontend.h>
+#include <kernel/pmm.h>
 #include <lib/com1.h>
 #include <mlibc/memory.h>
 #include <mlibc/mlibc.h>
@@ -391,7 +392,8 @@ void tty_init(void) {
     ttys[i].ansi_state = 0;
     ttys[i].ansi_val = 0;
     ttys[i].cells =
-        (u16 *)kcalloc((unsigned long)(width * height), sizeof(u16));
+        (u16 *)kcalloc_tagged((unsigned long)(width * height), sizeof(u16),
+                              KMEM_TAG_TTY);
     if (ttys[i].cells) {
       u16 blank = ((u16)ttys[i].color << 8) | ' ';
       for (int j = 0; j < width * height; j++) {
@@ -478,6 +480,7 @@ static char tty_getchar_blocking(int tty_idx) {
       tty_update();
       return c;
     }
+    pmm_zero_pool_refill();
     __asm__ volatile("hlt");
   }
 }
@@ -27,10 +27,11 @@
 #include <kernel/drivers/tty.h>
 #include <kernel/drivers/vga.h>
 #include <kernel/drivers/video/drm/frontend.h>
+#include <kernel/mmu.h>
 #include <mlibc/mlibc.h>
 #include <stdarg.h>
 
-static u16 *vga_buffer = (u16 *)0xB8000;
+static u16 *vga_buffer = (u16 *)(KERNEL_DIRECT_MAP_BASE + 0xB8000);
 static int cursor_x = 0;
 static int cursor_y = 0;
 static u8 terminal_color = 0x07;
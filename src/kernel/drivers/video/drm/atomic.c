@@ -1,7 +1,12 @@
 #include <kernel/drivers/video/drm/atomic.h>
+#include <kernel/mmu.h>
+#include <kernel/pmm.h>
+#include <kernel/vmalloc.h>
 #include <lib/com1.h>
 #include <mlibc/memory.h>
 
+#define DRM_PAGE_SIZE 4096ULL
+
 static int g_enabled = 0;
 static int g_pending_active = 0;
 static int g_dirty = 0;
@@ -13,6 +18,48 @@ static drm_framebuffer_t g_hw_fb;
 static drm_framebuffer_t g_shadow_fb;
 static drm_atomic_state_t g_current;
 static drm_atomic_state_t g_pending;
+static u64 g_shadow_frames = 0;
+
+/* Shadow buffers up to 4 MB come from the buddy allocator as one contiguous
+ * block, split so the frames past the end go straight back; larger ones are
+ * mapped from single frames by vmalloc. Returns the buffer and sets
+ * *out_frames to the frames kept, or to 0 when it came from vmalloc. */
+static u8 *drm_shadow_alloc(u64 bytes, u64 *out_frames) {
+  *out_frames = 0;
+  if (pmm_is_initialized()) {
+    u64 frames = (bytes + DRM_PAGE_SIZE - 1) / DRM_PAGE_SIZE;
+    u32 order = 0;
+    while (order < PMM_MAX_ORDER && (1ULL << order) < frames) {
+      order++;
+    }
+    u64 block = (1ULL << order) >= frames ? alloc_pages(order) : 0;
+    if (block) {
+      split_pages(block);
+      for (u64 i = frames; i < (1ULL << order); i++) {
+        free_pages(block + i * DRM_PAGE_SIZE, 0);
+      }
+      u8 *mem = phys_to_virt(block);
+      memset(mem, 0, (unsigned long)(frames * DRM_PAGE_SIZE));
+      *out_frames = frames;
+      return mem;
+    }
+  }
+  return (u8 *)kvzalloc((unsigned long)bytes, KMEM_TAG_VIDEO);
+}
+
+static void drm_shadow_free(u8 *mem, u64 frames) {
+  if (!mem) {
+    return;
+  }
+  if (frames) {
+    u64 base = virt_to_phys(mem);
+    for (u64 i = 0; i < frames; i++) {
+      free_pages(base + i * DRM_PAGE_SIZE, 0);
+    }
+  } else {
+    kvfree(mem);
+  }
+}
 
 static void drm_reset_dirty_state(void) {
   g_dirty = 0;
@@ -107,7 +154,8 @@ int drm_atomic_init(const drm_driver_t *driver, const drm_boot_display_t *boot)
   }
 
   u64 shadow_bytes = (u64)new_hw_fb.pitch * (u64)new_hw_fb.height;
-  u8 *new_shadow_mem = (u8 *)kcalloc((unsigned long)shadow_bytes, 1);
+  u64 new_shadow_frames = 0;
+  u8 *new_shadow_mem = drm_shadow_alloc(shadow_bytes, &new_shadow_frames);
   if (!new_shadow_mem) {
     com1_write_string("[DRM] shadow fb alloc failed\n");
     return -1;
@@ -141,14 +189,13 @@ int drm_atomic_init(const drm_driver_t *driver, const drm_boot_display_t *boot)
   };
 
   if (driver->present(&new_shadow_fb, &new_hw_fb) != 0) {
-    kfree(new_shadow_mem);
+    drm_shadow_free(new_shadow_mem, new_shadow_frames);
     com1_write_string("[DRM] initial present failed\n");
     return -1;
   }
 
-  if (g_shadow_fb.data) {
-    kfree(g_shadow_fb.data);
-  }
+  drm_shadow_free(g_shadow_fb.data, g_shadow_frames);
+  g_shadow_frames = new_shadow_frames;
 
   g_driver = driver;
   g_hw_fb = new_hw_fb;
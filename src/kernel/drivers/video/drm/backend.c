@@ -1,4 +1,5 @@
 #include <kernel/drivers/video/drm/backend.h>
+#include <kernel/mmu.h>
 #include <mlibc/memory.h>
 
 static int fbdev_probe(const drm_boot_display_t *boot) {
@@ -21,7 +22,7 @@ static int fbdev_init(const drm_boot_display_t *boot, drm_framebuffer_t *out_hw_
   out_hw_fb->height = boot->height;
   out_hw_fb->pitch = boot->pitch;
   out_hw_fb->bpp = boot->bpp;
-  out_hw_fb->data = (u8 *)boot->hw_address;
+  out_hw_fb->data = (u8 *)phys_to_virt(boot->hw_address);
   out_hw_fb->hw_address = boot->hw_address;
 
   return 0;
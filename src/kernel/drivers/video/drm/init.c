@@ -1,20 +1,15 @@
 #include <kernel/drivers/video/drm/atomic.h>
 #include <kernel/drivers/video/drm/driver.h>
 #include <kernel/drivers/video/drm/init.h>
+#include <kernel/mmu.h>
 #include <lib/com1.h>
 
-#define PAGE_SIZE 4096
-
 static void drm_map_hw_buffer(const drm_boot_display_t *boot) {
   u64 fb_size = (u64)boot->pitch * (u64)boot->height;
   u64 fb_pages = (fb_size + PAGE_SIZE - 1) / PAGE_SIZE;
 
-  extern void mmu_map_page(u64 vaddr, u64 paddr, u64 flags);
-
-  for (u64 i = 0; i < fb_pages; i++) {
-    mmu_map_page(boot->hw_address + i * PAGE_SIZE,
-                 boot->hw_address + i * PAGE_SIZE, 0x3);
-  }
+  mmu_map_range((u64)phys_to_virt(boot->hw_address), boot->hw_address,
+                fb_pages * PAGE_SIZE, 0x3);
 }
 
 static drm_boot_display_t g_boot_display;
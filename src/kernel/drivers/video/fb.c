@@ -26,9 +26,9 @@
 
 #include <kernel/drivers/video/drm/atomic.h>
 #include <kernel/drivers/video/fb.h>
+#include <kernel/mmu.h>
 #include <lib/com1.h>
 
-#define PAGE_SIZE 4096
 
 static u32 *framebuffer = 0;
 static u32 pitch = 0;
@@ -107,20 +107,16 @@ void fb_batch_end(void) { fb_atomic_end_if_needed(); }
 void fb_flush(void) { fb_maybe_commit(1); }
 
 static void fb_map_hw_buffer(void) {
-  u64 fb_addr = (u64)framebuffer;
   u64 fb_size = (u64)pitch * height;
   u64 fb_pages = (fb_size + PAGE_SIZE - 1) / PAGE_SIZE;
 
-  extern void mmu_map_page(u64 vaddr, u64 paddr, u64 flags);
-
-  for (u64 i = 0; i < fb_pages; i++) {
-    mmu_map_page(fb_addr + i * PAGE_SIZE, fb_addr + i * PAGE_SIZE, 0x3);
-  }
+  mmu_map_range((u64)framebuffer, virt_to_phys(framebuffer),
+                fb_pages * PAGE_SIZE, 0x3);
 }
 
 static void fb_init_common(u64 addr, u32 fb_pitch, u32 fb_width, u32 fb_height,
                            u8 fb_bpp) {
-  framebuffer = (u32 *)addr;
+  framebuffer = (u32 *)phys_to_virt(addr);
   pitch = fb_pitch;
   width = fb_width;
   height = fb_height;
@@ -292,7 +288,7 @@ u64 fb_get_address() {
   if (drm_atomic_is_ready()) {
     return drm_atomic_get_hw_address();
   }
-  return (u64)framebuffer;
+  return framebuffer ? virt_to_phys(framebuffer) : 0;
 }
 
 void fb_scroll(int lines) {
@@ -56,9 +56,8 @@ static void i6300esb_mmio_map(u64 base, u64 size) {
   u64 start = base & ~(PAGE_SIZE - 1);
   u64 end = (base + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 
-  for (u64 addr = start; addr < end; addr += PAGE_SIZE) {
-    mmu_map_page(addr, addr, PTE_RW | PTE_PCD | PTE_PWT);
-  }
+  mmu_map_range((u64)phys_to_virt(start), start, end - start,
+                PTE_RW | PTE_PCD | PTE_PWT);
 }
 
 static void i6300esb_write(i6300esb_priv_t *priv, u16 offset, u32 value) {
@@ -166,7 +165,7 @@ static int i6300esb_probe(pci_device_t *dev, const pci_match_t *match) {
   } else {
     pci_enable_memory_space(dev);
     i6300esb_priv.use_mmio = 1;
-    i6300esb_priv.mmio_base = (volatile u32 *)(u64)bar0.base;
+    i6300esb_priv.mmio_base = phys_to_virt(bar0.base);
     i6300esb_priv.mmio_size = bar0.size;
     i6300esb_mmio_map(bar0.base, bar0.size);
   }
@@ -31,6 +31,8 @@
 #include <kernel/drivers/vga.h>
 #include <kernel/drivers/watchdog/watchdog.h>
 #include <kernel/interrupts/idt.h>
+#include <kernel/kguard.h>
+#include <kernel/ksm.h>
 #include <kernel/mmu.h>
 #include <kernel/scheduler.h>
 #include <mlibc/mlibc.h>
@@ -43,9 +45,40 @@ extern void pic_send_eoi(unsigned char irq);
 #include <kernel/process.h>
 #include <lib/com1.h>
 
+/* Not-present faults may hit a lazily populated mmap region, and write
+ * faults on present pages may be copy-on-write. Either way, from user mode
+ * or from a syscall touching user memory, the page is filled in and the
+ * access retried. */
+static int handle_page_fault(registers_t *regs) {
+  u64 cr2 = 0;
+  __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+  if (!(regs->err_code & 1)) {
+    return mmap_handle_fault(cr2, regs->err_code);
+  }
+  if ((regs->err_code & 3) != 3) {
+    return -1;
+  }
+
+  int zero = (mmu_virt_to_phys(cr2) & PTE_ADDR_MASK) == mmu_zero_page();
+  if (mmu_handle_cow_fault(cr2) != 0) {
+    return -1;
+  }
+  process_t *proc = process_current();
+  if (proc) {
+    if (zero) {
+      proc->faults.demand_zero++;
+    } else {
+      proc->faults.cow++;
+    }
+  }
+  return 0;
+}
+
 void isr_handler(registers_t *regs) {
   if (regs->int_no == 128) {
     syscall_handler(regs);
+  } else if (regs->int_no == 14 && handle_page_fault(regs) == 0) {
+    return;
   } else {
     if ((regs->cs & 3) == 3) {
       process_t *proc = process_current();
@@ -89,23 +122,52 @@ void isr_handler(registers_t *regs) {
       __asm__ volatile("sti");
       process_exit(-1);
     } else {
+      if (regs->int_no == 14) {
+        u64 cr2 = 0;
+        __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+        kguard_report_fault(cr2, regs->err_code);
+
+        /* A syscall writing to a read-only user page (now that CR0.WP is
+         * set) is the process's fault, not the kernel's. */
+        process_t *proc = process_current();
+        if ((regs->err_code & 1) && proc &&
+            process_vm_owner(proc)->owns_address_space &&
+            (mmu_get_pte_flags(cr2) & PTE_USER)) {
+          com1_printf("[KERNEL] Process %d (%s): bad user access at %p "
+                      "from RIP=%p\n",
+                      (int)proc->pid, proc->name, (void *)cr2,
+                      (void *)regs->rip);
+          __asm__ volatile("sti");
+          process_exit(-1);
+        }
+      }
       __asm__ volatile("sti");
       kernel_panic(regs);
     }
   }
 }
 
+static volatile int irq_depth = 0;
+
+int in_irq(void) { return irq_depth; }
+
 void irq_handler(registers_t *regs) {
+  irq_depth++;
   if (regs->int_no == 32) {
     timer_handler();
     power_button_poll();
     watchdog_tick();
+    /* Only between user instructions: the kernel is never mid-update. */
+    if ((regs->cs & 3) == 3) {
+      ksm_tick();
+    }
     scheduler_tick(regs);
     keyboard_poll();
     tty_update();
   } else if (regs->int_no == 33) {
     keyboard_common_handler();
   }
+  irq_depth--;
 
   pic_send_eoi(regs->int_no - 32);
 }
@@ -28,6 +28,8 @@
 
 void init_idt();
 int idt_is_loaded(void);
+/* Nonzero while a hardware interrupt is being handled. */
+int in_irq(void);
 
 typedef struct {
   unsigned long long r15, r14, r13, r12, r11, r10, r9, r8;
@@ -39,14 +39,17 @@
 #include <kernel/drivers/video/fb.h>
 #include <kernel/drivers/watchdog/watchdog.h>
 #include <kernel/interrupts/idt.h>
+#include <kernel/kguard.h>
 #include <kernel/mmu.h>
 #include <kernel/multiboot.h>
 #include <kernel/multiboot2.h>
 #include <kernel/panic.h>
 #include <kernel/pci/pci.h>
+#include <kernel/pmm.h>
 #include <kernel/posix/posix.h>
 #include <kernel/kshell/kshell.h>
 #include <kernel/syscall.h>
+#include <kernel/vmalloc.h>
 #include <lib/com1.h>
 #include <mlibc/mlibc.h>
 #include <mlibc/stdlib.h>
@@ -55,8 +58,6 @@
 extern void cpuid_get(u32 code, u32 *res);
 extern void cinfo(char *buf);
 extern u64 rinfo(u64 mb_ptr);
-extern char start;
-extern char kernel_end;
 
 static u32 boot_magic = 0;
 static int is_multiboot2 = 0;
@@ -76,13 +77,13 @@ static void debug_multiboot_info(multiboot_info_t *mb_info) {
 
   if (mb_info->flags & MULTIBOOT_FLAG_CMDLINE) {
     com1_write_string("cmdline: ");
-    com1_write_string((const char *)(u64)mb_info->cmdline);
+    com1_write_string((const char *)phys_to_virt(mb_info->cmdline));
     com1_newline();
   }
 
   if (mb_info->flags & MULTIBOOT_FLAG_BOOTLOADER_NAME) {
     com1_write_string("bootloader: ");
-    com1_write_string((const char *)(u64)mb_info->boot_loader_name);
+    com1_write_string((const char *)phys_to_virt(mb_info->boot_loader_name));
     com1_newline();
   }
 
@@ -152,7 +153,7 @@ static int mb2_find_module(multiboot2_info_t *mb_info, const char *name,
       multiboot2_tag_module_t *mod = (multiboot2_tag_module_t *)tag;
       if (strcmp(mod->cmdline, name) == 0) {
         if (out_start) {
-          *out_start = (void *)(u64)mod->mod_start;
+          *out_start = phys_to_virt(mod->mod_start);
         }
         if (out_size) {
           *out_size = mod->mod_end - mod->mod_start;
@@ -292,9 +293,13 @@ void kmain(u64 magic, u64 addr, u64 boot_option) {
 
   // Create a 4MB ramdisk at 0x4000000 (ensure this doesn't overlap
   // kernel/bootstack)
-  ramdisk_init((void *)0x4000000, 4 * 1024 * 1024);
+  ramdisk_init(phys_to_virt(0x4000000), 4 * 1024 * 1024);
 
-  mmu_clear_user_range((u64)&start, (u64)&kernel_end);
+  pmm_reserve_range(0x4000000, 4 * 1024 * 1024);
+  pmm_init((u32)magic, addr);
+  kheap_enable_growth();
+  vmalloc_init();
+  kguard_init();
 
   boot_magic = (u32)magic;
 
@@ -304,7 +309,7 @@ void kmain(u64 magic, u64 addr, u64 boot_option) {
     com1_write_hex_dword(boot_magic);
     com1_write_string(")\n");
 
-    multiboot2_info_t *mboot_ptr = (multiboot2_info_t *)addr;
+    multiboot2_info_t *mboot_ptr = phys_to_virt(addr);
     debug_multiboot2_tags(mboot_ptr);
     drm_boot_init_mb2(mboot_ptr, 0);
     fb_init_mb2(mboot_ptr);
@@ -336,7 +341,7 @@ void kmain(u64 magic, u64 addr, u64 boot_option) {
     com1_write_hex_dword(boot_magic);
     com1_write_string(")\n");
 
-    multiboot_info_t *mboot_ptr = (multiboot_info_t *)addr;
+    multiboot_info_t *mboot_ptr = phys_to_virt(addr);
     debug_multiboot_info(mboot_ptr);
     drm_boot_init_mb1(mboot_ptr, 0);
     fb_init(mboot_ptr);
@@ -386,6 +391,7 @@ void kmain(u64 magic, u64 addr, u64 boot_option) {
   int idt_ok = idt_is_loaded();
   int timer_ok = timer_sanity_check();
   int mmu_ok = mmu_is_initialized() && mmu_read_cr3() != 0;
+  int pmm_ok = pmm_is_initialized() && pmm_free_frames() > 0;
   int syscall_ok = syscall_is_initialized();
   int disk_ok = disk_manager_is_initialized();
   int pata_ok = disk_has_type(DISK_TYPE_PATA);
@@ -401,6 +407,7 @@ void kmain(u64 magic, u64 addr, u64 boot_option) {
   status_line("idt", idt_ok);
   status_line("timer", timer_ok);
   status_line("mmu", mmu_ok);
+  status_line("pmm", pmm_ok);
   status_line("syscall", syscall_ok);
   status_line("disk manager", disk_ok);
   status_line("pata identify", pata_ok);
@@ -489,7 +496,7 @@ void kmain(u64 magic, u64 addr, u64 boot_option) {
     u32 fetch_module_size = 0;
 
     if (boot_magic == MULTIBOOT2_BOOTLOADER_MAGIC) {
-      multiboot2_info_t *mboot_ptr = (multiboot2_info_t *)addr;
+      multiboot2_info_t *mboot_ptr = phys_to_virt(addr);
       mb2_find_module(mboot_ptr, "init", &init_module_start, &init_module_size);
       mb2_find_module(mboot_ptr, "yes", &yes_module_start, &yes_module_size);
       mb2_find_module(mboot_ptr, "fetch", &fetch_module_start,
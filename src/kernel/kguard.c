@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <kernel/drivers/vga.h>
+#include <kernel/kguard.h>
+#include <kernel/mmu.h>
+#include <kernel/panic.h>
+#include <kernel/pmm.h>
+#include <lib/com1.h>
+
+/*
+ * Guard window: slot i owns the page at KGUARD_BASE + (2i + 1) pages and is
+ * surrounded by never-mapped guard pages. A sampled allocation gets a fresh
+ * frame in its slot, placed against the end of the page (or, every other
+ * time, the start) so running off it hits a guard page. The rest of the page
+ * is filled with KGUARD_PATTERN and checked on free, which catches overflows
+ * too small to reach the guard. Freeing unmaps the page right away, so a use
+ * after free traps as well, for as long as the slot is not reused.
+ */
+#define KGUARD_BASE 0xFFFFFE0000000000ULL
+#define KGUARD_WINDOW ((2 * KGUARD_SLOTS + 1) * PAGE_SIZE)
+#define KGUARD_PATTERN 0xCB
+
+enum { KGUARD_UNUSED = 0, KGUARD_LIVE, KGUARD_FREED };
+
+typedef struct {
+  u8 state;
+  u8 *ptr;
+  unsigned long size;
+  u64 frame;
+  void *alloc_site;
+  void *free_site;
+} kguard_slot_t;
+
+static kguard_slot_t kguard_slots[KGUARD_SLOTS];
+static kguard_stats_t kguard_stats;
+static int kguard_ready = 0;
+static u32 kguard_countdown = 0;
+static u32 kguard_cursor = 0;
+static u32 kguard_rng = 0x9E3779B9;
+static u32 kguard_flip = 0;
+
+int kguard_init(void) {
+  if (!pmm_is_initialized()) {
+    com1_printf("[KGUARD] Disabled: no frame allocator\n");
+    return -1;
+  }
+  if (mmu_share_kernel_region(KGUARD_BASE) != 0) {
+    com1_printf("[KGUARD] Disabled: cannot map window\n");
+    return -1;
+  }
+  kguard_stats.slots = KGUARD_SLOTS;
+  kguard_set_rate(KGUARD_DEFAULT_RATE);
+  kguard_ready = 1;
+  com1_printf("[KGUARD] %d slots at %p, sampling 1 in %d allocations\n",
+              KGUARD_SLOTS, (void *)KGUARD_BASE, KGUARD_DEFAULT_RATE);
+  return 0;
+}
+
+/* Next gap drawn from [1, 2 * rate) so the sampled sites do not lock onto a
+ * periodic allocation pattern. */
+static void kguard_rearm(void) {
+  u32 x = kguard_rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  kguard_rng = x;
+  kguard_countdown = kguard_stats.rate ? 1 + x % (2 * kguard_stats.rate) : 0;
+}
+
+void kguard_set_rate(u32 rate) {
+  kguard_stats.rate = rate;
+  kguard_rearm();
+}
+
+void kguard_get_stats(kguard_stats_t *out) { *out = kguard_stats; }
+
+static u64 kguard_slot_page(u32 slot) {
+  return KGUARD_BASE + (2 * (u64)slot + 1) * PAGE_SIZE;
+}
+
+/* Round robin from the last slot used, so a freed slot stays unmapped (and
+ * keeps catching use after free) for as long as possible. */
+static int kguard_pick_slot(void) {
+  for (u32 i = 0; i < KGUARD_SLOTS; i++) {
+    u32 slot = (kguard_cursor + i) % KGUARD_SLOTS;
+    if (kguard_slots[slot].state != KGUARD_LIVE) {
+      kguard_cursor = (slot + 1) % KGUARD_SLOTS;
+      return (int)slot;
+    }
+  }
+  return -1;
+}
+
+void *kguard_alloc(unsigned long size, void *site) {
+  if (!kguard_countdown || --kguard_countdown) {
+    return NULL;
+  }
+  kguard_rearm();
+  if (!kguard_ready) {
+    return NULL;
+  }
+
+  int slot = size && size <= PAGE_SIZE ? kguard_pick_slot() : -1;
+  u64 frame = slot >= 0 ? pmm_alloc_frame() : 0;
+  if (!frame) {
+    kguard_stats.skipped++;
+    return NULL;
+  }
+
+  u64 page = kguard_slot_page((u32)slot);
+  mmu_map_page(page, frame, PTE_PRESENT | PTE_RW | PTE_NX);
+  memset((void *)page, KGUARD_PATTERN, PAGE_SIZE);
+
+  /* Right-aligned objects keep the 16-byte alignment kmalloc promises, so
+   * the padding up to it is only covered by the pattern check. */
+  unsigned long offset = 0;
+  if (++kguard_flip & 1) {
+    offset = (PAGE_SIZE - size) & ~15UL;
+  }
+
+  kguard_slot_t *s = &kguard_slots[slot];
+  s->state = KGUARD_LIVE;
+  s->ptr = (u8 *)page + offset;
+  s->size = size;
+  s->frame = frame;
+  s->alloc_site = site;
+  s->free_site = NULL;
+  kguard_stats.live++;
+  kguard_stats.sampled++;
+  return s->ptr;
+}
+
+int is_kguard_addr(const void *addr) {
+  u64 va = (u64)addr;
+  return va >= KGUARD_BASE && va < KGUARD_BASE + KGUARD_WINDOW;
+}
+
+static kguard_slot_t *kguard_slot_of(const void *ptr) {
+  u64 index = ((u64)ptr - KGUARD_BASE) / PAGE_SIZE;
+  if ((index & 1) == 0) {
+    return NULL;
+  }
+  return &kguard_slots[index / 2];
+}
+
+void kguard_free(void *ptr, void *site) {
+  kguard_slot_t *s = kguard_slot_of(ptr);
+  if (!s || s->ptr != (u8 *)ptr || s->state == KGUARD_UNUSED) {
+    panic("KGUARD: invalid free of %p from %p", ptr, site);
+  }
+  if (s->state == KGUARD_FREED) {
+    panic("KGUARD: double free of %p (%d bytes) from %p, allocated at %p, "
+          "first freed at %p",
+          ptr, (int)s->size, site, s->alloc_site, s->free_site);
+  }
+
+  u8 *page = (u8 *)((u64)ptr & ~(u64)(PAGE_SIZE - 1));
+  for (u8 *p = page; p < page + PAGE_SIZE; p++) {
+    if ((p < s->ptr || p >= s->ptr + s->size) && *p != KGUARD_PATTERN) {
+      panic("KGUARD: %s of %p (%d bytes) at offset %d, allocated at %p, "
+            "freed at %p",
+            p < s->ptr ? "underflow" : "overflow", ptr, (int)s->size,
+            (int)(p - s->ptr), s->alloc_site, site);
+    }
+  }
+
+  mmu_unmap_page((u64)page);
+  pmm_free_frame(s->frame);
+  s->frame = 0;
+  s->state = KGUARD_FREED;
+  s->free_site = site;
+  kguard_stats.live--;
+}
+
+unsigned long kguard_size(const void *ptr) {
+  kguard_slot_t *s = kguard_slot_of(ptr);
+  return s && s->state == KGUARD_LIVE && s->ptr == (const u8 *)ptr ? s->size
+                                                                   : 0;
+}
+
+int kguard_slot(const void *ptr) {
+  kguard_slot_t *s = kguard_slot_of(ptr);
+  if (!s || s->state != KGUARD_LIVE || s->ptr != (const u8 *)ptr) {
+    return -1;
+  }
+  return (int)(s - kguard_slots);
+}
+
+static void kguard_report(const char *what, u64 addr, kguard_slot_t *s) {
+  long offset = (long)(addr - (u64)s->ptr);
+  com1_printf("[KGUARD] %s at %p: %d bytes %s %p (%d bytes)\n", what,
+              (void *)addr, (int)(offset < 0 ? -offset : offset),
+              offset < 0 ? "before" : "into", s->ptr, (int)s->size);
+  com1_printf("[KGUARD]   allocated at %p", s->alloc_site);
+  if (s->free_site) {
+    com1_printf(", freed at %p", s->free_site);
+  }
+  com1_printf("\n");
+  printf("[KGUARD] %s at %p, object %p allocated at %p\n", what, (void *)addr,
+         s->ptr, s->alloc_site);
+}
+
+int kguard_report_fault(u64 addr, u64 err_code) {
+  if (!kguard_ready || !is_kguard_addr((void *)addr)) {
+    return 0;
+  }
+
+  const char *access = (err_code & 2) ? "write" : "read";
+  com1_printf("[KGUARD] Faulting %s at %p\n", access, (void *)addr);
+
+  u64 index = (addr - KGUARD_BASE) / PAGE_SIZE;
+  if (index & 1) {
+    kguard_slot_t *s = &kguard_slots[index / 2];
+    kguard_report(s->state == KGUARD_FREED ? "use after free" : "wild access",
+                  addr, s);
+    return 1;
+  }
+
+  /* A guard page: blame the nearer of the objects on either side. */
+  kguard_slot_t *left = index ? &kguard_slots[index / 2 - 1] : NULL;
+  kguard_slot_t *right =
+      index / 2 < KGUARD_SLOTS ? &kguard_slots[index / 2] : NULL;
+  u64 left_gap = left && left->state != KGUARD_UNUSED
+                     ? addr - (u64)(left->ptr + left->size)
+                     : ~0ULL;
+  u64 right_gap = right && right->state != KGUARD_UNUSED
+                      ? (u64)right->ptr - addr
+                      : ~0ULL;
+  if (left_gap == ~0ULL && right_gap == ~0ULL) {
+    com1_printf("[KGUARD] Guard page hit with no slot nearby\n");
+    return 1;
+  }
+  if (left_gap <= right_gap) {
+    kguard_report("heap overflow", addr, left);
+  } else {
+    kguard_report("heap underflow", addr, right);
+  }
+  return 1;
+}
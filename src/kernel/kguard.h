@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef KGUARD_H
+#define KGUARD_H
+
+#include <mlibc/mlibc.h>
+
+/* One in KGUARD_DEFAULT_RATE kmalloc calls lands in a guarded slot. */
+#define KGUARD_DEFAULT_RATE 512
+#define KGUARD_SLOTS 64
+
+typedef struct {
+  u32 rate;    /* 1 in rate allocations is sampled, 0 = off */
+  u32 slots;   /* guarded slots in the window */
+  u32 live;    /* slots holding a live allocation */
+  u64 sampled; /* allocations placed in a slot */
+  u64 skipped; /* sampled, but too large or no slot free */
+} kguard_stats_t;
+
+int kguard_init(void);
+void kguard_set_rate(u32 rate);
+void kguard_get_stats(kguard_stats_t *out);
+
+/* Called by kmalloc for every small allocation. Returns NULL unless this one
+ * is sampled, which keeps the unsampled path to a countdown. */
+void *kguard_alloc(unsigned long size, void *site);
+int is_kguard_addr(const void *addr);
+void kguard_free(void *ptr, void *site);
+unsigned long kguard_size(const void *ptr);
+/* Slot holding the live sampled allocation ptr, or -1. */
+int kguard_slot(const void *ptr);
+
+/* Page fault hook for kernel-mode faults: explains a fault inside the guard
+ * window on COM1 and the console and returns 1, the caller still panics.
+ * Returns 0 for any other address. */
+int kguard_report_fault(u64 addr, u64 err_code);
+
+#endif
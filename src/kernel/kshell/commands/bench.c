@@ -0,0 +1,279 @@
+#include <kernel/drivers/timer.h>
+#include <kernel/kshell/kshell.h>
+#include <lib/com1.h>
+
+#define BENCH_DEFAULT_SLOTS 1024
+#define BENCH_MAX_SLOTS 4096
+#define BENCH_BATCH 64 /* ops timed together between fragmentation samples */
+#define BENCH_SEED 0x2545F491
+
+typedef struct {
+  void **slots;
+  u32 count;
+  u32 rng;
+  u64 cycles;
+  u64 ops;
+  u64 batch_start;
+  u32 batch_ops;
+  int frag_peak;
+  u64 failures;
+  u64 first_fail_op;
+  u64 first_fail_size;
+} bench_ctx_t;
+
+typedef struct {
+  const char *name;
+  void (*run)(bench_ctx_t *ctx);
+} bench_workload_t;
+
+static inline u64 bench_rdtsc(void) {
+  u32 lo, hi;
+  __asm__ volatile("lfence; rdtsc" : "=a"(lo), "=d"(hi));
+  return ((u64)hi << 32) | lo;
+}
+
+/* TSC cycles per microsecond, measured against the PIT. 0 if the timer is
+ * not ticking, in which case only cycles are reported. */
+static u64 bench_tsc_per_us(void) {
+  if (!timer_is_initialized() || timer_get_frequency() == 0) {
+    return 0;
+  }
+
+  u32 wait_ticks = timer_get_frequency() / 20;
+  if (wait_ticks == 0) {
+    wait_ticks = 1;
+  }
+
+  u64 start = timer_get_ticks();
+  u64 spins = 0;
+  while (timer_get_ticks() == start) {
+    if (++spins > 100000000ULL) {
+      return 0;
+    }
+    __asm__ volatile("pause");
+  }
+
+  u64 tick0 = timer_get_ticks();
+  u64 tsc0 = bench_rdtsc();
+  while (timer_get_ticks() < tick0 + wait_ticks) {
+    __asm__ volatile("pause");
+  }
+  u64 tsc1 = bench_rdtsc();
+
+  u64 us = ((u64)wait_ticks * 1000000ULL) / timer_get_frequency();
+  return us ? (tsc1 - tsc0) / us : 0;
+}
+
+static u32 bench_rand(bench_ctx_t *ctx) {
+  u32 x = ctx->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  ctx->rng = x;
+  return x;
+}
+
+static void bench_sample(bench_ctx_t *ctx) {
+  int frag = kheap_fragmentation(NULL, NULL);
+  if (frag > ctx->frag_peak) {
+    ctx->frag_peak = frag;
+  }
+}
+
+static void bench_op_done(bench_ctx_t *ctx) {
+  ctx->ops++;
+  if (++ctx->batch_ops == BENCH_BATCH) {
+    ctx->cycles += bench_rdtsc() - ctx->batch_start;
+    bench_sample(ctx);
+    ctx->batch_ops = 0;
+    ctx->batch_start = bench_rdtsc();
+  }
+}
+
+static void bench_alloc(bench_ctx_t *ctx, u32 slot, unsigned long size,
+                        unsigned long align) {
+  void *ptr = align ? kmalloc_aligned(size, align) : kmalloc(size);
+  if (!ptr && ctx->failures++ == 0) {
+    ctx->first_fail_op = ctx->ops;
+    ctx->first_fail_size = size;
+  }
+  ctx->slots[slot] = ptr;
+  bench_op_done(ctx);
+}
+
+static void bench_free(bench_ctx_t *ctx, u32 slot) {
+  if (!ctx->slots[slot]) {
+    return;
+  }
+  kfree(ctx->slots[slot]);
+  ctx->slots[slot] = NULL;
+  bench_op_done(ctx);
+}
+
+static void bench_free_all(bench_ctx_t *ctx) {
+  for (u32 i = 0; i < ctx->count; i++) {
+    bench_free(ctx, i);
+  }
+}
+
+/* Stack-like: everything allocated, then released newest first. */
+static void bench_lifo(bench_ctx_t *ctx) {
+  for (u32 i = 0; i < ctx->count; i++) {
+    bench_alloc(ctx, i, 32 + bench_rand(ctx) % 480, 0);
+  }
+  for (u32 i = ctx->count; i > 0; i--) {
+    bench_free(ctx, i - 1);
+  }
+}
+
+/* Queue-like: released oldest first, leaving holes ahead of live blocks. */
+static void bench_fifo(bench_ctx_t *ctx) {
+  for (u32 i = 0; i < ctx->count; i++) {
+    bench_alloc(ctx, i, 32 + bench_rand(ctx) % 480, 0);
+  }
+  bench_free_all(ctx);
+}
+
+/* Random sizes from path strings up to a couple of pages, random lifetimes. */
+static void bench_random(bench_ctx_t *ctx) {
+  for (u32 i = 0; i < ctx->count * 4; i++) {
+    u32 slot = bench_rand(ctx) % ctx->count;
+    if (ctx->slots[slot]) {
+      bench_free(ctx, slot);
+    } else {
+      bench_alloc(ctx, slot, 16 + bench_rand(ctx) % 8176, 0);
+    }
+  }
+  bench_free_all(ctx);
+}
+
+/* Page-aligned blocks (page tables, stacks) interleaved with small strings. */
+static void bench_aligned(bench_ctx_t *ctx) {
+  for (u32 i = 0; i < ctx->count; i++) {
+    if ((i & 3) == 0) {
+      bench_alloc(ctx, i, 4096, 4096);
+    } else {
+      bench_alloc(ctx, i, 24 + bench_rand(ctx) % 232, 0);
+    }
+  }
+  for (u32 i = 0; i < ctx->count; i++) {
+    bench_free(ctx, bench_rand(ctx) % ctx->count);
+  }
+  bench_free_all(ctx);
+}
+
+/* Buffers grown by doubling, round-robin, the way file data is extended. */
+static void bench_realloc(bench_ctx_t *ctx) {
+  u32 buffers = ctx->count / 8 ? ctx->count / 8 : 1;
+  for (u32 i = 0; i < buffers; i++) {
+    bench_alloc(ctx, i, 16, 0);
+  }
+  for (unsigned long size = 32; size <= 4096; size <<= 1) {
+    for (u32 i = 0; i < buffers; i++) {
+      if (!ctx->slots[i]) {
+        continue;
+      }
+      void *ptr = krealloc(ctx->slots[i], size);
+      if (!ptr) {
+        if (ctx->failures++ == 0) {
+          ctx->first_fail_op = ctx->ops;
+          ctx->first_fail_size = size;
+        }
+      } else {
+        ctx->slots[i] = ptr;
+      }
+      bench_op_done(ctx);
+    }
+  }
+  bench_free_all(ctx);
+}
+
+static const bench_workload_t bench_heap_workloads[] = {
+    {"lifo", bench_lifo},       {"fifo", bench_fifo},
+    {"random", bench_random},   {"aligned", bench_aligned},
+    {"realloc", bench_realloc},
+};
+
+static void bench_write_field(const char *label, u64 value) {
+  kshell_console_write(label);
+  kshell_console_write_int((int)value);
+}
+
+static int bench_heap(u32 count) {
+  void **slots = (void **)kcalloc(count, sizeof(void *));
+  if (!slots) {
+    kshell_console_write("bench: out of memory\n");
+    return -1;
+  }
+
+  u64 tsc_per_us = bench_tsc_per_us();
+  com1_printf("[BENCH] heap: %u slots, %u TSC cycles/us\n", count,
+              (u32)tsc_per_us);
+  if (!tsc_per_us) {
+    kshell_console_write("bench: timer not ticking, reporting cycles only\n");
+  }
+
+  u32 n = sizeof(bench_heap_workloads) / sizeof(bench_heap_workloads[0]);
+  for (u32 w = 0; w < n; w++) {
+    bench_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.slots = slots;
+    ctx.count = count;
+    ctx.rng = BENCH_SEED;
+
+    bench_sample(&ctx);
+    ctx.batch_start = bench_rdtsc();
+    bench_heap_workloads[w].run(&ctx);
+    ctx.cycles += bench_rdtsc() - ctx.batch_start;
+    bench_sample(&ctx);
+
+    u64 cycles_per_op = ctx.ops ? ctx.cycles / ctx.ops : 0;
+    u64 ns_per_op =
+        (ctx.ops && tsc_per_us) ? (ctx.cycles * 1000) / tsc_per_us / ctx.ops
+                                : 0;
+
+    com1_printf("[BENCH] heap %s: ops=%u cycles/op=%u ns/op=%u "
+                "frag_peak=%u%% failures=%u",
+                bench_heap_workloads[w].name, (u32)ctx.ops,
+                (u32)cycles_per_op, (u32)ns_per_op, (u32)ctx.frag_peak,
+                (u32)ctx.failures);
+    if (ctx.failures) {
+      com1_printf(" first_fail_op=%u size=%u", (u32)ctx.first_fail_op,
+                  (u32)ctx.first_fail_size);
+    }
+    com1_printf("\n");
+
+    kshell_console_write(bench_heap_workloads[w].name);
+    bench_write_field(": ops=", ctx.ops);
+    bench_write_field(" cyc/op=", cycles_per_op);
+    bench_write_field(" ns/op=", ns_per_op);
+    bench_write_field(" frag=", (u64)ctx.frag_peak);
+    bench_write_field("% fail=", ctx.failures);
+    if (ctx.failures) {
+      bench_write_field(" @op ", ctx.first_fail_op);
+    }
+    kshell_console_write("\n");
+  }
+
+  kfree(slots);
+  return 0;
+}
+
+int kshell_bench_command(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3 || strcmp(argv[1], "heap") != 0) {
+    kshell_console_write("bench: usage: bench heap [slots]\n");
+    return -1;
+  }
+
+  u32 count = BENCH_DEFAULT_SLOTS;
+  if (argc == 3) {
+    int value = atoi(argv[2]);
+    if (value < 16 || value > BENCH_MAX_SLOTS) {
+      kshell_console_write("bench: slots must be 16..4096\n");
+      return -1;
+    }
+    count = (u32)value;
+  }
+
+  return bench_heap(count);
+}
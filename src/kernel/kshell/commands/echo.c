@@ -187,7 +187,7 @@ static int print_kernel_var(const char *name) {
   }
 
   if (strcmp(name, "prun") == 0) {
-    kshell_console_write("PID\tNAME\tSTATE\n");
+    kshell_console_write("PID\tNAME\tSTATE\tZERO\tDEMAND\tCOW\tHUGE\tFILE\tSWAP\n");
     for (int i = 0; i < MAX_PROCESSES; i++) {
       process_t *proc = &process_table[i];
       if (proc->state != PROC_STATE_UNUSED) {
@@ -196,6 +196,18 @@ static int print_kernel_var(const char *name) {
         kshell_console_write(proc->name);
         kshell_console_write("\t");
         kshell_console_write(process_state_name(proc->state));
+        kshell_console_write("\t");
+        kshell_console_write_int((int)proc->faults.zero_page);
+        kshell_console_write("\t");
+        kshell_console_write_int((int)proc->faults.demand_zero);
+        kshell_console_write("\t");
+        kshell_console_write_int((int)proc->faults.cow);
+        kshell_console_write("\t");
+        kshell_console_write_int((int)proc->faults.huge);
+        kshell_console_write("\t");
+        kshell_console_write_int((int)proc->faults.file);
+        kshell_console_write("\t");
+        kshell_console_write_int((int)proc->faults.swap);
         kshell_console_write("\n");
       }
     }
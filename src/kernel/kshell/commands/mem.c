@@ -0,0 +1,447 @@
+#include <kernel/kguard.h>
+#include <kernel/ksm.h>
+#include <kernel/kshell/kshell.h>
+#include <kernel/mmu.h>
+#include <kernel/pmm.h>
+#include <kernel/reclaim.h>
+#include <kernel/shrinker.h>
+#include <kernel/swap.h>
+#include <kernel/vmalloc.h>
+#include <mlibc/kmem_cache.h>
+
+static void write_padded(const char *s, int width) {
+  int len = strlen(s);
+  kshell_console_write(s);
+  for (int i = len; i < width; i++) {
+    kshell_console_putc(' ');
+  }
+}
+
+static void write_int_padded(unsigned long value, int width) {
+  char buf[32];
+  itoa((int)value, buf, 10);
+  write_padded(buf, width);
+}
+
+int kshell_slabinfo_command(int argc, char *argv[]) {
+  (void)argv;
+  if (argc != 1) {
+    kshell_console_write("slabinfo: usage: slabinfo\n");
+    return -1;
+  }
+
+  write_padded("cache", 16);
+  write_padded("size", 8);
+  write_padded("active", 8);
+  write_padded("total", 8);
+  write_padded("slabs", 7);
+  write_padded("hits", 10);
+  kshell_console_write("misses\n");
+
+  for (kmem_cache_t *cache = kmem_cache_list(); cache; cache = cache->next) {
+    write_padded(cache->name, 16);
+    write_int_padded(cache->object_size, 8);
+    write_int_padded(cache->active, 8);
+    write_int_padded(cache->slabs * cache->per_slab, 8);
+    write_int_padded(cache->slabs, 7);
+    write_int_padded(cache->hits, 10);
+    write_int_padded(cache->misses, 0);
+    kshell_console_write("\n");
+  }
+
+  return 0;
+}
+
+static void write_stat_row(const kheap_stat_t *stat) {
+  write_int_padded(stat->live_bytes, 10);
+  write_int_padded(stat->live_count, 8);
+  write_int_padded(stat->allocs, 9);
+  write_int_padded(stat->peak_bytes, 0);
+  kshell_console_write("\n");
+}
+
+/* "0x" and 16 hex digits, then a gap. */
+#define HEAPSTAT_SITE_WIDTH 20
+
+/* Sites ordered by live bytes (ties by slot), up to limit rows. */
+static void heapstat_sites(int limit) {
+  unsigned long prev_bytes = ~0UL;
+  int prev_index = -1;
+  kheap_stat_t stat;
+
+  write_padded("site", HEAPSTAT_SITE_WIDTH);
+  write_padded("tag", 7);
+  write_padded("live", 10);
+  write_padded("count", 8);
+  write_padded("allocs", 9);
+  kshell_console_write("peak\n");
+
+  for (int shown = 0; shown < limit; shown++) {
+    int best = -1;
+    unsigned long best_bytes = 0;
+    for (int i = 0; kheap_site_stat(i, &stat) == 0; i++) {
+      if (stat.allocs == 0) {
+        continue;
+      }
+      if (stat.live_bytes > prev_bytes ||
+          (stat.live_bytes == prev_bytes && i <= prev_index)) {
+        continue;
+      }
+      if (best < 0 || stat.live_bytes > best_bytes) {
+        best = i;
+        best_bytes = stat.live_bytes;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+
+    kheap_site_stat(best, &stat);
+    /* Full 64-bit return address: the kernel runs in the top 2 GB. */
+    if (stat.site) {
+      kshell_console_write_ptr(stat.site);
+      write_padded("", HEAPSTAT_SITE_WIDTH - 18);
+    } else {
+      write_padded("(overflow)", HEAPSTAT_SITE_WIDTH);
+    }
+    write_padded(kheap_tag_name((int)stat.tag), 7);
+    write_stat_row(&stat);
+
+    prev_bytes = stat.live_bytes;
+    prev_index = best;
+  }
+}
+
+int kshell_heapstat_command(int argc, char *argv[]) {
+  int limit = 10;
+  if (argc == 2 && strcmp(argv[1], "all") == 0) {
+    limit = 1 << 30;
+  } else if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+    kheap_stat_reset_peaks();
+    kshell_console_write("heapstat: peaks reset\n");
+    return 0;
+  } else if (argc != 1) {
+    kshell_console_write("heapstat: usage: heapstat [all|reset]\n");
+    return -1;
+  }
+
+  kheap_stat_t stat;
+  unsigned long free_bytes = 0;
+  unsigned long largest = 0;
+  int frag = kheap_fragmentation(&free_bytes, &largest);
+  char buf[32];
+
+  kheap_stat_total(&stat);
+  kshell_console_write("live ");
+  write_int_padded(stat.live_bytes, 0);
+  kshell_console_write(" bytes in ");
+  write_int_padded(stat.live_count, 0);
+  kshell_console_write(" allocations, peak ");
+  write_int_padded(stat.peak_bytes, 0);
+  kshell_console_write("\nfree ");
+  write_int_padded(free_bytes, 0);
+  kshell_console_write(" bytes, largest block ");
+  write_int_padded(largest, 0);
+  kshell_console_write(", fragmentation ");
+  itoa(frag, buf, 10);
+  kshell_console_write(buf);
+  kshell_console_write("%\n\n");
+
+  write_padded("tag", 19);
+  write_padded("live", 10);
+  write_padded("count", 8);
+  write_padded("allocs", 9);
+  kshell_console_write("peak\n");
+  for (int tag = 0; kheap_tag_stat(tag, &stat) == 0; tag++) {
+    write_padded(kheap_tag_name(tag), 19);
+    write_stat_row(&stat);
+  }
+  kshell_console_write("\n");
+
+  heapstat_sites(limit);
+  return 0;
+}
+
+int kshell_meminfo_command(int argc, char *argv[]) {
+  (void)argv;
+  if (argc != 1) {
+    kshell_console_write("meminfo: usage: meminfo\n");
+    return -1;
+  }
+
+  kshell_console_write("frames: ");
+  kshell_console_write_int((int)pmm_free_frames());
+  kshell_console_write(" free of ");
+  kshell_console_write_int((int)pmm_total_frames());
+  kshell_console_write("\n");
+
+  pmm_zero_stats_t zero;
+  pmm_zero_pool_stats(&zero);
+  kshell_console_write("zero pool: ");
+  kshell_console_write_int((int)zero.count);
+  kshell_console_write(" pages (low ");
+  kshell_console_write_int((int)zero.low);
+  kshell_console_write(", high ");
+  kshell_console_write_int((int)zero.high);
+  kshell_console_write(")\n  hits ");
+  kshell_console_write_int((int)zero.hits);
+  kshell_console_write(", misses ");
+  kshell_console_write_int((int)zero.misses);
+  kshell_console_write(", refilled ");
+  kshell_console_write_int((int)zero.refilled);
+  kshell_console_write(", returned ");
+  kshell_console_write_int((int)zero.returned);
+  kshell_console_write("\n");
+
+  vmalloc_stats_t vm;
+  vmalloc_get_stats(&vm);
+  kshell_console_write("vmalloc: ");
+  kshell_console_write_int((int)vm.areas);
+  kshell_console_write(" areas, ");
+  kshell_console_write_int((int)vm.pages);
+  kshell_console_write(" pages, ");
+  kshell_console_write_int((int)vm.lazy_pages);
+  kshell_console_write(" lazy, ");
+  kshell_console_write_int((int)vm.flushes);
+  kshell_console_write(" flushes\n");
+
+  mmu_cow_stats_t cow;
+  mmu_cow_get_stats(&cow);
+  kshell_console_write("cow: ");
+  kshell_console_write_int((int)cow.shared);
+  kshell_console_write(" pages shared, ");
+  kshell_console_write_int((int)cow.copied);
+  kshell_console_write(" copied, ");
+  kshell_console_write_int((int)cow.reused);
+  kshell_console_write(" reused, ");
+  kshell_console_write_int((int)cow.zero_filled);
+  kshell_console_write(" zero-filled\n");
+
+  mmu_tlb_stats_t tlb;
+  mmu_tlb_get_stats(&tlb);
+  kshell_console_write("tlb: pcid ");
+  kshell_console_write(tlb.pcid ? "on" : "off");
+  kshell_console_write(", global ");
+  kshell_console_write(tlb.pge ? "on" : "off");
+  kshell_console_write(", 1g pages ");
+  kshell_console_write(tlb.gbpages ? "on" : "off");
+  kshell_console_write(", ");
+  kshell_console_write_int((int)tlb.switches);
+  kshell_console_write(" switches, ");
+  kshell_console_write_int((int)tlb.kept);
+  kshell_console_write(" kept, ");
+  kshell_console_write_int((int)tlb.assigned);
+  kshell_console_write(" tagged, ");
+  kshell_console_write_int((int)tlb.recycled);
+  kshell_console_write(" recycled, ");
+  kshell_console_write_int((int)tlb.global_flushes);
+  kshell_console_write(" full flushes\n");
+
+  reclaim_stats_t reclaim;
+  reclaim_get_stats(&reclaim);
+  kshell_console_write("file pages: ");
+  kshell_console_write_int((int)reclaim.tracked);
+  kshell_console_write(" on lru, ");
+  kshell_console_write_int((int)reclaim.scanned);
+  kshell_console_write(" scanned, ");
+  kshell_console_write_int((int)reclaim.referenced);
+  kshell_console_write(" referenced, ");
+  kshell_console_write_int((int)reclaim.reclaimed);
+  kshell_console_write(" reclaimed, ");
+  kshell_console_write_int((int)reclaim.refaults);
+  kshell_console_write(" read back\n");
+
+  swap_stats_t swap;
+  swap_get_stats(&swap);
+  kshell_console_write("swap: ");
+  if (swap.disk) {
+    kshell_console_write_int((int)swap.used);
+    kshell_console_write(" of ");
+    kshell_console_write_int((int)swap.slots);
+    kshell_console_write(" slots used, ");
+    kshell_console_write_int((int)swap.swapped_out);
+    kshell_console_write(" out, ");
+    kshell_console_write_int((int)swap.swapped_in);
+    kshell_console_write(" in\n");
+  } else {
+    kshell_console_write("off\n");
+  }
+
+  ksm_stats_t ksm;
+  ksm_get_stats(&ksm);
+  kshell_console_write("ksm: ");
+  kshell_console_write_int((int)ksm.shared);
+  kshell_console_write(" shared frames, ");
+  kshell_console_write_int((int)ksm.saved);
+  kshell_console_write(" pages saved, ");
+  kshell_console_write_int((int)ksm.zero_merged);
+  kshell_console_write(" to zero page\n");
+
+  kshell_console_write("shrinkers:\n");
+  for (shrinker_t *s = shrinker_list(); s; s = s->next) {
+    kshell_console_write("  ");
+    write_padded(s->name, 16);
+    kshell_console_write_int((int)s->count(s));
+    kshell_console_write(" reclaimable, ");
+    kshell_console_write_int((int)s->calls);
+    kshell_console_write(" calls, ");
+    kshell_console_write_int((int)s->freed);
+    kshell_console_write(" freed\n");
+  }
+  return 0;
+}
+
+int kshell_tlb_command(int argc, char *argv[]) {
+  if (argc == 3 && strcmp(argv[1], "threshold") == 0) {
+    int pages = atoi(argv[2]);
+    if (pages < 0 || pages > 64) {
+      kshell_console_write("tlb: threshold must be 0..64\n");
+      return -1;
+    }
+    mmu_set_flush_threshold((u32)pages);
+  } else if (argc != 1) {
+    kshell_console_write("tlb: usage: tlb [threshold <n>]\n");
+    return -1;
+  }
+
+  mmu_tlb_stats_t tlb;
+  mmu_tlb_get_stats(&tlb);
+  kshell_console_write("range flush threshold ");
+  kshell_console_write_int((int)mmu_get_flush_threshold());
+  kshell_console_write(" pages\n  ");
+  kshell_console_write_int((int)tlb.range_pages);
+  kshell_console_write(" pages invalidated one by one, ");
+  kshell_console_write_int((int)tlb.range_flushes);
+  kshell_console_write(" whole-TLB flushes\n");
+  return 0;
+}
+
+static disk_t *find_disk(const char *name) {
+  for (int i = 0; i < disk_count(); i++) {
+    disk_t *disk = disk_get(i);
+    if (disk && strcmp(disk->name, name) == 0) {
+      return disk;
+    }
+  }
+  return NULL;
+}
+
+int kshell_swap_command(int argc, char *argv[]) {
+  if (argc == 5 && strcmp(argv[1], "on") == 0) {
+    disk_t *disk = find_disk(argv[2]);
+    int start = atoi(argv[3]);
+    int sectors = atoi(argv[4]);
+    if (!disk) {
+      kshell_console_write("swap: no such disk\n");
+      return -1;
+    }
+    if (start < 0 || sectors <= 0 ||
+        swap_on(disk, (u32)start, (u32)sectors) != 0) {
+      kshell_console_write("swap: cannot use that range (already on?)\n");
+      return -1;
+    }
+  } else if (argc != 1) {
+    kshell_console_write(
+        "swap: usage: swap [on <disk> <start sector> <sectors>]\n");
+    return -1;
+  }
+
+  swap_stats_t swap;
+  swap_get_stats(&swap);
+  if (!swap.disk) {
+    kshell_console_write("swap off\n");
+    return 0;
+  }
+  kshell_console_write(swap.disk);
+  kshell_console_write(" from sector ");
+  kshell_console_write_int((int)swap.start_lba);
+  kshell_console_write(": ");
+  kshell_console_write_int((int)swap.used);
+  kshell_console_write(" of ");
+  kshell_console_write_int((int)swap.slots);
+  kshell_console_write(" pages used\n  ");
+  kshell_console_write_int((int)swap.scanned);
+  kshell_console_write(" scanned, ");
+  kshell_console_write_int((int)swap.referenced);
+  kshell_console_write(" referenced, ");
+  kshell_console_write_int((int)swap.swapped_out);
+  kshell_console_write(" swapped out in ");
+  kshell_console_write_int((int)swap.writes);
+  kshell_console_write(" writes, ");
+  kshell_console_write_int((int)swap.swapped_in);
+  kshell_console_write(" swapped in, ");
+  kshell_console_write_int((int)swap.errors);
+  kshell_console_write(" errors\n");
+  return 0;
+}
+
+int kshell_ksm_command(int argc, char *argv[]) {
+  if (argc == 3 && strcmp(argv[1], "rate") == 0) {
+    int rate = atoi(argv[2]);
+    if (rate < 0) {
+      kshell_console_write("ksm: rate must be 0 or more\n");
+      return -1;
+    }
+    ksm_set_rate((u32)rate);
+  } else if (argc != 1) {
+    kshell_console_write("ksm: usage: ksm [rate <pages per second>]\n");
+    return -1;
+  }
+
+  ksm_stats_t ksm;
+  ksm_get_stats(&ksm);
+  if (ksm.rate) {
+    kshell_console_write("scanning ");
+    kshell_console_write_int((int)ksm.rate);
+    kshell_console_write(" pages/s");
+  } else {
+    kshell_console_write("scanning off");
+  }
+  kshell_console_write(", ");
+  kshell_console_write_int((int)ksm.passes);
+  kshell_console_write(" passes, ");
+  kshell_console_write_int((int)ksm.scanned);
+  kshell_console_write(" pages hashed\n  ");
+  kshell_console_write_int((int)ksm.merged);
+  kshell_console_write(" merged, ");
+  kshell_console_write_int((int)ksm.zero_merged);
+  kshell_console_write(" to zero page, ");
+  kshell_console_write_int((int)ksm.shared);
+  kshell_console_write(" shared frames, ");
+  kshell_console_write_int((int)ksm.saved);
+  kshell_console_write(" pages saved\n");
+  return 0;
+}
+
+int kshell_kguard_command(int argc, char *argv[]) {
+  if (argc == 3 && strcmp(argv[1], "rate") == 0) {
+    int rate = atoi(argv[2]);
+    if (rate < 0) {
+      kshell_console_write("kguard: rate must be 0 or more\n");
+      return -1;
+    }
+    kguard_set_rate((u32)rate);
+  } else if (argc != 1) {
+    kshell_console_write("kguard: usage: kguard [rate <n>]\n");
+    return -1;
+  }
+
+  kguard_stats_t stats;
+  kguard_get_stats(&stats);
+  if (stats.rate) {
+    kshell_console_write("sampling 1 in ");
+    kshell_console_write_int((int)stats.rate);
+  } else {
+    kshell_console_write("sampling off");
+  }
+  kshell_console_write(", ");
+  kshell_console_write_int((int)stats.live);
+  kshell_console_write(" of ");
+  kshell_console_write_int((int)stats.slots);
+  kshell_console_write(" slots live\n  sampled ");
+  kshell_console_write_int((int)stats.sampled);
+  kshell_console_write(", skipped ");
+  kshell_console_write_int((int)stats.skipped);
+  kshell_console_write("\n");
+  return 0;
+}
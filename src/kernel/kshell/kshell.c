@@ -30,6 +30,7 @@
 #include <kernel/drivers/vga.h>
 #include <kernel/drivers/video/drm/frontend.h>
 #include <kernel/kshell/kshell.h>
+#include <kernel/pmm.h>
 #include <mlibc/mlibc.h>
 
 static volatile int kshell_open_requested = 0;
@@ -75,7 +76,8 @@ static void kshell_sync_cells(void) {
     kshell_cells = NULL;
   }
 
-  kshell_cells = (u16 *)kcalloc((unsigned long)(w * h), sizeof(u16));
+  kshell_cells = (u16 *)kcalloc_tagged((unsigned long)(w * h), sizeof(u16),
+                                        KMEM_TAG_TTY);
   kshell_cells_w = w;
   kshell_cells_h = h;
 
@@ -290,6 +292,14 @@ static void kshell_help_list(void) {
   kshell_console_write("  clear\n");
   kshell_console_write("  echo\n");
   kshell_console_write("  drm_switch\n");
+  kshell_console_write("  slabinfo\n");
+  kshell_console_write("  heapstat\n");
+  kshell_console_write("  meminfo\n");
+  kshell_console_write("  kguard\n");
+  kshell_console_write("  tlb\n");
+  kshell_console_write("  swap\n");
+  kshell_console_write("  ksm\n");
+  kshell_console_write("  bench\n");
   kshell_console_write("  exit\n");
   kshell_console_write("redirection:\n");
   kshell_console_write("  <command> > /absolute/path\n");
@@ -328,6 +338,64 @@ static void kshell_help_command(const char *cmd) {
     return;
   }
 
+  if (strcmp(cmd, "slabinfo") == 0) {
+    kshell_console_write("slabinfo\n");
+    kshell_console_write("  usage: slabinfo\n");
+    kshell_console_write("  show kmem_cache object counts and hit/miss counters\n");
+    return;
+  }
+
+  if (strcmp(cmd, "heapstat") == 0) {
+    kshell_console_write("heapstat\n");
+    kshell_console_write("  usage: heapstat [all|reset]\n");
+    kshell_console_write("  show live/peak heap usage per tag and per call site\n");
+    kshell_console_write("  all lists every site, reset restarts peak tracking\n");
+    return;
+  }
+
+  if (strcmp(cmd, "meminfo") == 0) {
+    kshell_console_write("meminfo\n");
+    kshell_console_write("  usage: meminfo\n");
+    kshell_console_write("  show free frames, zeroed page pool, vmalloc, COW, swap, ksm and shrinker counters\n");
+    return;
+  }
+
+  if (strcmp(cmd, "kguard") == 0) {
+    kshell_console_write("kguard\n");
+    kshell_console_write("  usage: kguard [rate <n>]\n");
+    kshell_console_write("  show guarded allocation sampling, or sample 1 in n (0 = off)\n");
+    return;
+  }
+
+  if (strcmp(cmd, "tlb") == 0) {
+    kshell_console_write("tlb\n");
+    kshell_console_write("  usage: tlb [threshold <n>]\n");
+    kshell_console_write("  show range flush counters, or flush the whole TLB past n changed pages\n");
+    return;
+  }
+
+  if (strcmp(cmd, "swap") == 0) {
+    kshell_console_write("swap\n");
+    kshell_console_write("  usage: swap [on <disk> <start sector> <sectors>]\n");
+    kshell_console_write("  show swap counters, or swap anonymous pages to a disk range\n");
+    return;
+  }
+
+  if (strcmp(cmd, "ksm") == 0) {
+    kshell_console_write("ksm\n");
+    kshell_console_write("  usage: ksm [rate <pages per second>]\n");
+    kshell_console_write("  show same-page merging counters, or set the scan rate (0 = off)\n");
+    return;
+  }
+
+  if (strcmp(cmd, "bench") == 0) {
+    kshell_console_write("bench\n");
+    kshell_console_write("  usage: bench heap [slots]\n");
+    kshell_console_write("  run heap workloads (lifo, fifo, random, aligned, realloc)\n");
+    kshell_console_write("  reports ns/op, peak fragmentation, failures; also on COM1\n");
+    return;
+  }
+
   if (strcmp(cmd, "exit") == 0) {
     kshell_console_write("exit\n");
     kshell_console_write("  usage: exit\n");
@@ -367,6 +435,38 @@ static int kshell_execute_core(int argc, char *argv[]) {
     return kshell_drm_switch_command(argc, argv);
   }
 
+  if (strcmp(argv[0], "slabinfo") == 0) {
+    return kshell_slabinfo_command(argc, argv);
+  }
+
+  if (strcmp(argv[0], "heapstat") == 0) {
+    return kshell_heapstat_command(argc, argv);
+  }
+
+  if (strcmp(argv[0], "meminfo") == 0) {
+    return kshell_meminfo_command(argc, argv);
+  }
+
+  if (strcmp(argv[0], "kguard") == 0) {
+    return kshell_kguard_command(argc, argv);
+  }
+
+  if (strcmp(argv[0], "tlb") == 0) {
+    return kshell_tlb_command(argc, argv);
+  }
+
+  if (strcmp(argv[0], "swap") == 0) {
+    return kshell_swap_command(argc, argv);
+  }
+
+  if (strcmp(argv[0], "ksm") == 0) {
+    return kshell_ksm_command(argc, argv);
+  }
+
+  if (strcmp(argv[0], "bench") == 0) {
+    return kshell_bench_command(argc, argv);
+  }
+
   if (strcmp(argv[0], "exit") == 0) {
     return 1;
   }
@@ -476,6 +576,7 @@ void kshell_run(void) {
         if (c != 0) {
           break;
         }
+        pmm_zero_pool_refill();
         __asm__ volatile("hlt");
       }
 
@@ -44,5 +44,13 @@ void kshell_console_write_ptr(const void *ptr);
 int kshell_parse_line(char *line, char *argv[], int max_args);
 int kshell_echo_command(int argc, char *argv[]);
 int kshell_drm_switch_command(int argc, char *argv[]);
+int kshell_slabinfo_command(int argc, char *argv[]);
+int kshell_heapstat_command(int argc, char *argv[]);
+int kshell_meminfo_command(int argc, char *argv[]);
+int kshell_kguard_command(int argc, char *argv[]);
+int kshell_tlb_command(int argc, char *argv[]);
+int kshell_swap_command(int argc, char *argv[]);
+int kshell_ksm_command(int argc, char *argv[]);
+int kshell_bench_command(int argc, char *argv[]);
 
 #endif
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <kernel/drivers/timer.h>
+#include <kernel/ksm.h>
+#include <kernel/mmu.h>
+#include <kernel/pmm.h>
+#include <kernel/process.h>
+#include <kernel/shrinker.h>
+#include <mlibc/kmem_cache.h>
+
+#define KSM_BUCKETS 1024
+
+/* A merged frame (stable, frame set) or a page seen in this pass
+ * (unstable, frame 0, named by pid and address). */
+typedef struct ksm_node {
+  u64 hash;
+  u64 frame;
+  u32 pid;
+  u64 vaddr;
+  struct ksm_node *next;
+} ksm_node_t;
+
+typedef struct {
+  process_t *proc;
+  u32 budget; /* pages left to hash in this tick */
+} ksm_scan_t;
+
+static kmem_cache_t *node_cache = NULL;
+static ksm_node_t *buckets[KSM_BUCKETS];
+static u64 zero_hash = 0;
+static u32 ksm_rate = KSM_DEFAULT_RATE;
+static u32 ksm_credit = 0; /* rate * ticks not yet turned into pages */
+static ksm_stats_t stats;
+
+/* Scan cursor: process table slot and the address to resume from. */
+static u32 cursor_slot = 0;
+static u64 cursor_vaddr = 0;
+
+static u64 ksm_hash(const u64 *words) {
+  u64 hash = 0xcbf29ce484222325ULL;
+  for (u32 i = 0; i < PAGE_SIZE / sizeof(u64); i++) {
+    hash = (hash ^ words[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static int ksm_same(u64 a, u64 b) {
+  const u64 *x = (const u64 *)phys_to_virt(a);
+  const u64 *y = (const u64 *)phys_to_virt(b);
+  for (u32 i = 0; i < PAGE_SIZE / sizeof(u64); i++) {
+    if (x[i] != y[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* The entry mapping frame read-only; writable pages become copy-on-write.
+ * Accessed and dirty are kept for the reclaim and swap clocks. */
+static u64 ksm_readonly(u64 entry, u64 frame) {
+  u64 flags = entry & PTE_FLAGS_MASK;
+  if (flags & PTE_RW) {
+    flags = (flags & ~(u64)PTE_RW) | PTE_COW;
+  }
+  return frame | flags;
+}
+
+/* A page only one mapping holds: the kind the scanner may merge. */
+static int ksm_private(u64 entry) {
+  u64 frame = entry & PTE_ADDR_MASK;
+  return (entry & PTE_PRESENT) && frame != mmu_zero_page() &&
+         pmm_page_refcount(frame) == 1;
+}
+
+static int ksm_scannable(process_t *proc) {
+  return proc->state != PROC_STATE_UNUSED &&
+         proc->state != PROC_STATE_EMBRYO &&
+         proc->state != PROC_STATE_ZOMBIE && proc->owns_address_space &&
+         proc->cr3;
+}
+
+/* Only anonymous memory is merged: file pages are reclaimed by rereading
+ * the file, and huge pages are not split. */
+static int ksm_mergeable(const vma_t *area) {
+  return area && (area->flags & VMA_ANON) && !(area->flags & VMA_HUGE);
+}
+
+/* The first mergeable area of proc ending above vaddr. */
+static vma_t *ksm_area(process_t *proc, u64 vaddr) {
+  if (!ksm_scannable(proc)) {
+    return NULL;
+  }
+  for (u32 i = 0; i < proc->vmas.count; i++) {
+    vma_t *area = &proc->vmas.vmas[i];
+    if (area->end > vaddr && ksm_mergeable(area)) {
+      return area;
+    }
+  }
+  return NULL;
+}
+
+/* Runs in the timer interrupt, so a node is never worth reclaiming for:
+ * without memory the page is simply not remembered this pass. */
+static ksm_node_t *ksm_add(u64 hash) {
+  shrink_disable();
+  if (!node_cache) {
+    node_cache = kmem_cache_create("ksm_node", sizeof(ksm_node_t), 8, NULL);
+  }
+  ksm_node_t *node =
+      node_cache ? (ksm_node_t *)kmem_cache_alloc(node_cache) : NULL;
+  shrink_enable();
+  if (!node) {
+    return NULL;
+  }
+  ksm_node_t **bucket = &buckets[hash % KSM_BUCKETS];
+  node->hash = hash;
+  node->frame = 0;
+  node->next = *bucket;
+  *bucket = node;
+  return node;
+}
+
+/* Point the page at vaddr of proc, mapped by pte, at frame. */
+static void ksm_remap(process_t *proc, u64 vaddr, u64 *pte, u64 frame) {
+  u64 old = *pte & PTE_ADDR_MASK;
+  pmm_page_get(frame);
+  *pte = ksm_readonly(*pte, frame);
+  mmu_flush_user_page(proc->cr3, vaddr);
+  pmm_page_put(old);
+}
+
+/* An unstable node whose page is still there, still private and still
+ * holds the same bytes as frame becomes stable on that page's frame. */
+static int ksm_promote(ksm_node_t *node, u64 frame) {
+  process_t *owner = process_get(node->pid);
+  if (!owner || !ksm_scannable(owner) ||
+      !ksm_mergeable(vma_find(&owner->vmas, node->vaddr))) {
+    return 0;
+  }
+  u64 entry = mmu_get_user_pte(owner->cr3, node->vaddr);
+  u64 shared = entry & PTE_ADDR_MASK;
+  if (!(entry & PTE_USER) || !ksm_private(entry) || shared == frame ||
+      !ksm_same(shared, frame)) {
+    return 0;
+  }
+  mmu_set_user_pte(owner->cr3, node->vaddr, ksm_readonly(entry, shared));
+  pmm_page_get(shared); /* the stable table's own reference */
+  node->frame = shared;
+  stats.shared++;
+  return 1;
+}
+
+static int ksm_page(u64 vaddr, u64 *pte, void *ctx) {
+  ksm_scan_t *scan = (ksm_scan_t *)ctx;
+  if (!ksm_private(*pte)) {
+    return 0;
+  }
+  u64 frame = *pte & PTE_ADDR_MASK;
+  u64 hash = ksm_hash((const u64 *)phys_to_virt(frame));
+  stats.scanned++;
+
+  if (hash == zero_hash && ksm_same(frame, mmu_zero_page())) {
+    ksm_remap(scan->proc, vaddr, pte, mmu_zero_page());
+    stats.zero_merged++;
+    return --scan->budget == 0;
+  }
+
+  for (ksm_node_t *node = buckets[hash % KSM_BUCKETS]; node;
+       node = node->next) {
+    if (node->hash != hash) {
+      continue;
+    }
+    if (node->frame ? ksm_same(node->frame, frame)
+                    : ksm_promote(node, frame)) {
+      ksm_remap(scan->proc, vaddr, pte, node->frame);
+      stats.merged++;
+      return --scan->budget == 0;
+    }
+  }
+
+  ksm_node_t *node = ksm_add(hash);
+  if (node) {
+    node->pid = scan->proc->pid;
+    node->vaddr = vaddr;
+  }
+  return --scan->budget == 0;
+}
+
+/* End of a pass: forget this pass's pages, and drop merged frames nobody
+ * maps any more. */
+static void ksm_end_pass(void) {
+  for (u32 i = 0; i < KSM_BUCKETS; i++) {
+    ksm_node_t **link = &buckets[i];
+    while (*link) {
+      ksm_node_t *node = *link;
+      if (node->frame && pmm_page_refcount(node->frame) > 1) {
+        link = &node->next;
+        continue;
+      }
+      if (node->frame) {
+        pmm_page_put(node->frame);
+        stats.shared--;
+      }
+      *link = node->next;
+      kmem_cache_free(node_cache, node);
+    }
+  }
+  stats.passes++;
+}
+
+static void ksm_scan(u32 pages) {
+  if (!zero_hash) {
+    zero_hash = ksm_hash((const u64 *)phys_to_virt(mmu_zero_page()));
+  }
+  ksm_scan_t scan;
+  scan.budget = pages;
+  /* Every slot at most once per call, so an idle table does not spin. */
+  for (u32 step = 0; scan.budget && step <= MAX_PROCESSES; step++) {
+    process_t *proc = &process_table[cursor_slot];
+    vma_t *area;
+    while (scan.budget && (area = ksm_area(proc, cursor_vaddr)) != NULL) {
+      u64 start = cursor_vaddr > area->start ? cursor_vaddr : area->start;
+      scan.proc = proc;
+      cursor_vaddr =
+          mmu_scan_user_ptes(proc->cr3, start, area->end, ksm_page, &scan);
+    }
+    if (!scan.budget) {
+      return;
+    }
+    cursor_vaddr = 0;
+    if (++cursor_slot == MAX_PROCESSES) {
+      cursor_slot = 0;
+      ksm_end_pass();
+    }
+  }
+}
+
+void ksm_tick(void) {
+  u32 hz = timer_get_frequency();
+  if (!ksm_rate || !hz || !pmm_is_initialized()) {
+    return;
+  }
+  ksm_credit += ksm_rate;
+  if (ksm_credit < hz) {
+    return;
+  }
+  u32 pages = ksm_credit / hz;
+  ksm_credit %= hz;
+  ksm_scan(pages);
+}
+
+void ksm_set_rate(u32 pages_per_sec) {
+  ksm_rate = pages_per_sec;
+  ksm_credit = 0;
+}
+
+void ksm_get_stats(ksm_stats_t *out) {
+  *out = stats;
+  out->rate = ksm_rate;
+  out->saved = 0;
+  for (u32 i = 0; i < KSM_BUCKETS; i++) {
+    for (ksm_node_t *node = buckets[i]; node; node = node->next) {
+      u32 refs = node->frame ? pmm_page_refcount(node->frame) : 0;
+      /* One reference is the table's and one mapping would exist anyway. */
+      if (refs > 2) {
+        out->saved += refs - 2;
+      }
+    }
+  }
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef KSM_H
+#define KSM_H
+
+#include <mlibc/mlibc.h>
+
+/*
+ * Same-page merging. From the timer, whenever it interrupts user mode, a
+ * scanner walks the 4K pages of every address space's anonymous areas at a
+ * set rate and hashes each page only one mapping holds. An all-zero page is remapped
+ * onto the shared zero page. Otherwise pages with the same content are
+ * remapped onto one read-only frame and the other copies are freed:
+ * - A stable table keeps the merged frames, each with a reference of its
+ *   own, so their content never changes.
+ * - An unstable table keeps the pages seen so far in the current pass.
+ *   It is rebuilt on every pass.
+ * Merged pages are copy-on-write, so the first write splits one off again
+ * through the usual fault path.
+ */
+
+/* Default scan rate, pages per second. */
+#define KSM_DEFAULT_RATE 1000
+
+typedef struct {
+  u32 rate;        /* pages per second, 0 when off */
+  u64 scanned;     /* pages hashed */
+  u64 passes;      /* full passes over every address space */
+  u64 merged;      /* pages remapped onto a shared frame */
+  u64 zero_merged; /* pages remapped onto the zero page */
+  u64 shared;      /* merged frames alive */
+  u64 saved;       /* mappings of them beyond the first, frames saved */
+} ksm_stats_t;
+
+/* Timer hook, called only when the tick interrupted user mode, so no page
+ * table update is in progress. */
+void ksm_tick(void);
+
+void ksm_set_rate(u32 pages_per_sec);
+void ksm_get_stats(ksm_stats_t *out);
+
+#endif
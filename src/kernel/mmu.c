@@ -25,14 +25,45 @@
  */
 
 #include <kernel/mmu.h>
+#include <kernel/pmm.h>
+#include <kernel/swap.h>
 #include <lib/com1.h>
 #include <mlibc/memory.h>
 
 #define MSR_EFER 0xC0000080
 #define EFER_NXE (1ULL << 11)
+#define CR0_WP (1ULL << 16)
+#define CR4_PGE (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+#define CR3_NOFLUSH (1ULL << 63)
+#define CPUID_EDX_PGE (1U << 13)
+#define CPUID_ECX_PCID (1U << 17)
+#define CPUID_EDX_PDPE1GB (1U << 26) /* leaf 0x80000001 */
+
+/* PML4 entries of the lower (user) half. The upper half is the kernel's and
+ * is shared by every address space. */
+#define MMU_USER_SLOTS 256
+
+/* Address space tags handed out to processes; 0 is left to untagged loads
+ * of CR3 (boot, exec, exit). */
+#define MMU_PCID_COUNT 256
 
 static u64 g_kernel_cr3 = 0;
 static int mmu_initialized = 0;
+static mmu_cow_stats_t cow_stats;
+
+static int mmu_pge_enabled = 0;
+static int mmu_pcid_enabled = 0;
+static int mmu_gbpages = 0; /* direct map built from 1GB pages */
+static u64 pcid_owner[MMU_PCID_COUNT]; /* PML4 each tag currently names */
+static u16 pcid_next = 1;
+static mmu_tlb_stats_t tlb_stats;
+
+static u64 *mmu_split_user_huge(u64 *pde);
+
+/* Backs every untouched anonymous page that has only been read. It lives in
+ * the kernel image, so the frame allocator never counts or frees it. */
+static u8 mmu_zero_frame[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
 
 static inline void mmu_wrmsr(u32 msr, u64 value) {
   u32 low = value & 0xFFFFFFFF;
@@ -40,12 +71,48 @@ static inline void mmu_wrmsr(u32 msr, u64 value) {
   __asm__ volatile("wrmsr" : : "c"(msr), "a"(low), "d"(high));
 }
 
+static inline void mmu_cpuid(u32 leaf, u32 *ecx, u32 *edx) {
+  u32 eax = leaf, ebx;
+  __asm__ volatile("cpuid"
+                   : "+a"(eax), "=b"(ebx), "=c"(*ecx), "=d"(*edx)
+                   : "c"(0));
+}
+
+static inline u64 mmu_read_cr4(void) {
+  u64 cr4;
+  __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+  return cr4;
+}
+
+static inline void mmu_write_cr4(u64 cr4) {
+  __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
 static inline u64 mmu_rdmsr(u32 msr) {
   u32 low, high;
   __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
   return ((u64)high << 32) | low;
 }
 
+/* Tables are handed around through their direct map address; entries and
+ * CR3 hold the physical one. */
+static inline u64 *mmu_table(u64 entry) {
+  return (u64 *)phys_to_virt(entry & PTE_ADDR_MASK);
+}
+
+/* Page tables come from the pre-zeroed frame pool. Tables are only freed
+ * once every entry has been cleared, so they go back to the pool as is. */
+u64 *mmu_alloc_table(void) {
+  u64 frame = pmm_alloc_zeroed_frame();
+  return frame ? (u64 *)phys_to_virt(frame) : NULL;
+}
+
+void mmu_free_table(u64 *table) {
+  if (table) {
+    pmm_free_zeroed_frame(virt_to_phys(table));
+  }
+}
+
 static u64 *split_huge_pde(u64 *pd, u16 pd_index, u64 flags) {
   u64 pde = pd[pd_index];
   if (!(pde & PTE_PRESENT) || !(pde & PTE_HUGE)) {
@@ -55,19 +122,18 @@ static u64 *split_huge_pde(u64 *pd, u16 pd_index, u64 flags) {
   u64 base = pde & PTE_ADDR_MASK;
   u64 pde_flags = pde & PTE_FLAGS_MASK;
 
-  u64 *pt = (u64 *)kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+  u64 *pt = mmu_alloc_table();
   if (!pt) {
     com1_printf("[MMU] Error: Failed to split huge page\n");
     return NULL;
   }
-  memset(pt, 0, PAGE_SIZE);
 
   u64 entry_flags = (pde_flags & ~PTE_HUGE) | PTE_PRESENT;
   for (u64 i = 0; i < 512; i++) {
     pt[i] = (base + (i * PAGE_SIZE)) | entry_flags;
   }
 
-  u64 new_pde = (u64)pt | PTE_PRESENT | PTE_RW;
+  u64 new_pde = virt_to_phys(pt) | PTE_PRESENT | PTE_RW;
   if (flags & PTE_USER) {
     new_pde |= PTE_USER;
   } else if (pde_flags & PTE_USER) {
@@ -78,16 +144,72 @@ static u64 *split_huge_pde(u64 *pd, u16 pd_index, u64 flags) {
   return pt;
 }
 
+/* Same for a 1GB entry: a page directory of 2MB entries over the same
+ * memory, with the same flags. */
+static u64 *split_huge_pdpte(u64 *pdpt, u16 pdpt_index) {
+  u64 pdpte = pdpt[pdpt_index];
+  if (!(pdpte & PTE_PRESENT) || !(pdpte & PTE_HUGE)) {
+    return NULL;
+  }
+
+  u64 base = pdpte & PTE_ADDR_MASK;
+  u64 pdpte_flags = pdpte & PTE_FLAGS_MASK;
+
+  u64 *pd = mmu_alloc_table();
+  if (!pd) {
+    com1_printf("[MMU] Error: Failed to split 1GB page\n");
+    return NULL;
+  }
+
+  for (u64 i = 0; i < 512; i++) {
+    pd[i] = (base + i * HUGE_PAGE_SIZE) | pdpte_flags;
+  }
+
+  pdpt[pdpt_index] =
+      virt_to_phys(pd) | (pdpte_flags & PTE_USER) | PTE_PRESENT | PTE_RW;
+  return pd;
+}
+
 void mmu_init() {
   u64 efer = mmu_rdmsr(MSR_EFER);
   if (!(efer & EFER_NXE)) {
     mmu_wrmsr(MSR_EFER, efer | EFER_NXE);
   }
+  /* Kernel writes to user memory must fault on read-only copy-on-write
+   * pages too, or they would land in a frame another process still sees. */
+  u64 cr0;
+  __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+  __asm__ volatile("mov %0, %%cr0" : : "r"(cr0 | CR0_WP) : "memory");
+
+  /* Kernel window mappings are marked global, so they survive CR3 loads.
+   * PCIDs keep each address space's entries across switches; they are only
+   * used with PGE, whose toggle is the one way to flush every tag. */
+  u32 ecx, edx;
+  mmu_cpuid(1, &ecx, &edx);
+  u64 cr4 = mmu_read_cr4();
+  if (edx & CPUID_EDX_PGE) {
+    cr4 |= CR4_PGE;
+    mmu_pge_enabled = 1;
+  }
+  if ((ecx & CPUID_ECX_PCID) && mmu_pge_enabled &&
+      (mmu_read_cr3() & 0xFFF) == 0) {
+    cr4 |= CR4_PCIDE;
+    mmu_pcid_enabled = 1;
+  }
+  mmu_write_cr4(cr4);
+
+  /* boot.s builds the direct map from 1GB pages under the same check. */
+  mmu_cpuid(0x80000001, &ecx, &edx);
+  mmu_gbpages = (edx & CPUID_EDX_PDPE1GB) != 0;
+
   u64 cr3 = mmu_read_cr3();
   if (g_kernel_cr3 == 0) {
     g_kernel_cr3 = cr3;
   }
-  com1_printf("[MMU] Initialized. Current CR3: %p\n", (void *)cr3);
+  com1_printf("[MMU] Initialized. Current CR3: %p, PGE %s, PCID %s, "
+              "1GB pages %s\n",
+              (void *)cr3, mmu_pge_enabled ? "on" : "off",
+              mmu_pcid_enabled ? "on" : "off", mmu_gbpages ? "on" : "off");
   mmu_initialized = 1;
 }
 
@@ -107,42 +229,29 @@ static u64 *get_next_level_from(u64 *current_table, u16 index, int alloc,
   u64 entry = current_table[index];
 
   if (entry & PTE_PRESENT) {
-    /* If we are mapping a user page, ensure the directory entry has USER.
-     * If it was a kernel-only shared table, clone it to avoid global mutation.
-     */
+    /* A large page has no table below it; callers split it first. */
+    if (entry & PTE_HUGE) {
+      return NULL;
+    }
+    /* User pages only go in the lower half, whose tables belong to this
+     * address space alone, so the entry can simply be opened up. */
     if (flags & PTE_USER) {
-      if (!(entry & PTE_USER)) {
-        u64 *old_table = (u64 *)(entry & PTE_ADDR_MASK);
-        u64 *new_table = (u64 *)kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
-        if (!new_table) {
-          com1_printf("[MMU] Error: Failed to allocate page table!\n");
-          return NULL;
-        }
-        memcpy(new_table, old_table, PAGE_SIZE);
-        u64 new_entry = ((u64)new_table) | (entry & PTE_FLAGS_MASK) | PTE_USER |
-                        PTE_PRESENT;
-        current_table[index] = new_entry;
-        entry = new_entry;
-      } else {
-        current_table[index] |= PTE_USER;
-      }
+      current_table[index] |= PTE_USER;
     }
-    return (u64 *)(entry & PTE_ADDR_MASK);
+    return mmu_table(entry);
   }
 
   if (!alloc) {
     return NULL;
   }
 
-  u64 *new_table = (u64 *)kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+  u64 *new_table = mmu_alloc_table();
   if (!new_table) {
     com1_printf("[MMU] Error: Failed to allocate page table!\n");
     return NULL;
   }
 
-  memset(new_table, 0, PAGE_SIZE);
-
-  u64 new_entry = (u64)new_table | PTE_PRESENT | PTE_RW;
+  u64 new_entry = virt_to_phys(new_table) | PTE_PRESENT | PTE_RW;
   if (flags & PTE_USER) {
     new_entry |= PTE_USER;
   }
@@ -151,60 +260,162 @@ static u64 *get_next_level_from(u64 *current_table, u16 index, int alloc,
   return new_table;
 }
 
-void mmu_map_page(u64 vaddr, u64 paddr, u64 flags) {
-  u64 pml4_index = (vaddr >> 39) & 0x1FF;
-  u64 pdpt_index = (vaddr >> 30) & 0x1FF;
-  u64 pd_index = (vaddr >> 21) & 0x1FF;
-  u64 pt_index = (vaddr >> 12) & 0x1FF;
+/* Drop the tag of an address space that is going away or is being loaded
+ * untagged and changed under tag 0; its next tagged load starts clean. */
+static void mmu_pcid_forget(u64 pml4) {
+  for (u32 i = 1; i < MMU_PCID_COUNT; i++) {
+    if (pcid_owner[i] == pml4) {
+      pcid_owner[i] = 0;
+    }
+  }
+}
 
-  u64 *pml4 = (u64 *)(mmu_read_cr3() & PTE_ADDR_MASK);
+void mmu_write_cr3(u64 cr3) {
+  if (mmu_pcid_enabled) {
+    mmu_pcid_forget(cr3 & PTE_ADDR_MASK);
+  }
+  __asm__ volatile("mov %0, %%cr3" : : "r"(cr3 & ~CR3_NOFLUSH) : "memory");
+}
 
-  u64 *pdpt = get_next_level_from(pml4, pml4_index, 1, flags);
-  if (!pdpt)
+void mmu_switch_address_space(u64 cr3, u16 *pcid) {
+  u64 pml4 = cr3 & PTE_ADDR_MASK;
+  tlb_stats.switches++;
+  if (!mmu_pcid_enabled) {
+    __asm__ volatile("mov %0, %%cr3" : : "r"(pml4) : "memory");
     return;
+  }
 
-  u64 *pd = get_next_level_from(pdpt, pdpt_index, 1, flags);
-  if (!pd)
+  if (*pcid && *pcid < MMU_PCID_COUNT && pcid_owner[*pcid] == pml4) {
+    u64 value = pml4 | *pcid | CR3_NOFLUSH;
+    __asm__ volatile("mov %0, %%cr3" : : "r"(value) : "memory");
+    tlb_stats.kept++;
+    return;
+  }
+
+  /* Prefer a free tag; with none left, take the next one round robin. */
+  u16 tag = pcid_next;
+  for (u32 n = 0; n < MMU_PCID_COUNT - 1; n++) {
+    u16 candidate = (u16)(1 + (pcid_next - 1 + n) % (MMU_PCID_COUNT - 1));
+    if (!pcid_owner[candidate]) {
+      tag = candidate;
+      break;
+    }
+  }
+  if (pcid_owner[tag]) {
+    tlb_stats.recycled++;
+  }
+  pcid_next = (u16)(tag % (MMU_PCID_COUNT - 1) + 1);
+  pcid_owner[tag] = pml4;
+  *pcid = tag;
+  tlb_stats.assigned++;
+  /* Without NOFLUSH: clears whatever the tag's previous owner left. */
+  u64 value = pml4 | tag;
+  __asm__ volatile("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+void mmu_flush_tlb_all(void) {
+  tlb_stats.global_flushes++;
+  if (mmu_pge_enabled) {
+    u64 cr4 = mmu_read_cr4();
+    mmu_write_cr4(cr4 & ~CR4_PGE);
+    mmu_write_cr4(cr4);
     return;
+  }
+  mmu_flush_tlb();
+}
+
+void mmu_tlb_get_stats(mmu_tlb_stats_t *out) {
+  *out = tlb_stats;
+  out->pcid = mmu_pcid_enabled;
+  out->pge = mmu_pge_enabled;
+  out->gbpages = mmu_gbpages;
+}
+
+/* The kernel half is the same in every address space. */
+static u64 mmu_leaf_flags(u64 vaddr, u64 flags) {
+  if (!(flags & PTE_USER) && (vaddr >> 47)) {
+    flags |= PTE_GLOBAL;
+  }
+  return flags;
+}
 
+/* Page table holding vaddr's entry, creating the levels above it and
+ * splitting a 1GB or 2MB entry in the way. */
+static u64 *mmu_leaf_table(u64 *pml4, u64 vaddr, u64 flags) {
+  if ((flags & PTE_USER) && (vaddr >> 47)) {
+    com1_printf("[MMU] Error: user mapping at kernel address %p\n",
+                (void *)vaddr);
+    return NULL;
+  }
+
+  u64 *pdpt = get_next_level_from(pml4, (vaddr >> 39) & 0x1FF, 1, flags);
+  if (!pdpt)
+    return NULL;
+
+  u64 pdpt_index = (vaddr >> 30) & 0x1FF;
+  u64 pdpte = pdpt[pdpt_index];
+  if ((pdpte & PTE_PRESENT) && (pdpte & PTE_HUGE)) {
+    if (!split_huge_pdpte(pdpt, pdpt_index)) {
+      return NULL;
+    }
+  }
+
+  u64 *pd = get_next_level_from(pdpt, (vaddr >> 30) & 0x1FF, 1, flags);
+  if (!pd)
+    return NULL;
+
+  u64 pd_index = (vaddr >> 21) & 0x1FF;
   u64 pde = pd[pd_index];
   if ((pde & PTE_PRESENT) && (pde & PTE_HUGE)) {
     if (!split_huge_pde(pd, pd_index, flags)) {
-      return;
+      return NULL;
     }
   }
 
-  u64 *pt = get_next_level_from(pd, pd_index, 1, flags);
+  return get_next_level_from(pd, pd_index, 1, flags);
+}
+
+void mmu_map_page(u64 vaddr, u64 paddr, u64 flags) {
+  flags = mmu_leaf_flags(vaddr, flags);
+  u64 *pml4 = mmu_table(mmu_read_cr3());
+  u64 *pt = mmu_leaf_table(pml4, vaddr, flags);
   if (!pt)
     return;
 
-  pt[pt_index] =
+  pt[(vaddr >> 12) & 0x1FF] =
       (paddr & PTE_ADDR_MASK) | (flags & PTE_FLAGS_MASK) | PTE_PRESENT;
 
   mmu_invlpg(vaddr);
 }
 
-void mmu_unmap_page(u64 vaddr) {
+/* Clear a 4KB mapping without touching the TLB; returns the old entry. */
+u64 mmu_unmap_page_noflush(u64 vaddr) {
   u64 pml4_index = (vaddr >> 39) & 0x1FF;
   u64 pdpt_index = (vaddr >> 30) & 0x1FF;
   u64 pd_index = (vaddr >> 21) & 0x1FF;
   u64 pt_index = (vaddr >> 12) & 0x1FF;
 
-  u64 *pml4 = (u64 *)(mmu_read_cr3() & PTE_ADDR_MASK);
+  u64 *pml4 = mmu_table(mmu_read_cr3());
 
   u64 *pdpt = get_next_level_from(pml4, pml4_index, 0, 0);
   if (!pdpt)
-    return;
+    return 0;
 
   u64 *pd = get_next_level_from(pdpt, pdpt_index, 0, 0);
   if (!pd)
-    return;
+    return 0;
 
   u64 *pt = get_next_level_from(pd, pd_index, 0, 0);
   if (!pt)
-    return;
+    return 0;
 
+  u64 old = pt[pt_index];
   pt[pt_index] = 0;
+  return old;
+}
+
+void mmu_unmap_page(u64 vaddr) {
+  mmu_unmap_page_noflush(vaddr);
   mmu_invlpg(vaddr);
 }
 
@@ -214,22 +425,12 @@ u64 mmu_virt_to_phys(u64 vaddr) {
   u64 pd_index = (vaddr >> 21) & 0x1FF;
   u64 pt_index = (vaddr >> 12) & 0x1FF;
 
-  u64 *pml4 = (u64 *)(mmu_read_cr3() & PTE_ADDR_MASK);
-
-  u64 *pdpt = get_next_level_from(pml4, pml4_index, 0, 0);
-  if (!pdpt)
-    return 0;
-
-  u64 *pd = get_next_level_from(pdpt, pdpt_index, 0, 0);
-  if (!pd)
-    return 0;
-
-  u64 pd_entry = ((u64 *)pdpt)[pdpt_index];
+  u64 *pml4 = mmu_table(mmu_read_cr3());
 
   u64 pml4e = pml4[pml4_index];
   if (!(pml4e & PTE_PRESENT))
     return 0;
-  pdpt = (u64 *)(pml4e & PTE_ADDR_MASK);
+  u64 *pdpt = mmu_table(pml4e);
 
   u64 pdpte = pdpt[pdpt_index];
   if (!(pdpte & PTE_PRESENT))
@@ -239,7 +440,7 @@ u64 mmu_virt_to_phys(u64 vaddr) {
     return (pdpte & PTE_ADDR_MASK) + (vaddr & 0x3FFFFFFF);
   }
 
-  pd = (u64 *)(pdpte & PTE_ADDR_MASK);
+  u64 *pd = mmu_table(pdpte);
   u64 pde = pd[pd_index];
   if (!(pde & PTE_PRESENT))
     return 0;
@@ -248,7 +449,7 @@ u64 mmu_virt_to_phys(u64 vaddr) {
     return (pde & PTE_ADDR_MASK) + (vaddr & 0x1FFFFF);
   }
 
-  u64 *pt = (u64 *)(pde & PTE_ADDR_MASK);
+  u64 *pt = mmu_table(pde);
   u64 pte = pt[pt_index];
   if (!(pte & PTE_PRESENT))
     return 0;
@@ -261,61 +462,55 @@ void mmu_map_page_in(u64 *pml4, u64 vaddr, u64 paddr, u64 flags) {
     return;
   }
 
-  u64 pml4_index = (vaddr >> 39) & 0x1FF;
-  u64 pdpt_index = (vaddr >> 30) & 0x1FF;
-  u64 pd_index = (vaddr >> 21) & 0x1FF;
-  u64 pt_index = (vaddr >> 12) & 0x1FF;
-
-  u64 *pdpt = get_next_level_from(pml4, pml4_index, 1, flags);
-  if (!pdpt)
-    return;
-
-  u64 *pd = get_next_level_from(pdpt, pdpt_index, 1, flags);
-  if (!pd)
-    return;
-
-  u64 *pt = get_next_level_from(pd, pd_index, 1, flags);
+  u64 *pt = mmu_leaf_table(pml4, vaddr, flags);
   if (!pt)
     return;
 
-  pt[pt_index] =
+  pt[(vaddr >> 12) & 0x1FF] =
       (paddr & PTE_ADDR_MASK) | (flags & PTE_FLAGS_MASK) | PTE_PRESENT;
 }
 
+/* The lower half starts empty; the upper half points at the kernel's own
+ * PDPTs, so kernel mappings under them are shared and never copied. */
 u64 mmu_create_address_space(void) {
-  u64 *src_pml4 = (u64 *)(mmu_kernel_cr3() & PTE_ADDR_MASK);
-  u64 *new_pml4 = (u64 *)kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+  u64 *src_pml4 = mmu_table(mmu_kernel_cr3());
+  u64 *new_pml4 = mmu_alloc_table();
   if (!new_pml4) {
     return 0;
   }
-  memset(new_pml4, 0, PAGE_SIZE);
 
-  for (int i = 0; i < 512; i++) {
-    u64 entry = src_pml4[i];
-    if (!(entry & PTE_PRESENT)) {
-      continue;
-    }
-    new_pml4[i] = entry;
-  }
-
-  return (u64)new_pml4;
+  memcpy(new_pml4 + MMU_USER_SLOTS, src_pml4 + MMU_USER_SLOTS,
+         (512 - MMU_USER_SLOTS) * sizeof(u64));
+  return virt_to_phys(new_pml4);
 }
 
 u64 mmu_kernel_cr3(void) { return g_kernel_cr3; }
 
+/* Make sure the kernel PML4 has a table for the 512 GB slot holding vaddr.
+ * Address spaces copy the kernel half of the PML4 when they are created, so
+ * calling this before any process exists keeps later mappings there
+ * shared. */
+int mmu_share_kernel_region(u64 vaddr) {
+  if (!mmu_kernel_cr3()) {
+    return -1;
+  }
+  u64 *pml4 = mmu_table(mmu_kernel_cr3());
+  return get_next_level_from(pml4, (vaddr >> 39) & 0x1FF, 1, 0) ? 0 : -1;
+}
+
 u64 mmu_get_pte_flags(u64 vaddr) {
   u64 pml4_index = (vaddr >> 39) & 0x1FF;
   u64 pdpt_index = (vaddr >> 30) & 0x1FF;
   u64 pd_index = (vaddr >> 21) & 0x1FF;
   u64 pt_index = (vaddr >> 12) & 0x1FF;
 
-  u64 *pml4 = (u64 *)(mmu_read_cr3() & PTE_ADDR_MASK);
+  u64 *pml4 = mmu_table(mmu_read_cr3());
 
   u64 pml4e = pml4[pml4_index];
   if (!(pml4e & PTE_PRESENT)) {
     return 0;
   }
-  u64 *pdpt = (u64 *)(pml4e & PTE_ADDR_MASK);
+  u64 *pdpt = mmu_table(pml4e);
   u64 pdpte = pdpt[pdpt_index];
   if (!(pdpte & PTE_PRESENT)) {
     return 0;
@@ -323,7 +518,7 @@ u64 mmu_get_pte_flags(u64 vaddr) {
   if (pdpte & PTE_HUGE) {
     return pdpte & PTE_FLAGS_MASK;
   }
-  u64 *pd = (u64 *)(pdpte & PTE_ADDR_MASK);
+  u64 *pd = mmu_table(pdpte);
   u64 pde = pd[pd_index];
   if (!(pde & PTE_PRESENT)) {
     return 0;
@@ -331,7 +526,7 @@ u64 mmu_get_pte_flags(u64 vaddr) {
   if (pde & PTE_HUGE) {
     return pde & PTE_FLAGS_MASK;
   }
-  u64 *pt = (u64 *)(pde & PTE_ADDR_MASK);
+  u64 *pt = mmu_table(pde);
   u64 pte = pt[pt_index];
   if (!(pte & PTE_PRESENT)) {
     return 0;
@@ -339,81 +534,174 @@ u64 mmu_get_pte_flags(u64 vaddr) {
   return pte & PTE_FLAGS_MASK;
 }
 
-void mmu_clear_user_range(u64 start, u64 end) {
-  if (end <= start) {
-    return;
+/* The 4K entry for a user page of any address space, NULL when a table is
+ * missing or a large page covers it. Never allocates or splits. */
+static u64 *mmu_user_pte_in(u64 cr3, u64 vaddr) {
+  u64 *pml4 = mmu_table(cr3);
+  u64 pml4e = pml4[(vaddr >> 39) & 0x1FF];
+  if (!(pml4e & PTE_PRESENT)) {
+    return NULL;
   }
+  u64 pdpte = mmu_table(pml4e)[(vaddr >> 30) & 0x1FF];
+  if (!(pdpte & PTE_PRESENT) || (pdpte & PTE_HUGE)) {
+    return NULL;
+  }
+  u64 pde = mmu_table(pdpte)[(vaddr >> 21) & 0x1FF];
+  if (!(pde & PTE_PRESENT) || (pde & PTE_HUGE)) {
+    return NULL;
+  }
+  return &mmu_table(pde)[(vaddr >> 12) & 0x1FF];
+}
 
-  u64 vaddr = start & ~(PAGE_SIZE - 1);
-  for (; vaddr < end; vaddr += PAGE_SIZE) {
-    u64 pml4_index = (vaddr >> 39) & 0x1FF;
-    u64 pdpt_index = (vaddr >> 30) & 0x1FF;
-    u64 pd_index = (vaddr >> 21) & 0x1FF;
-    u64 pt_index = (vaddr >> 12) & 0x1FF;
+u64 mmu_get_user_pte(u64 cr3, u64 vaddr) {
+  u64 *pte = mmu_user_pte_in(cr3, vaddr);
+  return pte ? *pte : 0;
+}
 
-    u64 *pml4 = (u64 *)(mmu_read_cr3() & PTE_ADDR_MASK);
-    u64 pml4e = pml4[pml4_index];
-    if (!(pml4e & PTE_PRESENT)) {
-      continue;
-    }
+void mmu_clear_accessed(u64 cr3, u64 vaddr) {
+  u64 *pte = mmu_user_pte_in(cr3, vaddr);
+  if (pte) {
+    *pte &= ~(u64)PTE_ACCESSED;
+  }
+}
+
+u64 mmu_evict_user_page(u64 cr3, u64 vaddr) {
+  return mmu_set_user_pte(cr3, vaddr, 0);
+}
+
+u64 mmu_set_user_pte(u64 cr3, u64 vaddr, u64 entry) {
+  u64 *pte = mmu_user_pte_in(cr3, vaddr);
+  if (!pte || !(*pte & PTE_PRESENT)) {
+    return 0;
+  }
+  u64 old = *pte;
+  *pte = entry;
+  mmu_flush_user_page(cr3, vaddr);
+  return old;
+}
+
+void mmu_flush_user_page(u64 cr3, u64 vaddr) {
+  u64 pml4 = cr3 & PTE_ADDR_MASK;
+  if (pml4 == (mmu_read_cr3() & PTE_ADDR_MASK)) {
+    mmu_invlpg(vaddr);
+  } else if (mmu_pcid_enabled) {
+    /* Its tag may still cache the page; the next switch flushes it. */
+    mmu_pcid_forget(pml4);
+  }
+}
 
-    u64 *pdpt = (u64 *)(pml4e & PTE_ADDR_MASK);
-    u64 pdpte = pdpt[pdpt_index];
-    if (!(pdpte & PTE_PRESENT)) {
+u64 mmu_scan_user_ptes(u64 cr3, u64 start, u64 end, mmu_pte_fn fn,
+                       void *ctx) {
+  u64 *pml4 = mmu_table(cr3);
+  u64 vaddr = start & ~((u64)PAGE_SIZE - 1);
+  while (vaddr < end) {
+    u64 pml4e = pml4[(vaddr >> 39) & 0x1FF];
+    if (!(pml4e & PTE_PRESENT)) {
+      vaddr = (vaddr | ((1ULL << 39) - 1)) + 1;
       continue;
     }
-    if (pdpte & PTE_HUGE) {
-      // 1GB huge page: nothing to do safely here
+    u64 pdpte = mmu_table(pml4e)[(vaddr >> 30) & 0x1FF];
+    if (!(pdpte & PTE_PRESENT) || (pdpte & PTE_HUGE)) {
+      vaddr = (vaddr | ((1ULL << 30) - 1)) + 1;
       continue;
     }
-
-    u64 *pd = (u64 *)(pdpte & PTE_ADDR_MASK);
-    u64 pde = pd[pd_index];
-    if (!(pde & PTE_PRESENT)) {
+    u64 pde = mmu_table(pdpte)[(vaddr >> 21) & 0x1FF];
+    u64 next = (vaddr | (HUGE_PAGE_SIZE - 1)) + 1;
+    if (!(pde & PTE_PRESENT) || (pde & PTE_HUGE)) {
+      vaddr = next;
       continue;
     }
-    if (pde & PTE_HUGE) {
-      if (!split_huge_pde(pd, pd_index, pde & PTE_FLAGS_MASK)) {
-        continue;
-      }
-      pde = pd[pd_index];
-      if (!(pde & PTE_PRESENT) || (pde & PTE_HUGE)) {
-        continue;
+    u64 *pt = mmu_table(pde);
+    for (; vaddr < next && vaddr < end; vaddr += PAGE_SIZE) {
+      u64 *pte = &pt[(vaddr >> 12) & 0x1FF];
+      if ((*pte & (PTE_PRESENT | PTE_USER)) == (PTE_PRESENT | PTE_USER) &&
+          fn(vaddr, pte, ctx)) {
+        return vaddr + PAGE_SIZE;
       }
     }
+  }
+  return end;
+}
 
-    u64 *pt = (u64 *)(pde & PTE_ADDR_MASK);
-    u64 *pte = &pt[pt_index];
-    if (!(*pte & PTE_PRESENT)) {
+/* End of the direct map: the boot page tables cover the first 4 GB. */
+static u64 direct_map_end = 0x100000000ULL;
+
+int mmu_map_direct(u64 end) {
+  if (end > KERNEL_DIRECT_MAP_SIZE) {
+    end = KERNEL_DIRECT_MAP_SIZE;
+  }
+  end = (end + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+  u64 *pml4 = mmu_table(mmu_kernel_cr3());
+  u64 flags = PTE_PRESENT | PTE_RW | PTE_HUGE | PTE_GLOBAL | PTE_NX;
+  while (direct_map_end < end) {
+    u64 vaddr = KERNEL_DIRECT_MAP_BASE + direct_map_end;
+    u64 *pdpt = get_next_level_from(pml4, (vaddr >> 39) & 0x1FF, 1, 0);
+    if (!pdpt) {
+      break;
+    }
+    /* Whole gigabytes of RAM take one 1GB entry; the tail gets 2MB ones
+     * so no memory hole past the end is mapped. */
+    u64 pdpt_index = (vaddr >> 30) & 0x1FF;
+    if (mmu_gbpages && !(pdpt[pdpt_index] & PTE_PRESENT) &&
+        (direct_map_end & ((1ULL << 30) - 1)) == 0 &&
+        end - direct_map_end >= (1ULL << 30)) {
+      pdpt[pdpt_index] = direct_map_end | flags;
+      direct_map_end += 1ULL << 30;
       continue;
     }
-    if (*pte & PTE_USER) {
-      *pte &= ~PTE_USER;
-      mmu_invlpg(vaddr);
+    u64 *pd = get_next_level_from(pdpt, pdpt_index, 1, 0);
+    if (!pd) {
+      break;
     }
+    pd[(vaddr >> 21) & 0x1FF] = direct_map_end | flags;
+    direct_map_end += HUGE_PAGE_SIZE;
+  }
+  if (direct_map_end < end) {
+    com1_printf("[MMU] Error: direct map stops at %p\n",
+                (void *)direct_map_end);
+    return -1;
   }
+  return 0;
+}
+
+void mmu_drop_identity_map(void) {
+  u64 *pml4 = mmu_table(mmu_kernel_cr3());
+  pml4[0] = 0;
+  mmu_flush_tlb_all();
+  com1_printf("[MMU] Identity map dropped, direct map ends at %p\n",
+              (void *)direct_map_end);
+}
+
+/* Take a reference on the frame behind a user entry for a second address
+ * space and make a writable entry copy-on-write. Frames the allocator does
+ * not own (device memory) stay shared as they are. */
+static u64 mmu_cow_share(u64 entry) {
+  if (pmm_page_get(entry & PTE_ADDR_MASK) != 0) {
+    return entry;
+  }
+  if (entry & PTE_RW) {
+    entry = (entry & ~PTE_RW) | PTE_COW;
+  }
+  cow_stats.shared++;
+  return entry;
 }
 
 static int mmu_copy_user_pages(u64 *dst_pml4, u64 *src_pml4) {
-  for (u64 i = 0; i < 512; i++) {
+  for (u64 i = 0; i < MMU_USER_SLOTS; i++) {
     u64 pml4e = src_pml4[i];
-    if (!(pml4e & PTE_PRESENT)) {
-      continue;
-    }
-    if (!(pml4e & PTE_USER)) {
-      dst_pml4[i] = pml4e;
+    if (!(pml4e & PTE_PRESENT) || !(pml4e & PTE_USER)) {
       continue;
     }
 
-    u64 *src_pdpt = (u64 *)(pml4e & PTE_ADDR_MASK);
-    u64 *dst_pdpt = (u64 *)kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+    u64 *src_pdpt = mmu_table(pml4e);
+    u64 *dst_pdpt = mmu_alloc_table();
     if (!dst_pdpt) {
       return -1;
     }
-    memset(dst_pdpt, 0, PAGE_SIZE);
 
     u64 pml4_flags = pml4e & PTE_FLAGS_MASK;
-    dst_pml4[i] = ((u64)dst_pdpt) | pml4_flags | PTE_PRESENT;
+    dst_pml4[i] = virt_to_phys(dst_pdpt) | pml4_flags | PTE_PRESENT;
 
     for (u64 j = 0; j < 512; j++) {
       u64 pdpte = src_pdpt[j];
@@ -433,15 +721,14 @@ static int mmu_copy_user_pages(u64 *dst_pml4, u64 *src_pml4) {
         continue;
       }
 
-      u64 *src_pd = (u64 *)(pdpte & PTE_ADDR_MASK);
-      u64 *dst_pd = (u64 *)kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+      u64 *src_pd = mmu_table(pdpte);
+      u64 *dst_pd = mmu_alloc_table();
       if (!dst_pd) {
         return -1;
       }
-      memset(dst_pd, 0, PAGE_SIZE);
 
       u64 pdpt_flags = pdpte & PTE_FLAGS_MASK;
-      dst_pdpt[j] = ((u64)dst_pd) | pdpt_flags | PTE_PRESENT;
+      dst_pdpt[j] = virt_to_phys(dst_pd) | pdpt_flags | PTE_PRESENT;
 
       for (u64 k = 0; k < 512; k++) {
         u64 pde = src_pd[k];
@@ -453,26 +740,9 @@ static int mmu_copy_user_pages(u64 *dst_pml4, u64 *src_pml4) {
             dst_pd[k] = pde;
             continue;
           }
-          u64 *dst_pt = (u64 *)kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
-          if (!dst_pt) {
-            return -1;
-          }
-          memset(dst_pt, 0, PAGE_SIZE);
-
-          u64 pd_flags = pde & PTE_FLAGS_MASK;
-          dst_pd[k] = ((u64)dst_pt) | (pd_flags & ~PTE_HUGE) | PTE_PRESENT;
-
-          for (u64 l = 0; l < 512; l++) {
-            u64 vaddr = (i << 39) | (j << 30) | (k << 21) | (l << 12);
-            void *new_page = kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
-            if (!new_page) {
-              return -1;
-            }
-            memcpy(new_page, (void *)vaddr, PAGE_SIZE);
-            u64 phys = mmu_virt_to_phys((u64)new_page);
-            u64 pte_flags = (pd_flags & PTE_FLAGS_MASK) | PTE_USER;
-            dst_pt[l] = (phys & PTE_ADDR_MASK) | pte_flags | PTE_PRESENT;
-          }
+          /* The whole 2MB block is shared; the first write copies it. */
+          src_pd[k] = mmu_cow_share(pde);
+          dst_pd[k] = src_pd[k];
           continue;
         }
         if (!(pde & PTE_USER)) {
@@ -480,19 +750,23 @@ static int mmu_copy_user_pages(u64 *dst_pml4, u64 *src_pml4) {
           continue;
         }
 
-        u64 *src_pt = (u64 *)(pde & PTE_ADDR_MASK);
-        u64 *dst_pt = (u64 *)kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+        u64 *src_pt = mmu_table(pde);
+        u64 *dst_pt = mmu_alloc_table();
         if (!dst_pt) {
           return -1;
         }
-        memset(dst_pt, 0, PAGE_SIZE);
 
         u64 pd_flags = pde & PTE_FLAGS_MASK;
-        dst_pd[k] = ((u64)dst_pt) | pd_flags | PTE_PRESENT;
+        dst_pd[k] = virt_to_phys(dst_pt) | pd_flags | PTE_PRESENT;
 
         for (u64 l = 0; l < 512; l++) {
           u64 pte = src_pt[l];
           if (!(pte & PTE_PRESENT)) {
+            /* Both copies name the slot until one reads it back. */
+            if (mmu_is_swap_entry(pte)) {
+              swap_entry_dup(pte);
+              dst_pt[l] = pte;
+            }
             continue;
           }
           if (!(pte & PTE_USER)) {
@@ -500,16 +774,8 @@ static int mmu_copy_user_pages(u64 *dst_pml4, u64 *src_pml4) {
             continue;
           }
 
-          u64 vaddr = (i << 39) | (j << 30) | (k << 21) | (l << 12);
-          void *new_page = kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
-          if (!new_page) {
-            return -1;
-          }
-          memcpy(new_page, (void *)vaddr, PAGE_SIZE);
-
-          u64 phys = mmu_virt_to_phys((u64)new_page);
-          u64 pte_flags = pte & PTE_FLAGS_MASK;
-          dst_pt[l] = (phys & PTE_ADDR_MASK) | pte_flags | PTE_PRESENT;
+          src_pt[l] = mmu_cow_share(pte);
+          dst_pt[l] = src_pt[l];
         }
       }
     }
@@ -519,32 +785,575 @@ static int mmu_copy_user_pages(u64 *dst_pml4, u64 *src_pml4) {
 }
 
 u64 mmu_clone_user_space(u64 src_cr3) {
-  u64 *src_pml4 = (u64 *)(src_cr3 & PTE_ADDR_MASK);
-  u64 *dst_pml4 = (u64 *)mmu_create_address_space();
-  if (!dst_pml4) {
+  u64 *src_pml4 = mmu_table(src_cr3);
+  u64 dst_cr3 = mmu_create_address_space();
+  if (!dst_cr3) {
     return 0;
   }
 
-  if (mmu_copy_user_pages(dst_pml4, src_pml4) != 0) {
-    mmu_free_user_space((u64)dst_pml4);
+  int err = mmu_copy_user_pages(mmu_table(dst_cr3), src_pml4);
+  /* The source lost write access to everything it now shares. */
+  if ((mmu_read_cr3() & PTE_ADDR_MASK) == (src_cr3 & PTE_ADDR_MASK)) {
+    mmu_flush_tlb();
+  }
+  if (err != 0) {
+    mmu_destroy_address_space(dst_cr3);
     return 0;
   }
 
-  return (u64)dst_pml4;
+  return dst_cr3;
 }
 
-void mmu_free_user_space(u64 cr3) {
-  u64 *pml4 = (u64 *)(cr3 & PTE_ADDR_MASK);
-  if (!pml4) {
+int mmu_handle_cow_fault(u64 vaddr) {
+  u64 *pml4 = mmu_table(mmu_read_cr3());
+  u64 *pdpt = get_next_level_from(pml4, (vaddr >> 39) & 0x1FF, 0, 0);
+  if (!pdpt) {
+    return -1;
+  }
+  u64 pdpte = pdpt[(vaddr >> 30) & 0x1FF];
+  if (!(pdpte & PTE_PRESENT) || (pdpte & PTE_HUGE)) {
+    return -1;
+  }
+
+  u64 *pd = mmu_table(pdpte);
+  u64 *entry = &pd[(vaddr >> 21) & 0x1FF];
+  u32 order = 9;
+  if ((*entry & PTE_PRESENT) && !(*entry & PTE_HUGE)) {
+    u64 *pt = mmu_table(*entry);
+    entry = &pt[(vaddr >> 12) & 0x1FF];
+    order = 0;
+  }
+  if (!(*entry & PTE_PRESENT) || !(*entry & PTE_COW)) {
+    return -1;
+  }
+
+  u64 size = (u64)PAGE_SIZE << order;
+  u64 old = *entry & PTE_ADDR_MASK & ~(size - 1);
+  u64 flags = (*entry & PTE_FLAGS_MASK & ~PTE_COW) | PTE_RW;
+
+  if (old == mmu_zero_page()) {
+    u64 page = pmm_alloc_zeroed_frame();
+    if (!page) {
+      return -1;
+    }
+    *entry = page | flags;
+    mmu_invlpg(vaddr);
+    cow_stats.zero_filled++;
+    return 0;
+  }
+
+  if (pmm_page_refcount(old) == 1) {
+    *entry = old | flags;
+    mmu_invlpg(vaddr);
+    cow_stats.reused++;
+    return 0;
+  }
+
+  u64 copy = alloc_pages(order);
+  if (!copy && order == 9 && mmu_split_user_huge(entry)) {
+    /* No free 2MB block: the split gave this process private 4K copies. */
+    mmu_invlpg(vaddr);
+    cow_stats.copied++;
+    return 0;
+  }
+  if (!copy) {
+    return -1;
+  }
+  memcpy(phys_to_virt(copy), phys_to_virt(old), size);
+  *entry = copy | flags;
+  mmu_invlpg(vaddr);
+  pmm_page_put(old);
+  cow_stats.copied++;
+  return 0;
+}
+
+void mmu_cow_get_stats(mmu_cow_stats_t *out) { *out = cow_stats; }
+
+u64 mmu_zero_page(void) { return virt_to_phys(mmu_zero_frame); }
+
+/* Changed entries are invalidated one by one up to mmu_flush_threshold of
+ * them, with a full TLB flush beyond. */
+#define MMU_FLUSH_BATCH_MAX 64
+#define MMU_FLUSH_BATCH_DEFAULT 32
+
+static u32 mmu_flush_threshold = MMU_FLUSH_BATCH_DEFAULT;
+
+typedef struct {
+  u64 count;
+  int global; /* a changed entry was global, so a full flush must be too */
+  u64 addrs[MMU_FLUSH_BATCH_MAX];
+} mmu_flush_batch_t;
+
+static void mmu_batch_init(mmu_flush_batch_t *batch) {
+  batch->count = 0;
+  batch->global = 0;
+}
+
+static void mmu_batch_add(mmu_flush_batch_t *batch, u64 vaddr, u64 old) {
+  if (old & PTE_GLOBAL) {
+    batch->global = 1;
+  }
+  if (batch->count < MMU_FLUSH_BATCH_MAX) {
+    batch->addrs[batch->count] = vaddr;
+  }
+  batch->count++;
+}
+
+static void mmu_batch_flush(mmu_flush_batch_t *batch) {
+  if (batch->count == 0) {
+    return;
+  }
+  if (batch->count > mmu_flush_threshold) {
+    tlb_stats.range_flushes++;
+    if (batch->global) {
+      mmu_flush_tlb_all();
+    } else {
+      mmu_flush_tlb();
+    }
     return;
   }
+  tlb_stats.range_pages += batch->count;
+  for (u64 i = 0; i < batch->count; i++) {
+    mmu_invlpg(batch->addrs[i]);
+  }
+}
+
+void mmu_set_flush_threshold(u32 pages) {
+  if (pages > MMU_FLUSH_BATCH_MAX) {
+    pages = MMU_FLUSH_BATCH_MAX;
+  }
+  mmu_flush_threshold = pages;
+}
+
+u32 mmu_get_flush_threshold(void) { return mmu_flush_threshold; }
+
+/* Give a user 2MB entry a page table of 4K entries for the same memory. A
+ * block only this address space maps is split in place; a shared one is
+ * copied, since the other mappers still hold it as one block. */
+static u64 *mmu_split_user_huge(u64 *pde) {
+  u64 entry = *pde;
+  u64 base = entry & PTE_ADDR_MASK & ~(HUGE_PAGE_SIZE - 1);
+  u64 flags = (entry & PTE_FLAGS_MASK & ~PTE_HUGE) | PTE_PRESENT;
+  u64 *pt = mmu_alloc_table();
+  if (!pt) {
+    com1_printf("[MMU] Error: Failed to split user huge page\n");
+    return NULL;
+  }
+
+  if (pmm_page_refcount(base) > 1) {
+    if (flags & PTE_COW) {
+      flags = (flags & ~PTE_COW) | PTE_RW;
+    }
+    for (u64 i = 0; i < 512; i++) {
+      u64 frame = alloc_pages(0);
+      if (!frame) {
+        for (u64 j = 0; j < i; j++) {
+          pmm_page_put(pt[j] & PTE_ADDR_MASK);
+        }
+        memset(pt, 0, PAGE_SIZE);
+        mmu_free_table(pt);
+        return NULL;
+      }
+      memcpy(phys_to_virt(frame), phys_to_virt(base + i * PAGE_SIZE),
+             PAGE_SIZE);
+      pt[i] = frame | flags;
+    }
+    pmm_page_put(base);
+  } else {
+    split_pages(base);
+    for (u64 i = 0; i < 512; i++) {
+      pt[i] = (base + i * PAGE_SIZE) | flags;
+    }
+  }
 
+  *pde = virt_to_phys(pt) | PTE_PRESENT | PTE_RW | PTE_USER;
+  return pt;
+}
+
+/* A PD entry can take a user 2MB page if it is empty or points to a user
+ * page table with nothing left in it. */
+static int mmu_huge_slot_usable(u64 pde) {
+  if (!(pde & PTE_PRESENT)) {
+    return 1;
+  }
+  if ((pde & PTE_HUGE) || !(pde & PTE_USER)) {
+    return 0;
+  }
+  u64 *pt = mmu_table(pde);
   for (u64 i = 0; i < 512; i++) {
+    if (pt[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int mmu_can_map_user_huge(u64 vaddr) {
+  u64 *pml4 = mmu_table(mmu_read_cr3());
+  u64 pml4e = pml4[(vaddr >> 39) & 0x1FF];
+  if (!(pml4e & PTE_PRESENT)) {
+    return 1;
+  }
+  u64 *pdpt = mmu_table(pml4e);
+  u64 pdpte = pdpt[(vaddr >> 30) & 0x1FF];
+  if (!(pdpte & PTE_PRESENT)) {
+    return 1;
+  }
+  if (pdpte & PTE_HUGE) {
+    return 0;
+  }
+  u64 *pd = mmu_table(pdpte);
+  return mmu_huge_slot_usable(pd[(vaddr >> 21) & 0x1FF]);
+}
+
+int mmu_map_user_huge(u64 vaddr, u64 paddr, u64 flags) {
+  u64 *pml4 = mmu_table(mmu_read_cr3());
+  u64 *pdpt = get_next_level_from(pml4, (vaddr >> 39) & 0x1FF, 1, flags);
+  if (!pdpt) {
+    return -1;
+  }
+  u64 pdpte = pdpt[(vaddr >> 30) & 0x1FF];
+  if ((pdpte & PTE_PRESENT) && (pdpte & PTE_HUGE)) {
+    return -1;
+  }
+  u64 *pd = get_next_level_from(pdpt, (vaddr >> 30) & 0x1FF, 1, flags);
+  if (!pd) {
+    return -1;
+  }
+  u64 *pde = &pd[(vaddr >> 21) & 0x1FF];
+  if (!mmu_huge_slot_usable(*pde)) {
+    return -1;
+  }
+  if (*pde & PTE_PRESENT) {
+    mmu_free_table(mmu_table(*pde));
+  }
+  *pde = (paddr & PTE_ADDR_MASK) | (flags & PTE_FLAGS_MASK) | PTE_HUGE |
+         PTE_PRESENT;
+  mmu_invlpg(vaddr);
+  return 0;
+}
+
+typedef void (*mmu_range_fn)(u64 vaddr, u64 *entry, u64 size, void *ctx);
+
+/* Call fn on every leaf entry in [start, end) of the current address space
+ * that has all the bits of need (PTE_PRESENT, plus PTE_USER for user
+ * walks; the tables above must have them too and be present). A user walk
+ * that also wants swap entries asks for PTE_USER alone. Missing tables are
+ * skipped whole, so sparse ranges cost one step per table instead of one per
+ * page.
+ * A 2MB entry is passed as one when the range covers all of it and split
+ * is 0; otherwise it is split into 4K entries first. A 1GB entry is always
+ * split into 2MB entries. Returns -1 if a split ran out of memory; the
+ * pages under that entry are skipped. */
+static int mmu_walk_range(u64 start, u64 end, u64 need, int split,
+                          mmu_range_fn fn, void *ctx) {
+  u64 *pml4 = mmu_table(mmu_read_cr3());
+  int rc = 0;
+  u64 table_need = need | PTE_PRESENT;
+  u64 vaddr = start & ~((u64)PAGE_SIZE - 1);
+  while (vaddr < end) {
+    u64 pml4e = pml4[(vaddr >> 39) & 0x1FF];
+    if ((pml4e & table_need) != table_need) {
+      vaddr = (vaddr | ((1ULL << 39) - 1)) + 1;
+      continue;
+    }
+    u64 *pdpt = mmu_table(pml4e);
+    u64 pdpte = pdpt[(vaddr >> 30) & 0x1FF];
+    if ((pdpte & table_need) != table_need) {
+      vaddr = (vaddr | ((1ULL << 30) - 1)) + 1;
+      continue;
+    }
+    if ((pdpte & PTE_HUGE) &&
+        !split_huge_pdpte(pdpt, (vaddr >> 30) & 0x1FF)) {
+      rc = -1;
+      vaddr = (vaddr | ((1ULL << 30) - 1)) + 1;
+      continue;
+    }
+    pdpte = pdpt[(vaddr >> 30) & 0x1FF];
+    u64 *pd = mmu_table(pdpte);
+    u64 *pde = &pd[(vaddr >> 21) & 0x1FF];
+    u64 next = (vaddr | (HUGE_PAGE_SIZE - 1)) + 1;
+    if ((*pde & table_need) != table_need) {
+      vaddr = next;
+      continue;
+    }
+    if (*pde & PTE_HUGE) {
+      if (!split && (vaddr & (HUGE_PAGE_SIZE - 1)) == 0 && next <= end) {
+        fn(vaddr, pde, HUGE_PAGE_SIZE, ctx);
+        vaddr = next;
+        continue;
+      }
+      u64 *split_pt = (*pde & PTE_USER)
+                          ? mmu_split_user_huge(pde)
+                          : split_huge_pde(pd, (vaddr >> 21) & 0x1FF, 0);
+      if (!split_pt) {
+        rc = -1;
+        vaddr = next;
+        continue;
+      }
+      mmu_invlpg(vaddr);
+    }
+    u64 *pt = mmu_table(*pde);
+    for (; vaddr < next && vaddr < end; vaddr += PAGE_SIZE) {
+      u64 *pte = &pt[(vaddr >> 12) & 0x1FF];
+      if ((*pte & need) == need) {
+        fn(vaddr, pte, PAGE_SIZE, ctx);
+      }
+    }
+  }
+  return rc;
+}
+
+/* Map pages [0, length / PAGE_SIZE) of a range at vaddr, to paddr onwards or
+ * to the frames fn hands out. Each page table is found once and filled in
+ * place; entries that were present are flushed together at the end. */
+static int mmu_map_pages(u64 vaddr, u64 length, u64 flags, u64 paddr,
+                         mmu_frame_fn fn, void *ctx) {
+  vaddr &= ~((u64)PAGE_SIZE - 1);
+  flags = mmu_leaf_flags(vaddr, flags);
+  u64 *pml4 = mmu_table(mmu_read_cr3());
+  u64 pages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+  mmu_flush_batch_t batch;
+  mmu_batch_init(&batch);
+
+  int rc = 0;
+  u64 *pt = NULL;
+  for (u64 i = 0; i < pages; i++) {
+    u64 va = vaddr + i * PAGE_SIZE;
+    u64 pt_index = (va >> 12) & 0x1FF;
+    if (!pt || pt_index == 0) {
+      pt = mmu_leaf_table(pml4, va, flags);
+      if (!pt) {
+        rc = -1;
+        break;
+      }
+    }
+    u64 frame = fn ? fn(i, ctx) : paddr + i * PAGE_SIZE;
+    if (!frame) {
+      rc = -1;
+      break;
+    }
+    u64 old = pt[pt_index];
+    pt[pt_index] =
+        (frame & PTE_ADDR_MASK) | (flags & PTE_FLAGS_MASK) | PTE_PRESENT;
+    if (old & PTE_PRESENT) {
+      mmu_batch_add(&batch, va, old);
+    }
+  }
+
+  mmu_batch_flush(&batch);
+  return rc;
+}
+
+int mmu_map_range(u64 vaddr, u64 paddr, u64 length, u64 flags) {
+  return mmu_map_pages(vaddr, length, flags, paddr, NULL, NULL);
+}
+
+int mmu_map_range_frames(u64 vaddr, u64 length, u64 flags, mmu_frame_fn fn,
+                         void *ctx) {
+  return mmu_map_pages(vaddr, length, flags, 0, fn, ctx);
+}
+
+typedef struct {
+  mmu_flush_batch_t batch;
+  int release;
+} mmu_unmap_ctx_t;
+
+static void mmu_unmap_entry(u64 vaddr, u64 *entry, u64 size, void *ctx) {
+  mmu_unmap_ctx_t *u = (mmu_unmap_ctx_t *)ctx;
+  u64 old = *entry;
+  *entry = 0;
+  if (!(old & PTE_PRESENT)) {
+    /* Out on swap: no translation to flush, only the slot to give back. */
+    swap_entry_free(old);
+    return;
+  }
+  if (u->release) {
+    pmm_page_put(old & PTE_ADDR_MASK & ~(size - 1));
+  }
+  mmu_batch_add(&u->batch, vaddr, old);
+}
+
+u64 mmu_unmap_range(u64 vaddr, u64 length, int release) {
+  mmu_unmap_ctx_t ctx;
+  mmu_batch_init(&ctx.batch);
+  ctx.release = release;
+  mmu_walk_range(vaddr, vaddr + length, PTE_PRESENT, 0, mmu_unmap_entry, &ctx);
+  mmu_batch_flush(&ctx.batch);
+  return ctx.batch.count;
+}
+
+typedef struct {
+  mmu_flush_batch_t batch;
+  u64 flags;
+} mmu_protect_ctx_t;
+
+static void mmu_protect_entry(u64 vaddr, u64 *entry, u64 size, void *ctx) {
+  mmu_protect_ctx_t *p = (mmu_protect_ctx_t *)ctx;
+  (void)size;
+  u64 keep = *entry & (PTE_ADDR_MASK | PTE_HUGE | PTE_ACCESSED | PTE_DIRTY);
+  u64 updated = keep | (p->flags & PTE_FLAGS_MASK) | PTE_PRESENT;
+  if (updated != *entry) {
+    u64 old = *entry;
+    *entry = updated;
+    mmu_batch_add(&p->batch, vaddr, old);
+  }
+}
+
+u64 mmu_protect_range(u64 vaddr, u64 length, u64 flags) {
+  mmu_protect_ctx_t ctx;
+  mmu_batch_init(&ctx.batch);
+  ctx.flags = mmu_leaf_flags(vaddr, flags);
+  mmu_walk_range(vaddr, vaddr + length, PTE_PRESENT, 0, mmu_protect_entry,
+                 &ctx);
+  mmu_batch_flush(&ctx.batch);
+  return ctx.batch.count;
+}
+
+u64 mmu_unmap_user_range(u64 start, u64 end) {
+  mmu_unmap_ctx_t ctx;
+  mmu_batch_init(&ctx.batch);
+  ctx.release = 1;
+  mmu_walk_range(start, end, PTE_USER, 0, mmu_unmap_entry, &ctx);
+  mmu_batch_flush(&ctx.batch);
+  return ctx.batch.count;
+}
+
+static void mmu_protect_user_entry(u64 vaddr, u64 *entry, u64 size,
+                                   void *ctx) {
+  mmu_protect_ctx_t *p = (mmu_protect_ctx_t *)ctx;
+  u64 frame = *entry & PTE_ADDR_MASK & ~(size - 1);
+  u64 keep = *entry & (PTE_ADDR_MASK | PTE_HUGE | PTE_ACCESSED | PTE_DIRTY);
+  u64 updated = keep | (p->flags & PTE_FLAGS_MASK & ~PTE_RW) | PTE_PRESENT;
+  if (p->flags & PTE_RW) {
+    /* Frames someone else still maps, and the zero page, only become
+     * writable through a copy. */
+    if (frame == mmu_zero_page() || pmm_page_refcount(frame) > 1) {
+      updated |= PTE_COW;
+    } else {
+      updated |= PTE_RW;
+    }
+  }
+  if (updated != *entry) {
+    u64 old = *entry;
+    *entry = updated;
+    mmu_batch_add(&p->batch, vaddr, old);
+  }
+}
+
+u64 mmu_protect_user_range(u64 start, u64 end, u64 flags) {
+  mmu_protect_ctx_t ctx;
+  mmu_batch_init(&ctx.batch);
+  ctx.flags = flags;
+  mmu_walk_range(start, end, PTE_PRESENT | PTE_USER, 0, mmu_protect_user_entry,
+                 &ctx);
+  mmu_batch_flush(&ctx.batch);
+  return ctx.batch.count;
+}
+
+static void mmu_clean_user_entry(u64 vaddr, u64 *entry, u64 size,
+                                 void *ctx) {
+  mmu_flush_batch_t *batch = (mmu_flush_batch_t *)ctx;
+  (void)size;
+  if (*entry & PTE_DIRTY) {
+    u64 old = *entry;
+    *entry = old & ~(u64)PTE_DIRTY;
+    mmu_batch_add(batch, vaddr, old);
+  }
+}
+
+u64 mmu_clean_user_range(u64 start, u64 end) {
+  mmu_flush_batch_t batch;
+  mmu_batch_init(&batch);
+  mmu_walk_range(start, end, PTE_PRESENT | PTE_USER, 0, mmu_clean_user_entry,
+                 &batch);
+  mmu_batch_flush(&batch);
+  return batch.count;
+}
+
+typedef struct {
+  mmu_flush_batch_t batch;
+  u64 delta;
+  int failed;
+} mmu_move_ctx_t;
+
+/* First pass of a move: build the tables every entry will land in, so that
+ * the second pass never allocates and cannot fail halfway. */
+static void mmu_prepare_move_entry(u64 vaddr, u64 *entry, u64 size,
+                                   void *ctx) {
+  mmu_move_ctx_t *m = (mmu_move_ctx_t *)ctx;
+  u64 to = vaddr + m->delta;
+  u64 *pml4 = mmu_table(mmu_read_cr3());
+  (void)entry;
+  if (size == PAGE_SIZE) {
+    if (!mmu_leaf_table(pml4, to, PTE_PRESENT | PTE_RW | PTE_USER)) {
+      m->failed = 1;
+    }
+    return;
+  }
+  u64 *pdpt = get_next_level_from(pml4, (to >> 39) & 0x1FF, 1, PTE_USER);
+  if (!pdpt || !get_next_level_from(pdpt, (to >> 30) & 0x1FF, 1, PTE_USER)) {
+    m->failed = 1;
+  }
+}
+
+/* Entries are copied as they are, so swapped-out pages move with the rest.
+ * One that cannot be placed stays where it was. */
+static void mmu_move_user_entry(u64 vaddr, u64 *entry, u64 size, void *ctx) {
+  mmu_move_ctx_t *m = (mmu_move_ctx_t *)ctx;
+  u64 to = vaddr + m->delta;
+  if (size == PAGE_SIZE) {
+    u64 *pt = mmu_leaf_table(mmu_table(mmu_read_cr3()), to,
+                             PTE_PRESENT | PTE_RW | PTE_USER);
+    if (!pt) {
+      m->failed = 1;
+      return;
+    }
+    pt[(to >> 12) & 0x1FF] = *entry;
+  } else if (mmu_map_user_huge(to, *entry & PTE_ADDR_MASK,
+                               *entry & PTE_FLAGS_MASK) != 0) {
+    m->failed = 1;
+    return;
+  }
+  u64 old = *entry;
+  *entry = 0;
+  if (old & PTE_PRESENT) {
+    mmu_batch_add(&m->batch, vaddr, old);
+  }
+}
+
+int mmu_move_user_range(u64 from, u64 to, u64 length) {
+  mmu_move_ctx_t ctx;
+  mmu_batch_init(&ctx.batch);
+  ctx.delta = to - from;
+  ctx.failed = 0;
+  /* 2MB pages only keep their size if the move preserves their alignment. */
+  int split = (ctx.delta & (HUGE_PAGE_SIZE - 1)) != 0;
+  if (mmu_walk_range(from, from + length, PTE_USER, split,
+                     mmu_prepare_move_entry, &ctx) != 0 ||
+      ctx.failed) {
+    com1_printf("[MMU] Error: no page tables to move %p to %p\n",
+                (void *)from, (void *)to);
+    return -1;
+  }
+  mmu_walk_range(from, from + length, PTE_USER, split, mmu_move_user_entry,
+                 &ctx);
+  mmu_batch_flush(&ctx.batch);
+  return ctx.failed ? -1 : 0;
+}
+
+void mmu_free_user_space(u64 cr3) {
+  if (!(cr3 & PTE_ADDR_MASK)) {
+    return;
+  }
+  u64 *pml4 = mmu_table(cr3);
+
+  for (u64 i = 0; i < MMU_USER_SLOTS; i++) {
     u64 pml4e = pml4[i];
     if (!(pml4e & PTE_PRESENT) || !(pml4e & PTE_USER)) {
       continue;
     }
-    u64 *pdpt = (u64 *)(pml4e & PTE_ADDR_MASK);
+    u64 *pdpt = mmu_table(pml4e);
     int pdpt_has_present = 0;
     for (u64 j = 0; j < 512; j++) {
       u64 pdpte = pdpt[j];
@@ -559,7 +1368,7 @@ void mmu_free_user_space(u64 cr3) {
         pdpt_has_present = 1;
         continue;
       }
-      u64 *pd = (u64 *)(pdpte & PTE_ADDR_MASK);
+      u64 *pd = mmu_table(pdpte);
       int pd_has_present = 0;
       for (u64 k = 0; k < 512; k++) {
         u64 pde = pd[k];
@@ -571,41 +1380,57 @@ void mmu_free_user_space(u64 cr3) {
           continue;
         }
         if (pde & PTE_HUGE) {
-          pd_has_present = 1;
+          pmm_page_put(pde & PTE_ADDR_MASK & ~0x1FFFFFULL);
+          pd[k] = 0;
           continue;
         }
-        u64 *pt = (u64 *)(pde & PTE_ADDR_MASK);
+        u64 *pt = mmu_table(pde);
         int pt_has_present = 0;
         for (u64 l = 0; l < 512; l++) {
           u64 pte = pt[l];
           if (!(pte & PTE_PRESENT)) {
+            if (mmu_is_swap_entry(pte)) {
+              swap_entry_free(pte);
+              pt[l] = 0;
+            }
             continue;
           }
           if (!(pte & PTE_USER)) {
             pt_has_present = 1;
             continue;
           }
-          void *page = (void *)(pte & PTE_ADDR_MASK);
-          kfree(page);
+          pmm_page_put(pte & PTE_ADDR_MASK);
           pt[l] = 0;
         }
         if (pt_has_present) {
           pd_has_present = 1;
         } else {
-          kfree(pt);
+          mmu_free_table(pt);
           pd[k] = 0;
         }
       }
       if (pd_has_present) {
         pdpt_has_present = 1;
       } else {
-        kfree(pd);
+        mmu_free_table(pd);
         pdpt[j] = 0;
       }
     }
     if (!pdpt_has_present) {
-      kfree(pdpt);
+      mmu_free_table(pdpt);
       pml4[i] = 0;
     }
   }
 }
+
+void mmu_destroy_address_space(u64 cr3) {
+  u64 pml4 = cr3 & PTE_ADDR_MASK;
+  if (!pml4 || pml4 == (mmu_kernel_cr3() & PTE_ADDR_MASK)) {
+    return;
+  }
+  mmu_pcid_forget(pml4);
+  mmu_free_user_space(cr3);
+  /* The PML4 still holds the kernel entries; clear it for the cache. */
+  memset(phys_to_virt(pml4), 0, PAGE_SIZE);
+  mmu_free_table(mmu_table(pml4));
+}
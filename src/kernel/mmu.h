@@ -30,6 +30,7 @@
 #include <mlibc/mlibc.h>
 
 #define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE 0x200000ULL
 
 #define PTE_PRESENT 0x1
 #define PTE_RW 0x2
@@ -41,29 +42,187 @@
 #define PTE_HUGE 0x80
 #define PTE_GLOBAL 0x100
 #define PTE_NX (1ULL << 63)
+/* Available to software: a shared frame mapped read-only until written. */
+#define PTE_COW 0x200
+/* Available to software, in a non-present user entry: the page is out on
+ * swap and the address bits hold its slot (see kernel/swap.c). */
+#define PTE_SWAP 0x400
 
 #define PTE_ADDR_MASK 0x000FFFFFFFFFF000
 #define PTE_FLAGS_MASK 0xFFF0000000000FFF
 
+static inline u64 mmu_swap_entry(u32 slot) {
+  return ((u64)slot << 12) | PTE_SWAP | PTE_USER;
+}
+
+static inline int mmu_is_swap_entry(u64 entry) {
+  return !(entry & PTE_PRESENT) && (entry & PTE_SWAP);
+}
+
+static inline u32 mmu_swap_slot(u64 entry) {
+  return (u32)((entry & PTE_ADDR_MASK) >> 12);
+}
+
+/* The kernel image is linked at KERNEL_VMA plus its load address (see
+ * linker.ld). All physical memory is mapped once more at
+ * KERNEL_DIRECT_MAP_BASE, which is how the kernel reaches frames, page
+ * tables and boot loader data; the identity map of the first 4 GB is gone
+ * by the time user processes run. */
+#define KERNEL_VMA 0xFFFFFFFF80000000ULL
+#define KERNEL_DIRECT_MAP_BASE 0xFFFF800000000000ULL
+#define KERNEL_DIRECT_MAP_SIZE (512ULL << 30)
+
+static inline void *phys_to_virt(u64 paddr) {
+  return (void *)(paddr + KERNEL_DIRECT_MAP_BASE);
+}
+
+/* Only for direct map and kernel image addresses; vmalloc and other
+ * windows need mmu_virt_to_phys. */
+static inline u64 virt_to_phys(const void *vaddr) {
+  u64 addr = (u64)vaddr;
+  if (addr >= KERNEL_VMA) {
+    return addr - KERNEL_VMA;
+  }
+  return addr - KERNEL_DIRECT_MAP_BASE;
+}
+
 void mmu_init();
 int mmu_is_initialized(void);
 void mmu_map_page(u64 vaddr, u64 paddr, u64 flags);
 void mmu_unmap_page(u64 vaddr);
+u64 mmu_unmap_page_noflush(u64 vaddr);
 u64 mmu_virt_to_phys(u64 vaddr);
 u64 mmu_create_address_space(void);
+typedef struct {
+  u64 shared;      /* user pages shared with a child instead of copied */
+  u64 copied;      /* write faults that copied a shared page */
+  u64 reused;      /* write faults on a page with no other user left */
+  u64 zero_filled; /* write faults that replaced the shared zero page */
+} mmu_cow_stats_t;
+
+/* Copy-on-write: the child shares every user frame with the parent. */
 u64 mmu_clone_user_space(u64 src_cr3);
+int mmu_handle_cow_fault(u64 vaddr);
+void mmu_cow_get_stats(mmu_cow_stats_t *out);
+/* Physical address of the shared, never-written zero page. */
+u64 mmu_zero_page(void);
 void mmu_free_user_space(u64 cr3);
+/* User mappings of the current address space over a whole range, ending
+ * with one batched TLB flush; unmapping and protecting return the number of
+ * entries changed. Unmapping drops the frames' references and frees swap
+ * slots, moving takes swapped-out pages along. Protecting a shared frame
+ * writable makes it copy-on-write instead. Moving relocates the entries of
+ * [from, from + length) to the same offsets from to. A 2MB page only partly
+ * in the range is split into 4K entries first. */
+u64 mmu_unmap_user_range(u64 start, u64 end);
+
+/* Frame for page index of a range being mapped, 0 when there is none. */
+typedef u64 (*mmu_frame_fn)(u64 index, void *ctx);
+
+/* Any mappings of the current address space over a whole range: each page
+ * table is walked to once and its entries filled in place, and the entries
+ * that were present are flushed together at the end. mmu_map_range maps
+ * physically contiguous memory, mmu_map_range_frames asks fn for each
+ * page. Both return -1 when a table or frame runs out, leaving the pages
+ * before it mapped; mmu_unmap_range over the whole range undoes that. It
+ * drops the frames' references when release is set. Unmap and protect
+ * return the number of entries changed. */
+int mmu_map_range(u64 vaddr, u64 paddr, u64 length, u64 flags);
+int mmu_map_range_frames(u64 vaddr, u64 length, u64 flags, mmu_frame_fn fn,
+                         void *ctx);
+u64 mmu_unmap_range(u64 vaddr, u64 length, int release);
+u64 mmu_protect_range(u64 vaddr, u64 length, u64 flags);
+/* Range operations that change more entries than this reload the whole
+ * TLB instead of invalidating page by page (at most 64, default 32). */
+void mmu_set_flush_threshold(u32 pages);
+u32 mmu_get_flush_threshold(void);
+u64 mmu_protect_user_range(u64 start, u64 end, u64 flags);
+/* Clear the dirty bit of the user pages in [start, end), for pages the
+ * kernel filled with what their file already holds. */
+u64 mmu_clean_user_range(u64 start, u64 end);
+/* Returns -1 when a page table for the destination cannot be allocated;
+ * the tables are built before anything moves, so the entries are then all
+ * still at from. */
+int mmu_move_user_range(u64 from, u64 to, u64 length);
+/* User 2MB pages in the current address space. A slot is usable when nothing
+ * is mapped there; a page table left empty by munmap is freed to make room. */
+int mmu_can_map_user_huge(u64 vaddr);
+int mmu_map_user_huge(u64 vaddr, u64 paddr, u64 flags);
+void mmu_destroy_address_space(u64 cr3);
+/* Zeroed page table, returned through the direct map. */
+u64 *mmu_alloc_table(void);
+void mmu_free_table(u64 *table);
+int mmu_share_kernel_region(u64 vaddr);
 void mmu_map_page_in(u64 *pml4, u64 vaddr, u64 paddr, u64 flags);
 u64 mmu_kernel_cr3(void);
 u64 mmu_get_pte_flags(u64 vaddr);
-void mmu_clear_user_range(u64 start, u64 end);
+/* Page reclaim on any address space, 4K user pages only. The accessed bit
+ * is cleared without a flush: a cached translation just keeps the page
+ * looking idle a little longer. Evicting clears the entry, flushes it and
+ * returns the old entry (0 if nothing was mapped); the caller drops the
+ * frame's reference. */
+u64 mmu_get_user_pte(u64 cr3, u64 vaddr);
+void mmu_clear_accessed(u64 cr3, u64 vaddr);
+u64 mmu_evict_user_page(u64 cr3, u64 vaddr);
+/* Replace the 4K entry of a present user page of any address space and
+ * flush it; returns the old entry, or 0 (nothing written) if the page is
+ * not mapped that way. */
+u64 mmu_set_user_pte(u64 cr3, u64 vaddr, u64 entry);
+/* Drop the cached translation of a user page of any address space: invlpg
+ * when it is the current one, otherwise its tag is flushed on next use. */
+void mmu_flush_user_page(u64 cr3, u64 vaddr);
+
+/* Call fn on each present 4K user entry of [start, end) in any address
+ * space, skipping missing tables and 2MB pages. fn may rewrite the entry
+ * (then flush it with mmu_flush_user_page) and returns nonzero to stop.
+ * Returns the address after the page it stopped at, or end. */
+typedef int (*mmu_pte_fn)(u64 vaddr, u64 *pte, void *ctx);
+u64 mmu_scan_user_ptes(u64 cr3, u64 start, u64 end, mmu_pte_fn fn,
+                       void *ctx);
+
+/* Extend the direct map to cover physical memory up to end (the boot
+ * tables cover 4 GB), with 1GB pages where the CPU has them and 2MB pages
+ * otherwise. Returns -1 when a table runs out. */
+int mmu_map_direct(u64 end);
+/* Unmap the low identity map the boot code ran on. Called once the kernel
+ * no longer needs it and before any address space copies it. */
+void mmu_drop_identity_map(void);
 
 static inline void mmu_invlpg(u64 vaddr) {
   __asm__ volatile("invlpg (%0)" : : "r"(vaddr) : "memory");
 }
 
-static inline void mmu_write_cr3(u64 pml4_addr) {
-  __asm__ volatile("mov %0, %%cr3" : : "r"(pml4_addr) : "memory");
+/* Untagged CR3 load: flushes the entries cached under the value's tag. */
+void mmu_write_cr3(u64 cr3);
+
+/* Scheduler switch to an address space tagged with a PCID. *pcid is the
+ * process's tag from its last run, kept with no flush while the address
+ * space still owns it; otherwise a tag is assigned (or recycled) and
+ * flushed. */
+void mmu_switch_address_space(u64 cr3, u16 *pcid);
+
+typedef struct {
+  int pcid;           /* CR4.PCIDE set */
+  int pge;            /* CR4.PGE set, kernel window pages global */
+  int gbpages;        /* direct map built from 1GB pages */
+  u64 switches;       /* address space switches by the scheduler */
+  u64 kept;           /* switches that kept the TLB (NOFLUSH) */
+  u64 assigned;       /* tags handed out */
+  u64 recycled;       /* tags taken from another address space */
+  u64 global_flushes; /* mmu_flush_tlb_all calls */
+  u64 range_pages;    /* pages invalidated one by one by range operations */
+  u64 range_flushes;  /* range operations that flushed the whole TLB */
+} mmu_tlb_stats_t;
+
+void mmu_tlb_get_stats(mmu_tlb_stats_t *out);
+
+/* Flush every tag and global entries too. mmu_flush_tlb only drops the
+ * current tag's non-global entries, which is enough for user mappings. */
+void mmu_flush_tlb_all(void);
+
+static inline void mmu_flush_tlb(void) {
+  u64 cr3;
+  __asm__ volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
 }
 
 static inline u64 mmu_read_cr3() {
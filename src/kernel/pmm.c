@@ -0,0 +1,743 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Physical page allocator.
+ * A binary buddy allocator over all usable RAM below PMM_MAX_PHYS, seeded from
+ * the multiboot memory map. Every 4 KB frame has a page_frame_t descriptor;
+ * free blocks of 2^order frames are kept on per-order lists linked through
+ * the descriptor of their first frame. The descriptor array lives in the
+ * first usable RAM below 4 GB that does not overlap the kernel image, the
+ * heap, boot modules or early reservations. Frames are reached through the
+ * direct map (phys_to_virt); RAM above the 4 GB the boot page tables cover
+ * is mapped and handed out once the allocator can supply the tables.
+ */
+
+#include <kernel/mmu.h>
+#include <kernel/multiboot.h>
+#include <kernel/multiboot2.h>
+#include <kernel/pmm.h>
+#include <kernel/shrinker.h>
+#include <lib/com1.h>
+#include <mlibc/memory.h>
+
+extern char start;
+
+#define PMM_LOW_MEMORY 0x100000ULL
+/* Reach of the boot page tables' direct map, enough for the descriptors. */
+#define PMM_BOOT_MAPPED 0x100000000ULL
+#define PMM_MAX_RESERVED 32
+#define PMM_NO_FRAME 0xFFFFFFFFU
+
+#define PAGE_FRAME_FREE 0x01     /* Head of a free buddy block */
+#define PAGE_FRAME_RESERVED 0x02 /* Never handed out */
+#define PAGE_FRAME_HEAD 0x04     /* Head of an allocated block */
+
+typedef struct {
+  u64 base;
+  u64 end;
+} pmm_range_t;
+
+typedef void (*pmm_region_fn)(u64 base, u64 end);
+
+static page_frame_t *pmm_frames = NULL;
+static u32 pmm_free_head[PMM_MAX_ORDER + 1];
+static u64 pmm_free_blocks_count[PMM_MAX_ORDER + 1];
+static u64 pmm_frame_count = 0;
+static u64 pmm_free_count = 0;
+static u64 pmm_usable_count = 0;
+static int pmm_initialized = 0;
+
+static pmm_range_t pmm_reserved[PMM_MAX_RESERVED];
+static int pmm_reserved_count = 0;
+
+static u64 pmm_highest_end = 0;
+static u64 pmm_place_size = 0;
+static u64 pmm_place_addr = 0;
+
+static shrinker_t zero_pool_shrinker; /* defined with the zero pool below */
+
+static u64 page_align_up(u64 value) {
+  return (value + PAGE_SIZE - 1) & ~(u64)(PAGE_SIZE - 1);
+}
+
+static u64 page_align_down(u64 value) {
+  return value & ~(u64)(PAGE_SIZE - 1);
+}
+
+static void buddy_list_push(u32 frame, u32 order) {
+  page_frame_t *page = &pmm_frames[frame];
+  page->flags = PAGE_FRAME_FREE;
+  page->order = (u8)order;
+  page->prev = PMM_NO_FRAME;
+  page->next = pmm_free_head[order];
+  if (page->next != PMM_NO_FRAME) {
+    pmm_frames[page->next].prev = frame;
+  }
+  pmm_free_head[order] = frame;
+  pmm_free_blocks_count[order]++;
+}
+
+static void buddy_list_remove(u32 frame, u32 order) {
+  page_frame_t *page = &pmm_frames[frame];
+  if (page->prev != PMM_NO_FRAME) {
+    pmm_frames[page->prev].next = page->next;
+  } else {
+    pmm_free_head[order] = page->next;
+  }
+  if (page->next != PMM_NO_FRAME) {
+    pmm_frames[page->next].prev = page->prev;
+  }
+  page->next = PMM_NO_FRAME;
+  page->prev = PMM_NO_FRAME;
+  page->flags &= ~PAGE_FRAME_FREE;
+  pmm_free_blocks_count[order]--;
+}
+
+/* Return a block to the free lists, merging with free buddies. */
+static void buddy_free_block(u32 frame, u32 order) {
+  pmm_free_count += 1ULL << order;
+
+  while (order < PMM_MAX_ORDER) {
+    u32 buddy = frame ^ (1U << order);
+    if (buddy >= pmm_frame_count) {
+      break;
+    }
+    page_frame_t *bp = &pmm_frames[buddy];
+    if (!(bp->flags & PAGE_FRAME_FREE) || bp->order != order) {
+      break;
+    }
+    buddy_list_remove(buddy, order);
+    bp->order = 0;
+    frame &= ~(1U << order);
+    order++;
+  }
+
+  buddy_list_push(frame, order);
+}
+
+/* Split a free block of `order` down to `target`, freeing the upper halves. */
+static void buddy_split(u32 frame, u32 order, u32 target) {
+  while (order > target) {
+    order--;
+    buddy_list_push(frame + (1U << order), order);
+  }
+}
+
+static u32 buddy_alloc_block(u32 order) {
+  for (u32 o = order; o <= PMM_MAX_ORDER; o++) {
+    u32 frame = pmm_free_head[o];
+    if (frame == PMM_NO_FRAME) {
+      continue;
+    }
+    buddy_list_remove(frame, o);
+    buddy_split(frame, o, order);
+    pmm_free_count -= 1ULL << order;
+    return frame;
+  }
+  return PMM_NO_FRAME;
+}
+
+/* Take one specific frame out of whatever free block contains it. */
+static void buddy_claim_frame(u32 frame) {
+  for (u32 o = 0; o <= PMM_MAX_ORDER; o++) {
+    u32 head = frame & ~((1U << o) - 1);
+    page_frame_t *hp = &pmm_frames[head];
+    if (!(hp->flags & PAGE_FRAME_FREE) || hp->order != o) {
+      continue;
+    }
+
+    buddy_list_remove(head, o);
+    pmm_free_count -= 1ULL << o;
+    /* Give back every half that does not contain the claimed frame. */
+    while (o > 0) {
+      o--;
+      u32 upper = head + (1U << o);
+      if (frame >= upper) {
+        buddy_list_push(head, o);
+        pmm_free_count += 1ULL << o;
+        head = upper;
+      } else {
+        buddy_list_push(upper, o);
+        pmm_free_count += 1ULL << o;
+      }
+    }
+    return;
+  }
+}
+
+static void pmm_add_reserved(u64 base, u64 end) {
+  if (end <= base) {
+    return;
+  }
+  if (pmm_reserved_count >= PMM_MAX_RESERVED) {
+    com1_printf("[PMM] Warning: too many reserved ranges, dropping %p-%p\n",
+                (void *)base, (void *)end);
+    return;
+  }
+  pmm_reserved[pmm_reserved_count].base = page_align_down(base);
+  pmm_reserved[pmm_reserved_count].end = page_align_up(end);
+  pmm_reserved_count++;
+}
+
+static int pmm_overlaps_reserved(u64 base, u64 end) {
+  for (int i = 0; i < pmm_reserved_count; i++) {
+    if (base < pmm_reserved[i].end && pmm_reserved[i].base < end) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void pmm_for_each_available(u32 magic, u64 mb_info, pmm_region_fn fn) {
+  if (magic == MULTIBOOT2_BOOTLOADER_MAGIC) {
+    multiboot2_info_t *info = phys_to_virt(mb_info);
+    multiboot2_tag_mmap_t *mmap = (multiboot2_tag_mmap_t *)multiboot2_find_tag(
+        info, MULTIBOOT2_TAG_TYPE_MMAP);
+    if (!mmap) {
+      multiboot2_tag_basic_meminfo_t *basic =
+          (multiboot2_tag_basic_meminfo_t *)multiboot2_find_tag(
+              info, MULTIBOOT2_TAG_TYPE_BASIC_MEMINFO);
+      if (basic) {
+        fn(PMM_LOW_MEMORY, PMM_LOW_MEMORY + (u64)basic->mem_upper * 1024);
+      }
+      return;
+    }
+
+    u8 *end = (u8 *)mmap + mmap->size;
+    multiboot2_mmap_entry_t *entry =
+        (multiboot2_mmap_entry_t *)((u8 *)mmap + 16);
+    while ((u8 *)entry < end) {
+      if (entry->type == MULTIBOOT2_MEMORY_AVAILABLE) {
+        fn(entry->base_addr, entry->base_addr + entry->length);
+      }
+      entry = (multiboot2_mmap_entry_t *)((u8 *)entry + mmap->entry_size);
+    }
+    return;
+  }
+
+  if (magic == MULTIBOOT_BOOTLOADER_MAGIC) {
+    multiboot_info_t *info = phys_to_virt(mb_info);
+    if (!(info->flags & MULTIBOOT_FLAG_MMAP)) {
+      if (info->flags & MULTIBOOT_FLAG_MEM) {
+        fn(PMM_LOW_MEMORY, PMM_LOW_MEMORY + (u64)info->mem_upper * 1024);
+      }
+      return;
+    }
+
+    multiboot_mmap_entry_t *entry = phys_to_virt(info->mmap_addr);
+    u64 end = (u64)entry + info->mmap_length;
+    while ((u64)entry < end) {
+      if (entry->type == MULTIBOOT_MEMORY_AVAILABLE) {
+        fn(entry->base_addr, entry->base_addr + entry->length);
+      }
+      entry = (multiboot_mmap_entry_t *)((u64)entry + entry->size + 4);
+    }
+  }
+}
+
+static void pmm_reserve_boot_info(u32 magic, u64 mb_info) {
+  if (magic == MULTIBOOT2_BOOTLOADER_MAGIC) {
+    multiboot2_info_t *info = phys_to_virt(mb_info);
+    pmm_add_reserved(mb_info, mb_info + info->total_size);
+
+    multiboot2_tag_t *tag = (multiboot2_tag_t *)((u8 *)info + 8);
+    while (tag->type != MULTIBOOT2_TAG_TYPE_END) {
+      if (tag->type == MULTIBOOT2_TAG_TYPE_MODULE) {
+        multiboot2_tag_module_t *mod = (multiboot2_tag_module_t *)tag;
+        pmm_add_reserved(mod->mod_start, mod->mod_end);
+      }
+      u64 next_addr = (u64)tag + tag->size;
+      next_addr = (next_addr + 7) & ~7;
+      tag = (multiboot2_tag_t *)next_addr;
+    }
+    return;
+  }
+
+  if (magic == MULTIBOOT_BOOTLOADER_MAGIC) {
+    multiboot_info_t *info = phys_to_virt(mb_info);
+    pmm_add_reserved(mb_info, mb_info + sizeof(multiboot_info_t));
+    if (info->flags & MULTIBOOT_FLAG_MMAP) {
+      pmm_add_reserved(info->mmap_addr,
+                       (u64)info->mmap_addr + info->mmap_length);
+    }
+    if (info->flags & MULTIBOOT_FLAG_MODS) {
+      u32 *mods = phys_to_virt(info->mods_addr);
+      pmm_add_reserved(info->mods_addr,
+                       (u64)info->mods_addr + info->mods_count * 16);
+      for (u32 i = 0; i < info->mods_count; i++) {
+        pmm_add_reserved(mods[i * 4], mods[i * 4 + 1]);
+      }
+    }
+  }
+}
+
+static void pmm_find_highest(u64 base, u64 end) {
+  (void)base;
+  if (end > PMM_MAX_PHYS) {
+    end = PMM_MAX_PHYS;
+  }
+  if (end > pmm_highest_end) {
+    pmm_highest_end = end;
+  }
+}
+
+static void pmm_try_place(u64 base, u64 end) {
+  if (pmm_place_addr) {
+    return;
+  }
+  if (base < PMM_LOW_MEMORY) {
+    base = PMM_LOW_MEMORY;
+  }
+  if (end > PMM_BOOT_MAPPED) {
+    end = PMM_BOOT_MAPPED;
+  }
+  base = page_align_up(base);
+  end = page_align_down(end);
+
+  /* Candidates: the region start and the end of every reservation. */
+  for (int i = -1; i < pmm_reserved_count; i++) {
+    u64 candidate = i < 0 ? base : pmm_reserved[i].end;
+    if (candidate < base || candidate + pmm_place_size > end) {
+      continue;
+    }
+    if (!pmm_overlaps_reserved(candidate, candidate + pmm_place_size)) {
+      pmm_place_addr = candidate;
+      return;
+    }
+  }
+}
+
+static void pmm_mark_available(u64 base, u64 end) {
+  if (base < PMM_LOW_MEMORY) {
+    base = PMM_LOW_MEMORY;
+  }
+  if (end > PMM_MAX_PHYS) {
+    end = PMM_MAX_PHYS;
+  }
+  u64 first = page_align_up(base) / PAGE_SIZE;
+  u64 last = page_align_down(end) / PAGE_SIZE;
+  for (u64 frame = first; frame < last && frame < pmm_frame_count; frame++) {
+    pmm_frames[frame].flags &= ~PAGE_FRAME_RESERVED;
+  }
+}
+
+static void pmm_mark_reserved(u64 base, u64 end) {
+  u64 first = page_align_down(base) / PAGE_SIZE;
+  u64 last = page_align_up(end) / PAGE_SIZE;
+  for (u64 frame = first; frame < last && frame < pmm_frame_count; frame++) {
+    pmm_frames[frame].flags |= PAGE_FRAME_RESERVED;
+  }
+}
+
+/* Feed a run of usable frames to the buddy lists as maximal aligned blocks. */
+static void pmm_seed_run(u64 first, u64 last) {
+  while (first < last) {
+    u32 order = PMM_MAX_ORDER;
+    while (order > 0 && ((first & ((1ULL << order) - 1)) != 0 ||
+                         first + (1ULL << order) > last)) {
+      order--;
+    }
+    buddy_free_block((u32)first, order);
+    pmm_usable_count += 1ULL << order;
+    first += 1ULL << order;
+  }
+}
+
+/* Seed every run of unreserved frames in [first, last). */
+static void pmm_seed_frames(u64 first, u64 last) {
+  u64 run_start = 0;
+  int in_run = 0;
+  for (u64 frame = first; frame <= last; frame++) {
+    int usable =
+        frame < last && !(pmm_frames[frame].flags & PAGE_FRAME_RESERVED);
+    if (usable && !in_run) {
+      run_start = frame;
+      in_run = 1;
+    } else if (!usable && in_run) {
+      pmm_seed_run(run_start, frame);
+      in_run = 0;
+    }
+  }
+}
+
+void pmm_init(u32 magic, u64 mb_info) {
+  unsigned long heap_start = 0;
+  unsigned long heap_end = 0;
+  kheap_get_range(&heap_start, &heap_end);
+
+  pmm_add_reserved(0, PMM_LOW_MEMORY);
+  pmm_add_reserved((u64)&start, virt_to_phys((void *)heap_end));
+  pmm_reserve_boot_info(magic, mb_info);
+
+  pmm_highest_end = 0;
+  pmm_for_each_available(magic, mb_info, pmm_find_highest);
+  if (pmm_highest_end == 0) {
+    com1_printf("[PMM] Error: no usable memory in boot memory map\n");
+    return;
+  }
+
+  pmm_frame_count = pmm_highest_end / PAGE_SIZE;
+  pmm_place_size = page_align_up(pmm_frame_count * sizeof(page_frame_t));
+  pmm_place_addr = 0;
+  pmm_for_each_available(magic, mb_info, pmm_try_place);
+  if (!pmm_place_addr) {
+    com1_printf("[PMM] Error: no room for frame descriptors (%u bytes)\n",
+                (u32)pmm_place_size);
+    return;
+  }
+
+  pmm_frames = phys_to_virt(pmm_place_addr);
+  for (u64 frame = 0; frame < pmm_frame_count; frame++) {
+    pmm_frames[frame].next = PMM_NO_FRAME;
+    pmm_frames[frame].prev = PMM_NO_FRAME;
+    pmm_frames[frame].order = 0;
+    pmm_frames[frame].flags = PAGE_FRAME_RESERVED;
+    pmm_frames[frame].owner = NULL;
+  }
+  for (u32 order = 0; order <= PMM_MAX_ORDER; order++) {
+    pmm_free_head[order] = PMM_NO_FRAME;
+    pmm_free_blocks_count[order] = 0;
+  }
+
+  pmm_for_each_available(magic, mb_info, pmm_mark_available);
+  for (int i = 0; i < pmm_reserved_count; i++) {
+    pmm_mark_reserved(pmm_reserved[i].base, pmm_reserved[i].end);
+  }
+  pmm_mark_reserved(pmm_place_addr, pmm_place_addr + pmm_place_size);
+
+  /* Frames above the boot direct map are only handed out once it has been
+   * extended over them, with page tables from the frames below. */
+  u64 boot_frames = PMM_BOOT_MAPPED / PAGE_SIZE;
+  if (boot_frames > pmm_frame_count) {
+    boot_frames = pmm_frame_count;
+  }
+  pmm_free_count = 0;
+  pmm_usable_count = 0;
+  pmm_seed_frames(0, boot_frames);
+  pmm_initialized = 1;
+  if (boot_frames < pmm_frame_count) {
+    if (mmu_map_direct(pmm_highest_end) == 0) {
+      pmm_seed_frames(boot_frames, pmm_frame_count);
+    } else {
+      com1_printf("[PMM] Warning: RAM above 4 GB left unused\n");
+    }
+  }
+  register_shrinker(&zero_pool_shrinker);
+
+  com1_printf("[PMM] %u MB usable, %u frames free, descriptors at %p "
+              "(%u bytes)\n",
+              (u32)(pmm_usable_count * PAGE_SIZE / (1024 * 1024)),
+              (u32)pmm_free_count, (void *)pmm_place_addr,
+              (u32)pmm_place_size);
+}
+
+int pmm_is_initialized(void) { return pmm_initialized; }
+
+void pmm_reserve_range(u64 base, u64 length) {
+  if (length == 0) {
+    return;
+  }
+  if (!pmm_initialized) {
+    pmm_add_reserved(base, base + length);
+    return;
+  }
+
+  u64 first = page_align_down(base) / PAGE_SIZE;
+  u64 last = page_align_up(base + length) / PAGE_SIZE;
+  for (u64 frame = first; frame < last && frame < pmm_frame_count; frame++) {
+    if (pmm_frames[frame].flags & PAGE_FRAME_RESERVED) {
+      continue;
+    }
+    buddy_claim_frame((u32)frame);
+    pmm_frames[frame].flags |= PAGE_FRAME_RESERVED;
+  }
+}
+
+u64 alloc_pages(u32 order) {
+  if (!pmm_initialized || order > PMM_MAX_ORDER) {
+    return 0;
+  }
+
+  u32 frame = buddy_alloc_block(order);
+  if (frame == PMM_NO_FRAME && shrink_caches(1UL << order, "pmm")) {
+    frame = buddy_alloc_block(order);
+  }
+  if (frame == PMM_NO_FRAME) {
+    com1_printf("[PMM] Error: out of memory for order %u block\n", order);
+    return 0;
+  }
+
+  pmm_frames[frame].flags = PAGE_FRAME_HEAD;
+  pmm_frames[frame].order = (u8)order;
+  pmm_frames[frame].refcount = 1;
+  return (u64)frame * PAGE_SIZE;
+}
+
+void free_pages(u64 paddr, u32 order) {
+  u64 frame = paddr / PAGE_SIZE;
+  if (!pmm_initialized || (paddr & (PAGE_SIZE - 1)) != 0 ||
+      frame >= pmm_frame_count || order > PMM_MAX_ORDER ||
+      (frame & ((1ULL << order) - 1)) != 0) {
+    com1_printf("[PMM] Error: bad free of %p (order %u)\n", (void *)paddr,
+                order);
+    return;
+  }
+
+  page_frame_t *page = &pmm_frames[frame];
+  if (!(page->flags & PAGE_FRAME_HEAD)) {
+    com1_printf("[PMM] Error: double free of %p\n", (void *)paddr);
+    return;
+  }
+  if (page->order != order) {
+    com1_printf("[PMM] Error: %p freed with order %u, allocated with %u\n",
+                (void *)paddr, order, (u32)page->order);
+    return;
+  }
+
+  page->flags = 0;
+  page->order = 0;
+  page->refcount = 0;
+  for (u64 i = 0; i < (1ULL << order); i++) {
+    pmm_frames[frame + i].owner = NULL;
+  }
+  buddy_free_block((u32)frame, order);
+}
+
+void pmm_set_owner(u64 paddr, u32 order, void *owner) {
+  u64 frame = paddr / PAGE_SIZE;
+  if (!pmm_initialized || frame + (1ULL << order) > pmm_frame_count) {
+    return;
+  }
+  for (u64 i = 0; i < (1ULL << order); i++) {
+    pmm_frames[frame + i].owner = owner;
+  }
+}
+
+void *pmm_get_owner(u64 paddr) {
+  u64 frame = paddr / PAGE_SIZE;
+  if (!pmm_initialized || frame >= pmm_frame_count) {
+    return NULL;
+  }
+  return pmm_frames[frame].owner;
+}
+
+static page_frame_t *pmm_allocated_head(u64 paddr) {
+  u64 frame = paddr / PAGE_SIZE;
+  if (!pmm_initialized || frame >= pmm_frame_count ||
+      !(pmm_frames[frame].flags & PAGE_FRAME_HEAD)) {
+    return NULL;
+  }
+  return &pmm_frames[frame];
+}
+
+void split_pages(u64 paddr) {
+  page_frame_t *head = pmm_allocated_head(paddr);
+  if (!head) {
+    return;
+  }
+  u64 frame = paddr / PAGE_SIZE;
+  u64 count = 1ULL << head->order;
+  u16 refcount = head->refcount;
+  for (u64 i = 0; i < count; i++) {
+    pmm_frames[frame + i].flags = PAGE_FRAME_HEAD;
+    pmm_frames[frame + i].order = 0;
+    pmm_frames[frame + i].refcount = refcount;
+  }
+}
+
+int pmm_page_get(u64 paddr) {
+  page_frame_t *page = pmm_allocated_head(paddr);
+  if (!page || page->refcount == 0xFFFF) {
+    return -1;
+  }
+  page->refcount++;
+  return 0;
+}
+
+void pmm_page_put(u64 paddr) {
+  page_frame_t *page = pmm_allocated_head(paddr);
+  if (!page) {
+    return;
+  }
+  if (page->refcount > 1) {
+    page->refcount--;
+    return;
+  }
+  free_pages(paddr & ~(u64)(PAGE_SIZE - 1), page->order);
+}
+
+u32 pmm_page_refcount(u64 paddr) {
+  page_frame_t *page = pmm_allocated_head(paddr);
+  return page ? page->refcount : 0;
+}
+
+u64 pmm_alloc_frame(void) { return alloc_pages(0); }
+
+void pmm_free_frame(u64 paddr) { free_pages(paddr, 0); }
+
+u64 pmm_total_frames(void) { return pmm_usable_count; }
+
+u64 pmm_free_frames(void) { return pmm_free_count; }
+
+u64 pmm_free_blocks(u32 order) {
+  if (order > PMM_MAX_ORDER) {
+    return 0;
+  }
+  return pmm_free_blocks_count[order];
+}
+
+/*
+ * Pre-zeroed frames. Callers that need a clean page (page tables, anonymous
+ * mmap, user stacks) take one from here instead of zeroing on their latency
+ * path; the pool is topped up from idle loops. Idle refill starts once the
+ * pool drops below the low watermark and runs until it reaches the high one.
+ */
+#define PMM_ZERO_POOL_SIZE 256
+#define PMM_ZERO_LOW 32
+#define PMM_ZERO_HIGH 128
+#define PMM_ZERO_BATCH 8       /* frames zeroed per idle call */
+#define PMM_ZERO_MIN_FREE 1024 /* leave this many frames to the buddy */
+
+static u64 zero_pool[PMM_ZERO_POOL_SIZE];
+static u32 zero_count = 0;
+static int zero_refilling = 1;
+static pmm_zero_stats_t zero_stats;
+
+/* The idle loops run with interrupts enabled and may be preempted by code
+ * that allocates, so pool and buddy updates from here mask interrupts. */
+static inline u64 pmm_irq_save(void) {
+  u64 flags;
+  __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+  return flags;
+}
+
+static inline void pmm_irq_restore(u64 flags) {
+  if (flags & 0x200) {
+    __asm__ volatile("sti" : : : "memory");
+  }
+}
+
+u64 pmm_alloc_zeroed_frame(void) {
+  u64 frame = 0;
+  u64 flags = pmm_irq_save();
+  if (zero_count) {
+    frame = zero_pool[--zero_count];
+    zero_stats.hits++;
+    if (zero_count < PMM_ZERO_LOW) {
+      zero_refilling = 1;
+    }
+  }
+  pmm_irq_restore(flags);
+  if (frame) {
+    return frame;
+  }
+
+  zero_stats.misses++;
+  frame = pmm_alloc_frame();
+  if (frame) {
+    memset(phys_to_virt(frame), 0, PAGE_SIZE);
+  }
+  return frame;
+}
+
+void pmm_free_zeroed_frame(u64 paddr) {
+  if (!paddr) {
+    return;
+  }
+  u64 flags = pmm_irq_save();
+  if (zero_count < PMM_ZERO_POOL_SIZE) {
+    zero_pool[zero_count++] = paddr;
+    zero_stats.returned++;
+    paddr = 0;
+  }
+  pmm_irq_restore(flags);
+  if (paddr) {
+    pmm_free_frame(paddr);
+  }
+}
+
+void pmm_zero_pool_refill(void) {
+  if (!pmm_initialized || !zero_refilling) {
+    return;
+  }
+
+  for (int i = 0; i < PMM_ZERO_BATCH; i++) {
+    u64 flags = pmm_irq_save();
+    u64 frame = 0;
+    if (zero_count >= PMM_ZERO_HIGH) {
+      zero_refilling = 0;
+    } else if (pmm_free_count > PMM_ZERO_MIN_FREE) {
+      frame = pmm_alloc_frame();
+    }
+    pmm_irq_restore(flags);
+    if (!frame) {
+      return;
+    }
+
+    memset(phys_to_virt(frame), 0, PAGE_SIZE);
+
+    flags = pmm_irq_save();
+    if (zero_count < PMM_ZERO_POOL_SIZE) {
+      zero_pool[zero_count++] = frame;
+      zero_stats.refilled++;
+      frame = 0;
+    }
+    if (frame) {
+      pmm_free_frame(frame);
+    }
+    pmm_irq_restore(flags);
+  }
+}
+
+static unsigned long zero_pool_count(shrinker_t *shrinker) {
+  (void)shrinker;
+  return zero_count;
+}
+
+static unsigned long zero_pool_scan(shrinker_t *shrinker, unsigned long nr) {
+  (void)shrinker;
+  unsigned long freed = 0;
+  u64 flags = pmm_irq_save();
+  while (freed < nr && zero_count) {
+    pmm_free_frame(zero_pool[--zero_count]);
+    freed++;
+  }
+  pmm_irq_restore(flags);
+  return freed;
+}
+
+static shrinker_t zero_pool_shrinker = {
+    .name = "zero_pool", .count = zero_pool_count, .scan = zero_pool_scan};
+
+void pmm_zero_pool_stats(pmm_zero_stats_t *out) {
+  u64 flags = pmm_irq_save();
+  *out = zero_stats;
+  out->count = zero_count;
+  out->low = PMM_ZERO_LOW;
+  out->high = PMM_ZERO_HIGH;
+  pmm_irq_restore(flags);
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PMM_H
+#define PMM_H
+
+#include <mlibc/mlibc.h>
+
+/* Frames are only handed out below this limit, the size of the direct map
+ * (KERNEL_DIRECT_MAP_SIZE) the kernel reaches them through. */
+#define PMM_MAX_PHYS (512ULL << 30)
+
+/* Largest buddy block: 2^10 frames = 4 MB */
+#define PMM_MAX_ORDER 10
+
+typedef struct {
+  u32 count;    /* zeroed frames currently pooled */
+  u32 low;      /* idle refill starts below this */
+  u32 high;     /* and stops here */
+  u64 hits;     /* allocations served from the pool */
+  u64 misses;   /* pool empty, zeroed on the spot */
+  u64 refilled; /* frames zeroed from idle loops */
+  u64 returned; /* already-clean frames given back (page tables) */
+} pmm_zero_stats_t;
+
+typedef struct {
+  u32 next; /* Free list links (frame numbers) */
+  u32 prev;
+  u8 order; /* Block order, valid on the first frame of a block */
+  u8 flags;
+  u16 refcount; /* Mappings of an allocated block, on its first frame */
+  void *owner; /* Set by the user of an allocated block (e.g. kmem_cache) */
+} page_frame_t;
+
+void pmm_init(u32 magic, u64 mb_info);
+int pmm_is_initialized(void);
+void pmm_reserve_range(u64 base, u64 length);
+
+/* Physically contiguous, naturally aligned blocks of 2^order frames.
+ * Returns the physical address (see phys_to_virt), 0 on failure. */
+u64 alloc_pages(u32 order);
+void free_pages(u64 paddr, u32 order);
+/* Turn an allocated block into 2^order single-frame blocks, each freed on
+ * its own and starting with the block's reference count. */
+void split_pages(u64 paddr);
+
+/* Tag every frame of an allocated block so an address can be mapped back to
+ * whoever owns it. */
+void pmm_set_owner(u64 paddr, u32 order, void *owner);
+void *pmm_get_owner(u64 paddr);
+
+/* Blocks start with one reference. pmm_page_get adds one for another
+ * mapping of the block at paddr, pmm_page_put drops one and frees the block
+ * with the last. Both ignore frames the allocator did not hand out (device
+ * memory, the kernel image); pmm_page_get returns -1 for those. */
+int pmm_page_get(u64 paddr);
+void pmm_page_put(u64 paddr);
+u32 pmm_page_refcount(u64 paddr);
+
+u64 pmm_alloc_frame(void);
+void pmm_free_frame(u64 paddr);
+u64 pmm_total_frames(void);
+u64 pmm_free_frames(void);
+u64 pmm_free_blocks(u32 order);
+
+/* Zero-filled frames from the idle-refilled pool. pmm_free_zeroed_frame is
+ * only for frames the caller knows are still all zero. */
+u64 pmm_alloc_zeroed_frame(void);
+void pmm_free_zeroed_frame(u64 paddr);
+void pmm_zero_pool_refill(void);
+void pmm_zero_pool_stats(pmm_zero_stats_t *out);
+
+#endif
@@ -27,6 +27,7 @@
 #include <kernel/mmu.h>
 #include <kernel/posix/posix.h>
 #include <kernel/process.h>
+#include <kernel/reclaim.h>
 #include <mlibc/memory.h>
 
 long sys_clone(u64 flags, u64 child_stack, u64 ptid, registers_t *regs) {
@@ -55,15 +56,13 @@ long sys_clone(u64 flags, u64 child_stack, u64 ptid, registers_t *regs) {
     return -ENOMEM;
   }
 
-  u8 *kstack = (u8 *)kmalloc_aligned(KERNEL_STACK_SIZE, 16);
-  if (!kstack) {
-    mmu_free_user_space(child_cr3);
-    kfree((void *)(child_cr3 & PTE_ADDR_MASK));
+  u64 kstack_top = process_alloc_kernel_stack();
+  if (!kstack_top) {
+    mmu_destroy_address_space(child_cr3);
     memset(child, 0, sizeof(process_t));
     child->state = PROC_STATE_UNUSED;
     return -ENOMEM;
   }
-  memset(kstack, 0, KERNEL_STACK_SIZE);
 
   memset(child, 0, sizeof(process_t));
 
@@ -78,7 +77,7 @@ long sys_clone(u64 flags, u64 child_stack, u64 ptid, registers_t *regs) {
   }
   child->name[PROCESS_NAME_LEN - 1] = '\0';
 
-  child->kernel_stack = (u64)(kstack + KERNEL_STACK_SIZE);
+  child->kernel_stack = kstack_top;
   child->user_stack = parent->user_stack;
 
   process_save_context(parent, regs);
@@ -93,6 +92,14 @@ long sys_clone(u64 flags, u64 child_stack, u64 ptid, registers_t *regs) {
   child->exit_code = 0;
   child->owns_address_space = 1;
   child->mmap_base = parent->mmap_base;
+  if (vma_copy(&child->vmas, &parent->vmas) != 0) {
+    mmu_destroy_address_space(child_cr3);
+    process_free_kernel_stack(kstack_top);
+    memset(child, 0, sizeof(process_t));
+    child->state = PROC_STATE_UNUSED;
+    return -ENOMEM;
+  }
+  reclaim_track_areas(child);
   posix_copy_fds(child, parent);
   child->next = NULL;
 
@@ -27,9 +27,13 @@
 #include <kernel/drivers/fs/chainFS/chainfs.h>
 #include <kernel/gdt.h>
 #include <kernel/mmu.h>
+#include <kernel/pmm.h>
 #include <kernel/posix/posix.h>
 #include <kernel/process.h>
+#include <kernel/reclaim.h>
 #include <kernel/useraddr.h>
+#include <kernel/vmalloc.h>
+#include <mlibc/arena.h>
 #include <mlibc/memory.h>
 #include <mlibc/mlibc.h>
 #include <userland/elf.h>
@@ -38,8 +42,15 @@
 #define EXEC_MAX_ARGS 64
 #define EXEC_MAX_ENVP 64
 #define EXEC_MAX_STR 256
+#define EXEC_MAX_AREAS 16
 
-static char *copy_user_string(const char *user, size_t max_len) {
+/*
+ * Everything sys_execve copies in (path, argv, envp and the pointer arrays
+ * built on the new stack) lives in one arena that is destroyed on the way
+ * out, success or not.
+ */
+static char *copy_user_string(arena_t *scratch, const char *user,
+                              size_t max_len) {
   if (!user) {
     return NULL;
   }
@@ -62,17 +73,11 @@ static char *copy_user_string(const char *user, size_t max_len) {
     return NULL;
   }
 
-  char *out = (char *)kcalloc(len + 1, 1);
-  if (!out) {
-    return NULL;
-  }
-  memcpy(out, user, len);
-  out[len] = '\0';
-  return out;
+  return arena_strndup(scratch, user, len);
 }
 
-static int copy_user_string_array(const char *const *user, char ***out,
-                                  int max_count) {
+static int copy_user_string_array(arena_t *scratch, const char *const *user,
+                                  char ***out, int max_count) {
   if (!user) {
     *out = NULL;
     return 0;
@@ -82,7 +87,7 @@ static int copy_user_string_array(const char *const *user, char ***out,
     return -EFAULT;
   }
 
-  char **arr = (char **)kcalloc(max_count + 1, sizeof(char *));
+  char **arr = (char **)arena_alloc(scratch, (max_count + 1) * sizeof(char *));
   if (!arr) {
     return -ENOMEM;
   }
@@ -96,12 +101,8 @@ static int copy_user_string_array(const char *const *user, char ***out,
     if (!ptr) {
       break;
     }
-    char *copy = copy_user_string(ptr, EXEC_MAX_STR);
+    char *copy = copy_user_string(scratch, ptr, EXEC_MAX_STR);
     if (!copy) {
-      for (int i = 0; i < count; i++) {
-        kfree(arr[i]);
-      }
-      kfree(arr);
       return -EFAULT;
     }
     arr[count++] = copy;
@@ -109,10 +110,6 @@ static int copy_user_string_array(const char *const *user, char ***out,
 
   if (count == max_count) {
     if (is_user_address(&user[count], sizeof(char *)) && user[count] != NULL) {
-      for (int i = 0; i < count; i++) {
-        kfree(arr[i]);
-      }
-      kfree(arr);
       return -E2BIG;
     }
   }
@@ -122,16 +119,6 @@ static int copy_user_string_array(const char *const *user, char ***out,
   return count;
 }
 
-static void free_string_array(char **arr) {
-  if (!arr) {
-    return;
-  }
-  for (int i = 0; arr[i]; i++) {
-    kfree(arr[i]);
-  }
-  kfree(arr);
-}
-
 static int read_file_into_buffer(const char *path, u8 **out_buf,
                                  u32 *out_size) {
   chainfs_file_entry_t entry;
@@ -145,7 +132,7 @@ static int read_file_into_buffer(const char *path, u8 **out_buf,
     return -ENOEXEC;
   }
 
-  u8 *buf = (u8 *)kcalloc(size, 1);
+  u8 *buf = (u8 *)kvzalloc(size, KMEM_TAG_PROC);
   if (!buf) {
     return -ENOMEM;
   }
@@ -153,7 +140,7 @@ static int read_file_into_buffer(const char *path, u8 **out_buf,
   u32 bytes_read = 0;
   if (chainfs_read_file(path, buf, size, &bytes_read) != 0 ||
       bytes_read != size) {
-    kfree(buf);
+    kvfree(buf);
     return -EIO;
   }
 
@@ -162,50 +149,41 @@ static int read_file_into_buffer(const char *path, u8 **out_buf,
   return 0;
 }
 
+static u64 user_stack_frame(u64 index, void *ctx) {
+  (void)index;
+  (void)ctx;
+  return pmm_alloc_zeroed_frame();
+}
+
 static u64 allocate_user_stack(void) {
   u64 stack_pages = (USER_STACK_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
   u64 stack_bottom = USER_STACK_TOP;
 
-  for (u64 i = 0; i < stack_pages; i++) {
-    void *page = kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
-    if (!page) {
-      for (u64 j = 0; j < i; j++) {
-        u64 vaddr = stack_bottom + (j * PAGE_SIZE);
-        u64 paddr = mmu_virt_to_phys(vaddr);
-        mmu_unmap_page(vaddr);
-        if (paddr) {
-          kfree((void *)paddr);
-        }
-      }
-      return 0;
-    }
-    memset(page, 0, PAGE_SIZE);
-
-    u64 vaddr = stack_bottom + (i * PAGE_SIZE);
-    mmu_map_page(vaddr, (u64)page, PTE_PRESENT | PTE_RW | PTE_USER | PTE_NX);
+  if (mmu_map_range_frames(stack_bottom, stack_pages * PAGE_SIZE,
+                           PTE_PRESENT | PTE_RW | PTE_USER | PTE_NX,
+                           user_stack_frame, NULL) != 0) {
+    mmu_unmap_range(stack_bottom, stack_pages * PAGE_SIZE, 1);
+    return 0;
   }
 
   return USER_STACK_BASE;
 }
 
-static int build_user_stack(char **argv, int argc, char **envp, int envc,
-                            u64 *out_rsp, u64 *out_argv, u64 *out_envp) {
+static int build_user_stack(arena_t *scratch, char **argv, int argc,
+                            char **envp, int envc, u64 *out_rsp,
+                            u64 *out_argv, u64 *out_envp) {
   u64 sp = USER_STACK_BASE & ~0xFULL;
   u64 stack_min = USER_STACK_TOP;
 
-  u64 *argv_ptrs = (u64 *)kcalloc(argc ? argc : 1, sizeof(u64));
-  u64 *envp_ptrs = (u64 *)kcalloc(envc ? envc : 1, sizeof(u64));
+  u64 *argv_ptrs = (u64 *)arena_alloc(scratch, argc * sizeof(u64));
+  u64 *envp_ptrs = (u64 *)arena_alloc(scratch, envc * sizeof(u64));
   if (!argv_ptrs || !envp_ptrs) {
-    kfree(argv_ptrs);
-    kfree(envp_ptrs);
     return -ENOMEM;
   }
 
   for (int i = envc - 1; i >= 0; i--) {
     size_t len = strlen(envp[i]) + 1;
     if (sp < stack_min + len) {
-      kfree(argv_ptrs);
-      kfree(envp_ptrs);
       return -E2BIG;
     }
     sp -= len;
@@ -216,8 +194,6 @@ static int build_user_stack(char **argv, int argc, char **envp, int envc,
   for (int i = argc - 1; i >= 0; i--) {
     size_t len = strlen(argv[i]) + 1;
     if (sp < stack_min + len) {
-      kfree(argv_ptrs);
-      kfree(envp_ptrs);
       return -E2BIG;
     }
     sp -= len;
@@ -228,8 +204,6 @@ static int build_user_stack(char **argv, int argc, char **envp, int envc,
   sp &= ~0xFULL;
 
   if (sp < stack_min + (u64)(8 * (argc + envc + 3))) {
-    kfree(argv_ptrs);
-    kfree(envp_ptrs);
     return -E2BIG;
   }
 
@@ -257,20 +231,147 @@ static int build_user_stack(char **argv, int argc, char **envp, int envc,
   *out_rsp = sp;
   *out_argv = argv_addr;
   *out_envp = envp_addr;
-
-  kfree(argv_ptrs);
-  kfree(envp_ptrs);
   return 0;
 }
 
-int sys_execve(const char *path, const char *const *argv,
-               const char *const *envp, registers_t *regs) {
-  process_t *proc = process_current();
-  if (!proc || !regs) {
-    com1_printf("[EXEC] Error: no current process or regs\n");
-    return -EINVAL;
+/* Pages of a read-only segment that hold file bytes only (VMA_FILE), or of
+ * a writable segment or the stack (VMA_ANON). */
+typedef struct {
+  u64 start;
+  u64 end;
+  u64 offset; /* file offset of start, VMA_FILE only */
+  u64 page_flags;
+  u32 vma_flags;
+} exec_area_t;
+
+/* A program loaded into a fresh address space, ready to be handed to a
+ * process by exec_start. */
+typedef struct {
+  u64 cr3;
+  u64 entry;
+  u64 user_stack;
+  u64 rsp;
+  u64 argv;
+  u64 envp;
+  int argc;
+  char name[PROCESS_NAME_LEN];
+  vma_file_t *file; /* the program file, when there are file areas */
+  exec_area_t areas[EXEC_MAX_AREAS];
+  u32 area_count;
+  u32 file_areas;
+} exec_image_t;
+
+static exec_area_t *exec_add_area(exec_image_t *image, u64 start, u64 end,
+                                  u64 page_flags, u32 vma_flags) {
+  if (start >= end || image->area_count == EXEC_MAX_AREAS) {
+    return NULL;
+  }
+  exec_area_t *area = &image->areas[image->area_count++];
+  area->start = start;
+  area->end = end;
+  area->offset = 0;
+  area->page_flags = page_flags;
+  area->vma_flags = vma_flags;
+  return area;
+}
+
+/* Shrink [*start, *end) so it no longer overlaps [other_start, other_end),
+ * keeping the part below the overlap when it is in the middle. */
+static void exec_clip(u64 *start, u64 *end, u64 other_start, u64 other_end) {
+  if (other_start >= *end || other_end <= *start) {
+    return;
+  }
+  if (other_start <= *start) {
+    *start = other_end;
+  } else {
+    *end = other_start;
+  }
+}
+
+/*
+ * Read-only PT_LOAD segments become file areas that reclaim can drop and
+ * read back in: the whole pages between the segment's first byte and the
+ * end of its file data, which hold exactly what the file has there. They
+ * are mapped read-only as the segment asks (elf_load leaves everything
+ * writable), and marked clean since elf_load's copy dirtied them.
+ */
+static void exec_file_area(exec_image_t *image, elf64_phdr_t *phdr) {
+  if ((phdr->p_vaddr - phdr->p_offset) & (PAGE_SIZE - 1)) {
+    return;
+  }
+  u64 start = (phdr->p_vaddr + PAGE_SIZE - 1) & ~((u64)PAGE_SIZE - 1);
+  u64 end = (phdr->p_vaddr + phdr->p_filesz) & ~((u64)PAGE_SIZE - 1);
+  u64 page_flags = PTE_PRESENT | PTE_USER;
+  if (!(phdr->p_flags & PF_X)) {
+    page_flags |= PTE_NX;
+  }
+  exec_area_t *area = exec_add_area(image, start, end, page_flags, VMA_FILE);
+  if (!area) {
+    return;
+  }
+  area->offset = phdr->p_offset + (start - phdr->p_vaddr);
+  image->file_areas++;
+  mmu_protect_user_range(start, end, page_flags);
+  mmu_clean_user_range(start, end);
+}
+
+/*
+ * Writable PT_LOAD segments (data and bss) become anonymous areas, so swap
+ * and same-page merging see them. A page shared with a read-only segment
+ * or already in an earlier area is left out: its flags are a mix.
+ */
+static void exec_anon_area(exec_image_t *image, elf_info_t *info, u16 index) {
+  elf64_phdr_t *phdr = &info->phdrs[index];
+  u64 start = phdr->p_vaddr & ~((u64)PAGE_SIZE - 1);
+  u64 end = (phdr->p_vaddr + phdr->p_memsz + PAGE_SIZE - 1) &
+            ~((u64)PAGE_SIZE - 1);
+  for (u16 i = 0; i < info->header->e_phnum; i++) {
+    elf64_phdr_t *other = &info->phdrs[i];
+    if (i == index || other->p_type != PT_LOAD || (other->p_flags & PF_W)) {
+      continue;
+    }
+    exec_clip(&start, &end, other->p_vaddr & ~((u64)PAGE_SIZE - 1),
+              (other->p_vaddr + other->p_memsz + PAGE_SIZE - 1) &
+                  ~((u64)PAGE_SIZE - 1));
+  }
+  for (u32 i = 0; i < image->area_count; i++) {
+    exec_clip(&start, &end, image->areas[i].start, image->areas[i].end);
+  }
+  u64 page_flags = PTE_PRESENT | PTE_USER | PTE_RW;
+  if (!(phdr->p_flags & PF_X)) {
+    page_flags |= PTE_NX;
+  }
+  exec_add_area(image, start, end, page_flags, VMA_ANON);
+}
+
+/* The areas of the loaded segments. Runs in the new address space. */
+static void exec_collect_areas(u8 *elf, u32 size, exec_image_t *image) {
+  image->area_count = 0;
+  image->file_areas = 0;
+  elf_info_t info;
+  if (elf_parse(elf, size, &info) != ELF_OK) {
+    return;
+  }
+  for (u16 i = 0; i < info.header->e_phnum; i++) {
+    elf64_phdr_t *phdr = &info.phdrs[i];
+    if (phdr->p_type != PT_LOAD) {
+      continue;
+    }
+    if (phdr->p_flags & PF_W) {
+      exec_anon_area(image, &info, i);
+    } else {
+      exec_file_area(image, phdr);
+    }
   }
+}
 
+/*
+ * Builds the program at the user path in a new address space. On success the
+ * CPU is left on the new space; on failure it is back on the one it was on
+ * and nothing is left behind.
+ */
+static int exec_load(const char *path, const char *const *argv,
+                     const char *const *envp, exec_image_t *image) {
   if (!is_user_address(path, 1)) {
     com1_printf("[EXEC] Error: invalid user path pointer %p\n",
                 (void *)path);
@@ -283,25 +384,28 @@ int sys_execve(const char *path, const char *const *argv,
     return -EIO;
   }
 
-  char *kpath = copy_user_string(path, EXEC_MAX_STR);
+  arena_t scratch;
+  arena_init(&scratch);
+
+  char *kpath = copy_user_string(&scratch, path, EXEC_MAX_STR);
   if (!kpath) {
     com1_printf("[EXEC] Error: failed to copy user path\n");
+    arena_destroy(&scratch);
     return -EFAULT;
   }
 
   char **kargv = NULL;
   char **kenvp = NULL;
-  int argc = copy_user_string_array(argv, &kargv, EXEC_MAX_ARGS);
+  int argc = copy_user_string_array(&scratch, argv, &kargv, EXEC_MAX_ARGS);
   if (argc < 0) {
     com1_printf("[EXEC] Error: failed to copy argv\n");
-    kfree(kpath);
+    arena_destroy(&scratch);
     return argc;
   }
-  int envc = copy_user_string_array(envp, &kenvp, EXEC_MAX_ENVP);
+  int envc = copy_user_string_array(&scratch, envp, &kenvp, EXEC_MAX_ENVP);
   if (envc < 0) {
     com1_printf("[EXEC] Error: failed to copy envp\n");
-    free_string_array(kargv);
-    kfree(kpath);
+    arena_destroy(&scratch);
     return envc;
   }
 
@@ -310,9 +414,7 @@ int sys_execve(const char *path, const char *const *argv,
   int err = read_file_into_buffer(kpath, &elf_buf, &elf_size);
   if (err < 0) {
     com1_printf("[EXEC] Error: failed to read file '%s'\n", kpath);
-    free_string_array(kargv);
-    free_string_array(kenvp);
-    kfree(kpath);
+    arena_destroy(&scratch);
     return err;
   }
   com1_printf("[EXEC] Loaded '%s' (%u bytes)\n", kpath, elf_size);
@@ -320,26 +422,24 @@ int sys_execve(const char *path, const char *const *argv,
   u64 new_cr3 = mmu_create_address_space();
   if (!new_cr3) {
     com1_printf("[EXEC] Error: failed to create address space\n");
-    kfree(elf_buf);
-    free_string_array(kargv);
-    free_string_array(kenvp);
-    kfree(kpath);
+    kvfree(elf_buf);
+    arena_destroy(&scratch);
     return -ENOMEM;
   }
 
-  u64 old_cr3 = proc->cr3;
+  u64 old_cr3 = mmu_read_cr3() & PTE_ADDR_MASK;
   mmu_write_cr3(new_cr3);
 
   u64 entry = elf_load(elf_buf, elf_size);
-  kfree(elf_buf);
+  if (entry != 0) {
+    exec_collect_areas(elf_buf, elf_size, image);
+  }
+  kvfree(elf_buf);
   if (entry == 0) {
     com1_printf("[EXEC] Error: elf_load failed for '%s'\n", kpath);
     mmu_write_cr3(old_cr3);
-    mmu_free_user_space(new_cr3);
-    kfree((void *)(new_cr3 & PTE_ADDR_MASK));
-    free_string_array(kargv);
-    free_string_array(kenvp);
-    kfree(kpath);
+    mmu_destroy_address_space(new_cr3);
+    arena_destroy(&scratch);
     return -ENOEXEC;
   }
 
@@ -347,74 +447,160 @@ int sys_execve(const char *path, const char *const *argv,
   if (user_stack == 0) {
     com1_printf("[EXEC] Error: allocate_user_stack failed\n");
     mmu_write_cr3(old_cr3);
-    mmu_free_user_space(new_cr3);
-    kfree((void *)(new_cr3 & PTE_ADDR_MASK));
-    free_string_array(kargv);
-    free_string_array(kenvp);
-    kfree(kpath);
+    mmu_destroy_address_space(new_cr3);
+    arena_destroy(&scratch);
     return -ENOMEM;
   }
+  exec_add_area(image, USER_STACK_TOP,
+                USER_STACK_TOP + ((USER_STACK_SIZE + PAGE_SIZE - 1) &
+                                  ~((u64)PAGE_SIZE - 1)),
+                PTE_PRESENT | PTE_RW | PTE_USER | PTE_NX, VMA_ANON);
 
-  u64 new_rsp = 0;
-  u64 argv_addr = 0;
-  u64 envp_addr = 0;
-  err = build_user_stack(kargv, argc, kenvp, envc, &new_rsp, &argv_addr,
-                         &envp_addr);
+  err = build_user_stack(&scratch, kargv, argc, kenvp, envc, &image->rsp,
+                         &image->argv, &image->envp);
   if (err < 0) {
     com1_printf("[EXEC] Error: build_user_stack failed\n");
     mmu_write_cr3(old_cr3);
-    mmu_free_user_space(new_cr3);
-    kfree((void *)(new_cr3 & PTE_ADDR_MASK));
-    free_string_array(kargv);
-    free_string_array(kenvp);
-    kfree(kpath);
+    mmu_destroy_address_space(new_cr3);
+    arena_destroy(&scratch);
     return err;
   }
 
-  free_string_array(kargv);
-  free_string_array(kenvp);
-
-  if (proc->owns_address_space) {
-    mmu_free_user_space(old_cr3);
-    kfree((void *)(old_cr3 & PTE_ADDR_MASK));
-  }
-
   const char *base = kpath;
   for (const char *p = kpath; *p; p++) {
     if (*p == '/') {
       base = p + 1;
     }
   }
-  memset(proc->name, 0, sizeof(proc->name));
+  memset(image->name, 0, sizeof(image->name));
   for (int i = 0; i < PROCESS_NAME_LEN - 1 && base[i]; i++) {
-    proc->name[i] = base[i];
+    image->name[i] = base[i];
+  }
+  /* Without the file object the file areas just stay resident. */
+  image->file = NULL;
+  if (image->file_areas) {
+    image->file = vma_file_create(kpath, elf_size);
   }
-  kfree(kpath);
+  arena_destroy(&scratch);
 
-  proc->cr3 = new_cr3;
-  proc->entry_point = entry;
-  proc->user_stack = user_stack;
-  proc->context.rip = entry;
-  proc->context.rsp = new_rsp;
+  image->cr3 = new_cr3;
+  image->entry = entry;
+  image->user_stack = user_stack;
+  image->argc = argc;
+  return 0;
+}
+
+/* Points proc at a loaded image; it starts in main(argc, argv, envp). */
+static void exec_start(process_t *proc, const exec_image_t *image) {
+  memcpy(proc->name, image->name, sizeof(proc->name));
+  proc->cr3 = image->cr3;
+  proc->entry_point = image->entry;
+  proc->user_stack = image->user_stack;
+  memset(&proc->context, 0, sizeof(cpu_context_t));
+  proc->context.rip = image->entry;
+  proc->context.rsp = image->rsp;
   proc->context.cs = USER_CS;
   proc->context.ss = USER_DS;
   proc->context.rflags = 0x202;
-  proc->context.rdi = (u64)argc;
-  proc->context.rsi = argv_addr;
-  proc->context.rdx = envp_addr;
+  proc->context.rdi = (u64)image->argc;
+  proc->context.rsi = image->argv;
+  proc->context.rdx = image->envp;
   proc->context.rax = 0;
   proc->owns_address_space = 1;
   proc->mmap_base = MMAP_BASE;
 
-  regs->rip = entry;
-  regs->rsp = new_rsp;
+  for (u32 i = 0; i < image->area_count; i++) {
+    const exec_area_t *area = &image->areas[i];
+    if (area->vma_flags & VMA_ANON) {
+      vma_insert(&proc->vmas, area->start, area->end, area->page_flags,
+                 VMA_ANON);
+    } else if (image->file &&
+               vma_insert_file(&proc->vmas, area->start, area->end,
+                               area->page_flags, image->file,
+                               area->offset) == 0) {
+      reclaim_track_range(proc, area->start, area->end);
+    }
+  }
+  if (image->file) {
+    vma_file_put(image->file);
+  }
+}
+
+int sys_execve(const char *path, const char *const *argv,
+               const char *const *envp, registers_t *regs) {
+  process_t *proc = process_current();
+  if (!proc || !regs) {
+    com1_printf("[EXEC] Error: no current process or regs\n");
+    return -EINVAL;
+  }
+
+  exec_image_t image;
+  int err = exec_load(path, argv, envp, &image);
+  if (err < 0) {
+    return err;
+  }
+
+  if (proc->owns_address_space) {
+    mmu_destroy_address_space(proc->cr3);
+  }
+  reclaim_forget(proc);
+  vma_release(&proc->vmas);
+  exec_start(proc, &image);
+  process_vfork_release(proc);
+
+  regs->rip = proc->context.rip;
+  regs->rsp = proc->context.rsp;
   regs->cs = USER_CS;
   regs->ss = USER_DS;
   regs->rflags = 0x202;
-  regs->rdi = (u64)argc;
-  regs->rsi = argv_addr;
-  regs->rdx = envp_addr;
+  regs->rdi = proc->context.rdi;
+  regs->rsi = proc->context.rsi;
+  regs->rdx = proc->context.rdx;
   regs->rax = 0;
 
   return 0;
 }
+
+int sys_spawn(const char *path, const char *const *argv,
+              const char *const *envp) {
+  process_t *parent = process_current();
+  if (!parent) {
+    return -EINVAL;
+  }
+
+  process_t *child = alloc_process();
+  if (!child) {
+    return -EAGAIN;
+  }
+  child->state = PROC_STATE_EMBRYO;
+
+  u64 kstack_top = process_alloc_kernel_stack();
+  if (!kstack_top) {
+    child->state = PROC_STATE_UNUSED;
+    return -ENOMEM;
+  }
+
+  /* The child's space is built while the parent's stays the one argv and
+   * envp are read from; exec_load only switches after copying them. */
+  exec_image_t image;
+  int err = exec_load(path, argv, envp, &image);
+  mmu_switch_address_space(parent->cr3, &parent->pcid);
+  if (err < 0) {
+    process_free_kernel_stack(kstack_top);
+    child->state = PROC_STATE_UNUSED;
+    return err;
+  }
+
+  memset(child, 0, sizeof(process_t));
+  child->pid = next_pid++;
+  child->ppid = parent->pid;
+  child->state = PROC_STATE_EMBRYO;
+  child->kernel_stack = kstack_top;
+  exec_start(child, &image);
+  posix_copy_fds(child, parent);
+  child->state = PROC_STATE_RUNNABLE;
+
+  com1_printf("[EXEC] Spawned '%s' (PID %d) for PID %d\n", child->name,
+              (int)child->pid, (int)parent->pid);
+  return (int)child->pid;
+}
@@ -27,6 +27,8 @@
 #include <kernel/mmu.h>
 #include <kernel/posix/posix.h>
 #include <kernel/process.h>
+#include <kernel/reclaim.h>
+#include <kernel/scheduler.h>
 #include <mlibc/memory.h>
 
 int sys_fork(registers_t *regs) {
@@ -49,15 +51,13 @@ int sys_fork(registers_t *regs) {
     return -ENOMEM;
   }
 
-  u8 *kstack = (u8 *)kmalloc_aligned(KERNEL_STACK_SIZE, 16);
-  if (!kstack) {
-    mmu_free_user_space(child_cr3);
-    kfree((void *)(child_cr3 & PTE_ADDR_MASK));
+  u64 kstack_top = process_alloc_kernel_stack();
+  if (!kstack_top) {
+    mmu_destroy_address_space(child_cr3);
     memset(child, 0, sizeof(process_t));
     child->state = PROC_STATE_UNUSED;
     return -ENOMEM;
   }
-  memset(kstack, 0, KERNEL_STACK_SIZE);
 
   memset(child, 0, sizeof(process_t));
 
@@ -72,7 +72,7 @@ int sys_fork(registers_t *regs) {
   }
   child->name[PROCESS_NAME_LEN - 1] = '\0';
 
-  child->kernel_stack = (u64)(kstack + KERNEL_STACK_SIZE);
+  child->kernel_stack = kstack_top;
   child->user_stack = parent->user_stack;
 
   process_save_context(parent, regs);
@@ -82,8 +82,73 @@ int sys_fork(registers_t *regs) {
   child->exit_code = 0;
   child->owns_address_space = 1;
   child->mmap_base = parent->mmap_base;
+  if (vma_copy(&child->vmas, &parent->vmas) != 0) {
+    mmu_destroy_address_space(child_cr3);
+    process_free_kernel_stack(kstack_top);
+    memset(child, 0, sizeof(process_t));
+    child->state = PROC_STATE_UNUSED;
+    return -ENOMEM;
+  }
+  reclaim_track_areas(child);
   posix_copy_fds(child, parent);
   child->next = NULL;
 
   return (int)child->pid;
 }
+
+/*
+ * The child runs on the parent's page tables and mappings instead of a copy,
+ * and the parent sleeps until the child calls execve or exits
+ * (process_vfork_release). The call returns straight into the child: the
+ * 0 returned here lands in the child's rax, the parent gets the child's pid
+ * from its saved context when it is woken.
+ */
+int sys_vfork(registers_t *regs) {
+  process_t *parent = process_current();
+  if (!parent || !regs) {
+    return -EINVAL;
+  }
+
+  process_t *child = alloc_process();
+  if (!child) {
+    return -EAGAIN;
+  }
+
+  u64 kstack_top = process_alloc_kernel_stack();
+  if (!kstack_top) {
+    return -ENOMEM;
+  }
+
+  memset(child, 0, sizeof(process_t));
+
+  child->pid = next_pid++;
+  child->ppid = parent->pid;
+  child->state = PROC_STATE_RUNNABLE;
+  child->cr3 = parent->cr3;
+  child->pcid = parent->pcid;
+  child->entry_point = parent->entry_point;
+
+  for (int i = 0; i < PROCESS_NAME_LEN - 1 && parent->name[i]; i++) {
+    child->name[i] = parent->name[i];
+  }
+  child->name[PROCESS_NAME_LEN - 1] = '\0';
+
+  child->kernel_stack = kstack_top;
+  child->user_stack = parent->user_stack;
+
+  process_save_context(parent, regs);
+  child->context = parent->context;
+  child->context.rax = 0;
+  parent->context.rax = child->pid;
+
+  child->exit_code = 0;
+  child->owns_address_space = 0;
+  child->vfork_parent = parent;
+  child->mmap_base = parent->mmap_base;
+  posix_copy_fds(child, parent);
+  child->next = NULL;
+
+  parent->state = PROC_STATE_SLEEPING;
+  scheduler_switch_to(child, regs);
+  return 0;
+}
@@ -26,8 +26,11 @@
 
 #include <kernel/drivers/fs/chainFS/chainfs.h>
 #include <kernel/mmu.h>
+#include <kernel/pmm.h>
 #include <kernel/posix/posix.h>
 #include <kernel/process.h>
+#include <kernel/reclaim.h>
+#include <kernel/swap.h>
 #include <kernel/useraddr.h>
 #include <lib/com1.h>
 #include <mlibc/memory.h>
@@ -46,7 +49,25 @@ static u64 align_up(u64 val, u64 align) {
   return (val + align - 1) & ~(align - 1);
 }
 
-static int range_is_free(u64 base, u64 pages) {
+#define PF_WRITE 0x2
+#define PF_FETCH 0x10
+
+typedef struct {
+  u64 old_addr;
+  u64 old_size;
+  u64 new_size;
+  u32 flags;
+} __attribute__((packed)) mremap_args_t;
+
+/* Outside the mmap window a fixed mapping may also land on pages the ELF
+ * loader or the stack put there, which have no area. */
+static int range_is_free(process_t *proc, u64 base, u64 pages) {
+  if (vma_overlaps(&proc->vmas, base, base + pages * PAGE_SIZE)) {
+    return 0;
+  }
+  if (base >= MMAP_BASE && base + pages * PAGE_SIZE <= MMAP_LIMIT) {
+    return 1;
+  }
   for (u64 i = 0; i < pages; i++) {
     u64 vaddr = base + i * PAGE_SIZE;
     u64 flags = mmu_get_pte_flags(vaddr);
@@ -57,37 +78,62 @@ static int range_is_free(u64 base, u64 pages) {
   return 1;
 }
 
+/* Mappings of 2MB or more start on a 2MB boundary so that transparent huge
+ * pages can back them. */
 static u64 find_free_region(process_t *proc, u64 length) {
-  u64 pages = align_up(length, PAGE_SIZE) / PAGE_SIZE;
-  u64 start = proc->mmap_base;
-  if (start < MMAP_BASE) {
-    start = MMAP_BASE;
-  }
-  if (start >= MMAP_LIMIT) {
-    start = MMAP_BASE;
+  u64 align = length >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : PAGE_SIZE;
+  u64 addr = vma_find_gap(&proc->vmas, align_up(proc->mmap_base, PAGE_SIZE),
+                          length, align, MMAP_BASE, MMAP_LIMIT);
+  if (addr) {
+    proc->mmap_base = addr + length;
   }
+  return addr;
+}
 
-  for (u64 addr = align_up(start, PAGE_SIZE); addr + pages * PAGE_SIZE < MMAP_LIMIT;
-       addr += PAGE_SIZE) {
-    if (range_is_free(addr, pages)) {
-      proc->mmap_base = addr + pages * PAGE_SIZE;
-      return addr;
-    }
+u64 mmap_prot_to_pte(u32 prot) {
+  u64 page_flags = PTE_PRESENT | PTE_USER;
+  if (prot & PROT_WRITE) {
+    page_flags |= PTE_RW;
   }
+  if (!(prot & PROT_EXEC)) {
+    page_flags |= PTE_NX;
+  }
+  return page_flags;
+}
 
-  for (u64 addr = MMAP_BASE; addr + pages * PAGE_SIZE < start;
-       addr += PAGE_SIZE) {
-    if (range_is_free(addr, pages)) {
-      proc->mmap_base = addr + pages * PAGE_SIZE;
-      return addr;
+typedef struct {
+  const char *path;
+  u64 offset; /* file offset of the mapping's first page */
+  u32 size;
+} mmap_file_ctx_t;
+
+/* A zeroed frame holding one page of the file, past its end left zero.
+ * 0 when there is no frame or the file cannot be read. */
+static u64 mmap_file_frame(u64 index, void *ctx) {
+  mmap_file_ctx_t *file = (mmap_file_ctx_t *)ctx;
+  u64 page = pmm_alloc_zeroed_frame();
+  if (!page) {
+    return 0;
+  }
+  u64 file_off = file->offset + index * PAGE_SIZE;
+  if (file_off < file->size) {
+    u32 to_copy = (u32)(file->size - file_off);
+    if (to_copy > PAGE_SIZE) {
+      to_copy = PAGE_SIZE;
+    }
+    u32 bytes_read = 0;
+    if (chainfs_read_file_range(file->path, phys_to_virt(page), to_copy,
+                                (u32)file_off, &bytes_read) != 0) {
+      com1_printf("[MMAP] Error: file read failed\n");
+      pmm_free_frame(page);
+      return 0;
     }
   }
-
-  return 0;
+  return page;
 }
 
 u64 sys_mmap(const void *uargs) {
-  process_t *proc = process_current();
+  process_t *proc = process_vm_owner(process_current());
   if (!proc) {
     return (u64)(-EINVAL);
   }
@@ -105,14 +151,20 @@ u64 sys_mmap(const void *uargs) {
     return (u64)(-EINVAL);
   }
 
-  u64 length = align_up(args.length, PAGE_SIZE);
+  int huge = (args.flags & MAP_HUGETLB) != 0;
+  if (huge && !(args.flags & MAP_ANONYMOUS)) {
+    return (u64)(-EINVAL);
+  }
+  u64 page_size = huge ? HUGE_PAGE_SIZE : PAGE_SIZE;
+  u64 length = align_up(args.length, page_size);
   u64 addr = args.addr;
 
   if (args.flags & MAP_FIXED) {
-    if (addr == 0 || (addr & (PAGE_SIZE - 1)) != 0) {
+    if (addr == 0 || (addr & (page_size - 1)) != 0 ||
+        !is_user_address((const void *)addr, length)) {
       return (u64)(-EINVAL);
     }
-    if (!range_is_free(addr, length / PAGE_SIZE)) {
+    if (!range_is_free(proc, addr, length / PAGE_SIZE)) {
       return (u64)(-EEXIST);
     }
   } else {
@@ -154,45 +206,305 @@ u64 sys_mmap(const void *uargs) {
     memcpy(file_path, oft[of_index].path, len);
   }
 
-  u64 page_flags = PTE_PRESENT | PTE_USER;
-  if (args.prot & PROT_WRITE) {
-    page_flags |= PTE_RW;
+  u64 page_flags = mmap_prot_to_pte(args.prot);
+
+  /* Anonymous memory is only recorded here; mmap_handle_fault fills each
+   * page in when it is first touched. */
+  if (!file_backed) {
+    u32 vma_flags = VMA_ANON;
+    if (huge) {
+      vma_flags |= VMA_HUGE;
+    }
+    if (vma_insert(&proc->vmas, addr, addr + length, page_flags, vma_flags) !=
+        0) {
+      return (u64)(-ENOMEM);
+    }
+    return addr;
   }
-  if (!(args.prot & PROT_EXEC)) {
-    page_flags |= PTE_NX;
+
+  /* File pages are read in now, and the area remembers where they came
+   * from so that reclaim can drop the clean ones. */
+  vma_file_t *source = vma_file_create(file_path, file_size);
+  if (!source) {
+    return (u64)(-ENOMEM);
+  }
+  int err = vma_insert_file(&proc->vmas, addr, addr + length, page_flags,
+                            source, args.offset);
+  vma_file_put(source);
+  if (err != 0) {
+    return (u64)(-ENOMEM);
   }
 
-  for (u64 off = 0; off < length; off += PAGE_SIZE) {
-    void *page = kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
-    if (!page) {
-      for (u64 rollback = 0; rollback < off; rollback += PAGE_SIZE) {
-        u64 vaddr = addr + rollback;
-        u64 paddr = mmu_virt_to_phys(vaddr);
-        mmu_unmap_page(vaddr);
-        if (paddr) {
-          kfree((void *)paddr);
-        }
-      }
-      return (u64)(-ENOMEM);
+  mmap_file_ctx_t file;
+  file.path = file_path;
+  file.offset = args.offset;
+  file.size = file_size;
+  if (mmu_map_range_frames(addr, length, page_flags, mmap_file_frame,
+                           &file) != 0) {
+    mmu_unmap_user_range(addr, addr + length);
+    vma_remove(&proc->vmas, addr, addr + length);
+    return (u64)(-ENOMEM);
+  }
+  reclaim_track_range(proc, addr, addr + length);
+
+  return addr;
+}
+
+/* A transparent huge page needs the whole aligned 2MB block inside the area
+ * and a free buddy block, checked first so that falling back to 4K pages
+ * neither logs nor shrinks caches. */
+static int thp_eligible(vma_t *region, u64 vaddr) {
+  u64 block = vaddr & ~(HUGE_PAGE_SIZE - 1);
+  return block >= region->start && block + HUGE_PAGE_SIZE <= region->end &&
+         (pmm_free_blocks(9) || pmm_free_blocks(10));
+}
+
+static int fault_in_huge(process_t *proc, vma_t *region, u64 vaddr) {
+  u64 block = vaddr & ~(HUGE_PAGE_SIZE - 1);
+  if (!mmu_can_map_user_huge(block)) {
+    return -1;
+  }
+  u64 frame = alloc_pages(9);
+  if (!frame) {
+    return -1;
+  }
+  memset(phys_to_virt(frame), 0, HUGE_PAGE_SIZE);
+  if (mmu_map_user_huge(block, frame, region->page_flags) != 0) {
+    free_pages(frame, 9);
+    return -1;
+  }
+  proc->faults.huge++;
+  return 0;
+}
+
+/* A file page dropped by reclaim, read back in from the file. */
+static int fault_in_file(process_t *proc, vma_t *region, u64 vaddr) {
+  u64 page = vaddr & ~((u64)PAGE_SIZE - 1);
+  mmap_file_ctx_t file;
+  file.path = region->file->path;
+  file.offset = region->offset + (page - region->start);
+  file.size = region->file->size;
+  u64 frame = mmap_file_frame(0, &file);
+  if (!frame) {
+    com1_printf("[MMAP] Cannot read back %p of PID %d from '%s'\n",
+                (void *)page, (int)proc->pid, file.path);
+    return -1;
+  }
+  mmu_map_page(page, frame, region->page_flags);
+  proc->faults.file++;
+  reclaim_refault(proc, page);
+  return 0;
+}
+
+/* Not-present fault on a lazily populated, reclaimed or swapped-out mapping
+ * of the current process. Returns 0 once the page is mapped and the access
+ * can be retried. */
+int mmap_handle_fault(u64 vaddr, u64 err) {
+  process_t *proc = process_vm_owner(process_current());
+  if (!proc || !proc->owns_address_space) {
+    return -1;
+  }
+  vma_t *region = vma_find(&proc->vmas, vaddr);
+  if (!region || !(region->flags & (VMA_ANON | VMA_FILE))) {
+    return -1;
+  }
+  if ((err & PF_WRITE) && !(region->page_flags & PTE_RW)) {
+    return -1;
+  }
+  if ((err & PF_FETCH) && (region->page_flags & PTE_NX)) {
+    return -1;
+  }
+  if (region->flags & VMA_FILE) {
+    return fault_in_file(proc, region, vaddr);
+  }
+
+  int swapped = swap_in(vaddr, region->page_flags);
+  if (swapped != 0) {
+    if (swapped < 0) {
+      return -1;
     }
-    memset(page, 0, PAGE_SIZE);
-    mmu_map_page(addr + off, (u64)page, page_flags);
-
-    if (file_backed) {
-      u64 file_off = args.offset + off;
-      if (file_off < file_size) {
-        u32 to_copy = (u32)(file_size - file_off);
-        if (to_copy > PAGE_SIZE) {
-          to_copy = PAGE_SIZE;
-        }
-        u32 bytes_read = 0;
-        if (chainfs_read_file_range(file_path, (u8 *)page, to_copy,
-                                    (u32)file_off, &bytes_read) != 0) {
-          com1_printf("[MMAP] Error: file read failed\n");
-        }
+    proc->faults.swap++;
+    return 0;
+  }
+
+  if ((region->flags & VMA_HUGE) || thp_eligible(region, vaddr)) {
+    if (fault_in_huge(proc, region, vaddr) == 0) {
+      return 0;
+    }
+    if (region->flags & VMA_HUGE) {
+      com1_printf("[MMAP] No 2MB block for MAP_HUGETLB page %p of PID %d\n",
+                  (void *)vaddr, (int)proc->pid);
+      return -1;
+    }
+  }
+
+  u64 page = vaddr & ~((u64)PAGE_SIZE - 1);
+  if (err & PF_WRITE) {
+    u64 frame = pmm_alloc_zeroed_frame();
+    if (!frame) {
+      com1_printf("[MMAP] Out of memory faulting in %p for PID %d\n",
+                  (void *)page, (int)proc->pid);
+      return -1;
+    }
+    mmu_map_page(page, frame, region->page_flags);
+    proc->faults.demand_zero++;
+    return 0;
+  }
+
+  /* Reads share the zero page; a later write takes the copy-on-write path,
+   * which swaps in a private zeroed frame. */
+  u64 flags = region->page_flags & ~PTE_RW;
+  if (region->page_flags & PTE_RW) {
+    flags |= PTE_COW;
+  }
+  mmu_map_page(page, mmu_zero_page(), flags);
+  proc->faults.zero_page++;
+  return 0;
+}
+
+/* MAP_HUGETLB areas can only be cut at 2MB boundaries. */
+static int huge_aligned(process_t *proc, u64 addr, u64 end) {
+  vma_t *first = vma_find(&proc->vmas, addr);
+  vma_t *last = vma_find(&proc->vmas, end - 1);
+  if (first && (first->flags & VMA_HUGE) && (addr & (HUGE_PAGE_SIZE - 1))) {
+    return 0;
+  }
+  if (last && (last->flags & VMA_HUGE) && (end & (HUGE_PAGE_SIZE - 1))) {
+    return 0;
+  }
+  return 1;
+}
+
+static int check_range(process_t *proc, u64 addr, u64 length, u64 *end) {
+  if (!proc || !proc->owns_address_space) {
+    return -EINVAL;
+  }
+  if ((addr & (PAGE_SIZE - 1)) != 0 || length == 0) {
+    return -EINVAL;
+  }
+  *end = addr + align_up(length, PAGE_SIZE);
+  if (!is_user_address((const void *)addr, *end - addr)) {
+    return -EINVAL;
+  }
+  if (!huge_aligned(proc, addr, *end)) {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+int sys_munmap(u64 addr, u64 length) {
+  process_t *proc = process_vm_owner(process_current());
+  u64 end;
+  int err = check_range(proc, addr, length, &end);
+  if (err) {
+    return err;
+  }
+  if (vma_remove(&proc->vmas, addr, end) != 0) {
+    return -ENOMEM;
+  }
+  mmu_unmap_user_range(addr, end);
+  reclaim_forget_range(proc, addr, end);
+  return 0;
+}
+
+int sys_mprotect(u64 addr, u64 length, u32 prot) {
+  process_t *proc = process_vm_owner(process_current());
+  u64 end;
+  int err = check_range(proc, addr, length, &end);
+  if (err) {
+    return err;
+  }
+  if (!vma_covers(&proc->vmas, addr, end)) {
+    return -ENOMEM;
+  }
+  u64 page_flags = mmap_prot_to_pte(prot);
+  if (vma_protect(&proc->vmas, addr, end, page_flags) != 0) {
+    return -ENOMEM;
+  }
+  mmu_protect_user_range(addr, end, page_flags);
+  return 0;
+}
+
+/* Shrinking unmaps the tail. Growing extends the area in place when the
+ * pages after it are free, otherwise (with MREMAP_MAYMOVE) moves the page
+ * table entries to a new gap without copying any data. */
+u64 sys_mremap(const void *uargs) {
+  process_t *proc = process_vm_owner(process_current());
+  if (!is_user_address(uargs, sizeof(mremap_args_t))) {
+    return (u64)(-EFAULT);
+  }
+  mremap_args_t args;
+  memcpy(&args, uargs, sizeof(args));
+
+  u64 old_addr = args.old_addr;
+  u64 old_end;
+  int err = check_range(proc, old_addr, args.old_size, &old_end);
+  if (err) {
+    return (u64)(long)err;
+  }
+  if (args.new_size == 0) {
+    return (u64)(-EINVAL);
+  }
+  u64 old_size = old_end - old_addr;
+
+  vma_t *vma = vma_find(&proc->vmas, old_addr);
+  if (!vma || vma->end < old_end) {
+    return (u64)(-EFAULT);
+  }
+  u64 page_size = (vma->flags & VMA_HUGE) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+  u64 new_size = align_up(args.new_size, page_size);
+  u64 page_flags = vma->page_flags;
+  u32 vma_flags = vma->flags;
+
+  if (new_size <= old_size) {
+    if (new_size < old_size) {
+      if (vma_remove(&proc->vmas, old_addr + new_size, old_end) != 0) {
+        return (u64)(-ENOMEM);
       }
+      mmu_unmap_user_range(old_addr + new_size, old_end);
+      reclaim_forget_range(proc, old_addr + new_size, old_end);
     }
+    return old_addr;
   }
 
-  return addr;
+  /* File areas cover the file range they were mapped from and no more. */
+  if (!(vma_flags & VMA_ANON)) {
+    return (u64)(-EINVAL);
+  }
+
+  u64 grow = new_size - old_size;
+  if (is_user_address((const void *)old_end, grow) &&
+      range_is_free(proc, old_end, grow / PAGE_SIZE)) {
+    if (vma_insert(&proc->vmas, old_end, old_end + grow, page_flags,
+                   vma_flags) != 0) {
+      return (u64)(-ENOMEM);
+    }
+    return old_addr;
+  }
+
+  if (!(args.flags & MREMAP_MAYMOVE)) {
+    return (u64)(-ENOMEM);
+  }
+  u64 new_addr = find_free_region(proc, new_size);
+  if (!new_addr) {
+    return (u64)(-ENOMEM);
+  }
+  if (vma_insert(&proc->vmas, new_addr, new_addr + new_size, page_flags,
+                 vma_flags) != 0) {
+    return (u64)(-ENOMEM);
+  }
+  /* Pages move while both areas exist, and the old area goes only once
+   * they have. Moving back never allocates: the old tables are still
+   * there. */
+  if (mmu_move_user_range(old_addr, new_addr, old_size) != 0) {
+    mmu_move_user_range(new_addr, old_addr, old_size);
+    vma_remove(&proc->vmas, new_addr, new_addr + new_size);
+    return (u64)(-ENOMEM);
+  }
+  if (vma_remove(&proc->vmas, old_addr, old_end) != 0) {
+    mmu_move_user_range(new_addr, old_addr, old_size);
+    vma_remove(&proc->vmas, new_addr, new_addr + new_size);
+    return (u64)(-ENOMEM);
+  }
+  return new_addr;
 }
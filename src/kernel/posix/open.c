@@ -52,7 +52,7 @@ static char *copy_user_path(const char *path) {
   if (len == 255) {
     return NULL;
   }
-  char *buf = (char *)kcalloc(len + 1, 1);
+  char *buf = (char *)kcalloc_tagged(len + 1, 1, KMEM_TAG_FS);
   if (!buf) {
     return NULL;
   }
@@ -27,8 +27,40 @@
 #include <kernel/posix/posix.h>
 #include <kernel/process.h>
 #include <kernel/useraddr.h>
+#include <mlibc/kmem_cache.h>
 #include <mlibc/memory.h>
 
+static kmem_cache_t *pipe_cache = NULL;
+
+/* Only the bookkeeping needs resetting; the ring buffer content is dead. */
+static void pipe_reset(pipe_t *p) {
+  p->read_pos = 0;
+  p->write_pos = 0;
+  p->size = 0;
+  p->readers = 0;
+  p->writers = 0;
+}
+
+static void pipe_ctor(void *obj) { pipe_reset((pipe_t *)obj); }
+
+pipe_t *pipe_alloc(void) {
+  if (!pipe_cache) {
+    pipe_cache = kmem_cache_create("pipe", sizeof(pipe_t), 16, pipe_ctor);
+    if (!pipe_cache) {
+      return NULL;
+    }
+  }
+  return (pipe_t *)kmem_cache_alloc(pipe_cache);
+}
+
+void pipe_free(pipe_t *p) {
+  if (!p) {
+    return;
+  }
+  pipe_reset(p);
+  kmem_cache_free(pipe_cache, p);
+}
+
 static int posix_find_free_fd(void) {
   file_descriptor_t *fd_table = posix_get_fd_table();
   for (int i = 3; i < MAX_FDS; i++) {
@@ -121,13 +153,12 @@ int sys_pipe(int fds[2]) {
     return -ENFILE;
   }
 
-  pipe_t *p = (pipe_t *)kmalloc(sizeof(pipe_t));
+  pipe_t *p = pipe_alloc();
   if (!p) {
     posix_release_open_file(of_read);
     posix_release_open_file(of_write);
     return -ENOMEM;
   }
-  memset(p, 0, sizeof(pipe_t));
   p->readers = 1;
   p->writers = 1;
 
@@ -70,6 +70,9 @@ typedef struct {
 #define MAP_PRIVATE 0x02
 #define MAP_FIXED 0x10
 #define MAP_ANONYMOUS 0x20
+#define MAP_HUGETLB 0x40000
+
+#define MREMAP_MAYMOVE 0x1
 
 #define CLONE_VM 0x00000100
 #define CLONE_THREAD 0x00010000
@@ -116,12 +119,22 @@ int sys_wait(int *status);
 int sys_pipe(int fds[2]);
 long sys_clone(u64 flags, u64 child_stack, u64 ptid, registers_t *regs);
 u64 sys_mmap(const void *uargs);
+int sys_munmap(u64 addr, u64 length);
+int sys_mprotect(u64 addr, u64 length, u32 prot);
+u64 sys_mremap(const void *uargs);
+u64 mmap_prot_to_pte(u32 prot);
+int mmap_handle_fault(u64 vaddr, u64 err);
 int sys_fork(registers_t *regs);
+int sys_vfork(registers_t *regs);
 
+pipe_t *pipe_alloc(void);
+void pipe_free(pipe_t *p);
 int pipe_read(pipe_t *p, void *buf, u32 count);
 int pipe_write(pipe_t *p, const void *buf, u32 count);
 int sys_execve(const char *path, const char *const *argv,
                const char *const *envp, registers_t *regs);
+int sys_spawn(const char *path, const char *const *argv,
+              const char *const *envp);
 void posix_init(void);
 void posix_init_process(struct process *proc);
 void posix_copy_fds(struct process *dst, const struct process *src);
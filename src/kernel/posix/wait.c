@@ -49,16 +49,13 @@ int sys_wait(int *status) {
     }
 
     if (child->owns_address_space && child->cr3) {
-      mmu_free_user_space(child->cr3);
-      kfree((void *)(child->cr3 & PTE_ADDR_MASK));
+      mmu_destroy_address_space(child->cr3);
       child->cr3 = 0;
       child->owns_address_space = 0;
     }
+    vma_release(&child->vmas);
 
-    if (child->kernel_stack) {
-      u64 kstack_base = child->kernel_stack - KERNEL_STACK_SIZE;
-      kfree((void *)kstack_base);
-    }
+    process_free_kernel_stack(child->kernel_stack);
 
     int pid = (int)child->pid;
     memset(child, 0, sizeof(process_t));
@@ -84,7 +84,7 @@ void posix_release_open_file(int index) {
         }
       }
       if (p->readers == 0 && p->writers == 0) {
-        kfree(p);
+        pipe_free(p);
       }
     }
     memset(&open_file_table[index], 0, sizeof(open_file_table[index]));
@@ -221,7 +221,7 @@ int sys_write(int fd, const void *buf, u32 count) {
   u32 end_pos = offset + count;
   u32 new_size = (end_pos > entry.size) ? end_pos : entry.size;
 
-  u8 *new_data = (u8 *)kcalloc(new_size, 1);
+  u8 *new_data = (u8 *)kcalloc_tagged(new_size, 1, KMEM_TAG_FS);
   if (!new_data) {
     return -ENOMEM;
   }
@@ -27,9 +27,12 @@
 #include <kernel/gdt.h>
 #include <kernel/mmu.h>
 #include <kernel/panic.h>
+#include <kernel/pmm.h>
 #include <kernel/process.h>
+#include <kernel/reclaim.h>
 #include <kernel/signal.h>
 #include <lib/com1.h>
+#include <mlibc/kmem_cache.h>
 #include <mlibc/memory.h>
 
 process_t process_table[MAX_PROCESSES];
@@ -57,6 +60,32 @@ process_t *alloc_process(void) {
   return NULL;
 }
 
+static kmem_cache_t *kernel_stack_cache = NULL;
+
+u64 process_alloc_kernel_stack(void) {
+  if (!kernel_stack_cache) {
+    kernel_stack_cache =
+        kmem_cache_create("kernel_stack", KERNEL_STACK_SIZE, 4096, NULL);
+    if (!kernel_stack_cache) {
+      return 0;
+    }
+  }
+  /* Not zeroed: the stack is only ever read back after being pushed to, so
+   * a reused object goes out as it was freed. */
+  u8 *base = (u8 *)kmem_cache_alloc(kernel_stack_cache);
+  if (!base) {
+    return 0;
+  }
+  return (u64)(base + KERNEL_STACK_SIZE);
+}
+
+void process_free_kernel_stack(u64 stack_top) {
+  if (!stack_top) {
+    return;
+  }
+  kmem_cache_free(kernel_stack_cache, (void *)(stack_top - KERNEL_STACK_SIZE));
+}
+
 process_t *process_create_kernel(const char *name, void (*entry)(void)) {
   process_t *proc = alloc_process();
   if (!proc) {
@@ -64,12 +93,11 @@ process_t *process_create_kernel(const char *name, void (*entry)(void)) {
     return NULL;
   }
 
-  u8 *kstack = (u8 *)kmalloc_aligned(KERNEL_STACK_SIZE, 16);
-  if (!kstack) {
+  u64 kstack_top = process_alloc_kernel_stack();
+  if (!kstack_top) {
     com1_printf("[PROC] Error: Failed to allocate kernel stack\n");
     return NULL;
   }
-  memset(kstack, 0, KERNEL_STACK_SIZE);
 
   proc->pid = next_pid++;
   proc->ppid = 0;
@@ -81,10 +109,10 @@ process_t *process_create_kernel(const char *name, void (*entry)(void)) {
   }
   proc->name[i] = '\0';
 
-  proc->cr3 = mmu_read_cr3();
+  proc->cr3 = mmu_read_cr3() & PTE_ADDR_MASK;
   proc->entry_point = (u64)entry;
 
-  proc->kernel_stack = (u64)(kstack + KERNEL_STACK_SIZE);
+  proc->kernel_stack = kstack_top;
   proc->user_stack = 0;
 
   memset(&proc->context, 0, sizeof(cpu_context_t));
@@ -97,6 +125,8 @@ process_t *process_create_kernel(const char *name, void (*entry)(void)) {
   proc->exit_code = 0;
   proc->owns_address_space = 0;
   proc->mmap_base = MMAP_BASE;
+  memset(&proc->vmas, 0, sizeof(proc->vmas));
+  memset(&proc->faults, 0, sizeof(proc->faults));
   posix_init_process(proc);
   proc->next = NULL;
 
@@ -135,11 +165,22 @@ void process_switch(process_t *proc) {
     return;
   }
   process_set_current(proc);
-  mmu_write_cr3(proc->cr3);
+  mmu_switch_address_space(proc->cr3, &proc->pcid);
 }
 
 void process_yield(void) { __asm__ volatile("int $32"); }
 
+void process_vfork_release(process_t *proc) {
+  process_t *parent = proc ? proc->vfork_parent : NULL;
+  if (!parent) {
+    return;
+  }
+  proc->vfork_parent = NULL;
+  if (parent->state == PROC_STATE_SLEEPING) {
+    parent->state = PROC_STATE_RUNNABLE;
+  }
+}
+
 void process_exit(int code) {
   if (!current_process) {
     com1_printf("[PROC] Error: No current process to exit\n");
@@ -155,19 +196,22 @@ void process_exit(int code) {
 
   current_process->exit_code = code;
   current_process->state = PROC_STATE_ZOMBIE;
+  process_vfork_release(current_process);
   posix_release_fds(current_process);
   if (current_process->owns_address_space) {
     u64 old_cr3 = current_process->cr3;
     mmu_write_cr3(mmu_kernel_cr3());
-    mmu_free_user_space(old_cr3);
-    kfree((void *)(old_cr3 & PTE_ADDR_MASK));
+    mmu_destroy_address_space(old_cr3);
     current_process->cr3 = 0;
     current_process->owns_address_space = 0;
   }
+  reclaim_forget(current_process);
+  vma_release(&current_process->vmas);
   current_process->mmap_base = MMAP_BASE;
 
   __asm__ volatile("sti");
   while (1) {
+    pmm_zero_pool_refill();
     __asm__ volatile("hlt");
   }
 }
@@ -242,18 +286,31 @@ int process_kill(u32 pid) {
     return 0;
   }
 
+  /* A vfork child still runs on proc's address space; it goes first, unless
+   * it is the caller. */
+  for (int i = 0; i < MAX_PROCESSES; i++) {
+    process_t *borrower = &process_table[i];
+    if (borrower->state == PROC_STATE_UNUSED ||
+        borrower->vfork_parent != proc) {
+      continue;
+    }
+    if (borrower == current_process) {
+      return -1;
+    }
+    process_kill(borrower->pid);
+  }
+
+  process_vfork_release(proc);
   posix_release_fds(proc);
   if (proc->owns_address_space) {
-    mmu_free_user_space(proc->cr3);
-    kfree((void *)(proc->cr3 & PTE_ADDR_MASK));
+    mmu_destroy_address_space(proc->cr3);
     proc->cr3 = 0;
     proc->owns_address_space = 0;
   }
+  reclaim_forget(proc);
+  vma_release(&proc->vmas);
 
-  if (proc->kernel_stack) {
-    void *kstack_base = (void *)(proc->kernel_stack - KERNEL_STACK_SIZE);
-    kfree(kstack_base);
-  }
+  process_free_kernel_stack(proc->kernel_stack);
 
   memset(proc, 0, sizeof(process_t));
   proc->state = PROC_STATE_UNUSED;
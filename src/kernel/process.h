@@ -28,6 +28,7 @@
 #define PROCESS_H
 
 #include <kernel/posix/posix.h>
+#include <kernel/vma.h>
 #include <mlibc/mlibc.h>
 
 #define MAX_PROCESSES 64
@@ -56,6 +57,16 @@ typedef struct {
   u64 ss;
 } __attribute__((packed)) cpu_context_t;
 
+/* Page faults resolved without killing the process. */
+typedef struct {
+  u64 zero_page;   /* reads of untouched mmap pages, given the zero page */
+  u64 demand_zero; /* first writes to mmap pages, given a zeroed frame */
+  u64 cow;         /* writes to a frame shared with another address space */
+  u64 huge;        /* first touches of an mmap block given a 2MB page */
+  u64 file;        /* file pages read back in after reclaim */
+  u64 swap;        /* anonymous pages read back in from swap */
+} proc_fault_stats_t;
+
 /* Process Control Block (PCB) */
 typedef struct process {
   u32 pid;                     /* Process ID */
@@ -65,6 +76,7 @@ typedef struct process {
 
   /* Memory */
   u64 cr3;         /* Page table root */
+  u16 pcid;        /* TLB tag from the last switch, see mmu_switch_address_space */
   u64 entry_point; /* Entry point address */
 
   /* Stack */
@@ -79,9 +91,12 @@ typedef struct process {
 
   /* Address space ownership */
   int owns_address_space;
+  struct process *vfork_parent; /* space borrowed until exec or exit */
 
   /* mmap base */
   u64 mmap_base;
+  vma_set_t vmas; /* mmap areas */
+  proc_fault_stats_t faults;
 
   /* File descriptors */
   file_descriptor_t fd_table[MAX_FDS];
@@ -113,6 +128,16 @@ void process_exit(int code);
 int process_kill(u32 pid);
 int process_send_signal(u32 pid, int sig);
 
+/* A vfork child is done with its parent's address space (exec or exit);
+ * wake the parent. No-op for other processes. */
+void process_vfork_release(process_t *proc);
+
+/* The process whose address space and mappings proc runs on: the vfork
+ * parent while proc borrows it, otherwise proc itself. */
+static inline process_t *process_vm_owner(process_t *proc) {
+  return proc && proc->vfork_parent ? proc->vfork_parent : proc;
+}
+
 /* Switch to a process (used by scheduler) */
 void process_switch(process_t *proc);
 
@@ -125,6 +150,10 @@ void process_dump(process_t *proc);
 /* Save CPU context from interrupt/syscall frame */
 void process_save_context(process_t *proc, registers_t *regs);
 
+/* Allocate a kernel stack (not zeroed), returns its top (0 on failure) */
+u64 process_alloc_kernel_stack(void);
+void process_free_kernel_stack(u64 stack_top);
+
 /* Internal: find free process slot */
 process_t *alloc_process(void);
 int process_is_initialized(void);
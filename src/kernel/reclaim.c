@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <kernel/mmu.h>
+#include <kernel/pmm.h>
+#include <kernel/reclaim.h>
+#include <kernel/shrinker.h>
+#include <mlibc/kmem_cache.h>
+
+/* On the global LRU and on the list of its process table slot, so that
+ * munmap and exit only walk the pages of that process. */
+typedef struct reclaim_page {
+  u32 pid;
+  u32 slot;
+  u64 vaddr;
+  struct reclaim_page *prev;
+  struct reclaim_page *next;
+  struct reclaim_page *slot_prev;
+  struct reclaim_page *slot_next;
+} reclaim_page_t;
+
+static kmem_cache_t *page_cache = NULL;
+static reclaim_page_t *lru_head = NULL; /* least recently used */
+static reclaim_page_t *lru_tail = NULL;
+static reclaim_page_t *slot_pages[MAX_PROCESSES];
+static reclaim_stats_t stats;
+
+static void lru_append(reclaim_page_t *page) {
+  page->next = NULL;
+  page->prev = lru_tail;
+  if (lru_tail) {
+    lru_tail->next = page;
+  } else {
+    lru_head = page;
+  }
+  lru_tail = page;
+  stats.tracked++;
+}
+
+static void lru_unlink(reclaim_page_t *page) {
+  if (page->prev) {
+    page->prev->next = page->next;
+  } else {
+    lru_head = page->next;
+  }
+  if (page->next) {
+    page->next->prev = page->prev;
+  } else {
+    lru_tail = page->prev;
+  }
+  stats.tracked--;
+}
+
+static void slot_link(reclaim_page_t *page) {
+  page->slot_prev = NULL;
+  page->slot_next = slot_pages[page->slot];
+  if (page->slot_next) {
+    page->slot_next->slot_prev = page;
+  }
+  slot_pages[page->slot] = page;
+}
+
+/* Off both lists and back to the cache. */
+static void reclaim_release(reclaim_page_t *page) {
+  if (page->slot_prev) {
+    page->slot_prev->slot_next = page->slot_next;
+  } else {
+    slot_pages[page->slot] = page->slot_next;
+  }
+  if (page->slot_next) {
+    page->slot_next->slot_prev = page->slot_prev;
+  }
+  kmem_cache_free(page_cache, page);
+}
+
+enum { RECLAIM_DROP, RECLAIM_KEEP, RECLAIM_FREED };
+
+/* One entry off the head: is it still a clean file page, and idle? */
+static int reclaim_one(reclaim_page_t *page) {
+  process_t *proc = process_get(page->pid);
+  if (!proc || proc->state == PROC_STATE_ZOMBIE ||
+      !proc->owns_address_space || !proc->cr3) {
+    return RECLAIM_DROP;
+  }
+  vma_t *area = vma_find(&proc->vmas, page->vaddr);
+  if (!area || !(area->flags & VMA_FILE)) {
+    return RECLAIM_DROP;
+  }
+  u64 pte = mmu_get_user_pte(proc->cr3, page->vaddr);
+  if (!(pte & PTE_PRESENT)) {
+    return RECLAIM_DROP;
+  }
+  /* Written at some point, even if the area has been made read-only
+   * since: the file no longer has it. */
+  if (pte & PTE_DIRTY) {
+    return RECLAIM_DROP;
+  }
+  if (pte & PTE_ACCESSED) {
+    mmu_clear_accessed(proc->cr3, page->vaddr);
+    stats.referenced++;
+    return RECLAIM_KEEP;
+  }
+  /* Still mapped by a fork child or parent: unmapping here frees nothing. */
+  if (pmm_page_refcount(pte & PTE_ADDR_MASK) > 1) {
+    return RECLAIM_KEEP;
+  }
+
+  u64 old = mmu_evict_user_page(proc->cr3, page->vaddr);
+  pmm_page_put(old & PTE_ADDR_MASK);
+  stats.reclaimed++;
+  return RECLAIM_FREED;
+}
+
+static unsigned long reclaim_count(shrinker_t *shrinker) {
+  (void)shrinker;
+  return (unsigned long)stats.tracked;
+}
+
+/* Each entry is looked at most once per call, so a list of pages that are
+ * all in use ends the scan instead of cycling. */
+static unsigned long reclaim_scan(shrinker_t *shrinker, unsigned long nr) {
+  (void)shrinker;
+  unsigned long freed = 0;
+  u64 budget = stats.tracked;
+  while (freed < nr && budget-- > 0 && lru_head) {
+    reclaim_page_t *page = lru_head;
+    lru_unlink(page);
+    stats.scanned++;
+    int result = reclaim_one(page);
+    if (result == RECLAIM_KEEP) {
+      lru_append(page);
+      continue;
+    }
+    reclaim_release(page);
+    if (result == RECLAIM_FREED) {
+      freed++;
+    }
+  }
+  return freed;
+}
+
+static shrinker_t reclaim_shrinker = {
+    .name = "file_pages",
+    .count = reclaim_count,
+    .scan = reclaim_scan,
+};
+
+static void reclaim_track(process_t *proc, u64 vaddr) {
+  if (!page_cache) {
+    page_cache = kmem_cache_create("reclaim_page", sizeof(reclaim_page_t),
+                                   8, NULL);
+    if (!page_cache) {
+      return;
+    }
+    register_shrinker(&reclaim_shrinker);
+  }
+  reclaim_page_t *page = (reclaim_page_t *)kmem_cache_alloc(page_cache);
+  if (!page) {
+    return;
+  }
+  page->pid = proc->pid;
+  page->slot = (u32)(proc - process_table);
+  page->vaddr = vaddr;
+  lru_append(page);
+  slot_link(page);
+}
+
+void reclaim_track_range(process_t *proc, u64 start, u64 end) {
+  if (!proc || !proc->cr3) {
+    return;
+  }
+  for (u64 vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+    if (mmu_get_user_pte(proc->cr3, vaddr) & PTE_PRESENT) {
+      reclaim_track(proc, vaddr);
+    }
+  }
+}
+
+void reclaim_track_areas(process_t *proc) {
+  for (u32 i = 0; proc && i < proc->vmas.count; i++) {
+    vma_t *area = &proc->vmas.vmas[i];
+    if (area->flags & VMA_FILE) {
+      reclaim_track_range(proc, area->start, area->end);
+    }
+  }
+}
+
+void reclaim_refault(process_t *proc, u64 vaddr) {
+  stats.refaults++;
+  reclaim_track(proc, vaddr);
+}
+
+void reclaim_forget_range(process_t *proc, u64 start, u64 end) {
+  if (!proc) {
+    return;
+  }
+  reclaim_page_t *page = slot_pages[proc - process_table];
+  while (page) {
+    reclaim_page_t *next = page->slot_next;
+    if (page->pid == proc->pid && page->vaddr >= start &&
+        page->vaddr < end) {
+      lru_unlink(page);
+      reclaim_release(page);
+    }
+    page = next;
+  }
+}
+
+void reclaim_forget(process_t *proc) { reclaim_forget_range(proc, 0, ~0ULL); }
+
+void reclaim_get_stats(reclaim_stats_t *out) { *out = stats; }
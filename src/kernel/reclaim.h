@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+#include <kernel/process.h>
+
+/*
+ * LRU of user pages that are copies of a ChainFS file (VMA_FILE areas).
+ * Under memory pressure the shrinker walks it oldest first: pages used since
+ * the last pass get another round, clean ones are unmapped and freed, and
+ * mmap_handle_fault reads them back in when they are touched again. Entries
+ * name a process and an address and are checked against its VMAs and page
+ * tables when scanned, so stale ones cost nothing but their slot.
+ */
+typedef struct {
+  u64 tracked;    /* pages on the LRU */
+  u64 scanned;    /* entries looked at by the shrinker */
+  u64 referenced; /* accessed since the last pass, kept */
+  u64 reclaimed;  /* clean pages unmapped and freed */
+  u64 refaults;   /* reclaimed pages read back in */
+} reclaim_stats_t;
+
+/* Add the present pages of [start, end) of proc's address space. */
+void reclaim_track_range(process_t *proc, u64 start, u64 end);
+/* Every present page of proc's VMA_FILE areas (after fork). */
+void reclaim_track_areas(process_t *proc);
+/* The page at vaddr was just read back in. */
+void reclaim_refault(process_t *proc, u64 vaddr);
+/* Drop the entries for [start, end) of proc, or all of them. */
+void reclaim_forget_range(process_t *proc, u64 start, u64 end);
+void reclaim_forget(process_t *proc);
+
+void reclaim_get_stats(reclaim_stats_t *out);
+
+#endif
@@ -112,8 +112,17 @@ void scheduler_tick(registers_t *regs) {
 
   process_set_current(next);
   if (next->cr3 != current->cr3) {
-    mmu_write_cr3(next->cr3);
+    mmu_switch_address_space(next->cr3, &next->pcid);
   }
 
   load_context(next, regs);
 }
+
+void scheduler_switch_to(process_t *next, registers_t *regs) {
+  process_t *current = process_current();
+  process_set_current(next);
+  if (!current || next->cr3 != current->cr3) {
+    mmu_switch_address_space(next->cr3, &next->pcid);
+  }
+  load_context(next, regs);
+}
@@ -29,6 +29,11 @@
 
 #include <kernel/interrupts/idt.h>
 
+#include <kernel/process.h>
+
 void scheduler_tick(registers_t *regs);
+/* Leave the current process (its context already saved by the caller) and
+ * return from this interrupt or syscall into next. */
+void scheduler_switch_to(process_t *next, registers_t *regs);
 
 #endif
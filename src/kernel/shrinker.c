@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <kernel/shrinker.h>
+#include <lib/com1.h>
+
+static shrinker_t *shrinkers = NULL;
+static int shrinking = 0;
+static int disabled = 0; /* shrink_disable nesting */
+
+void register_shrinker(shrinker_t *shrinker) {
+  for (shrinker_t *s = shrinkers; s; s = s->next) {
+    if (s == shrinker) {
+      return;
+    }
+  }
+  shrinker->calls = 0;
+  shrinker->freed = 0;
+  shrinker->next = NULL;
+  /* Asked in registration order: boot-time caches first, then what is
+   * registered once in use, swap (the costliest) normally last. */
+  shrinker_t **link = &shrinkers;
+  while (*link) {
+    link = &(*link)->next;
+  }
+  *link = shrinker;
+  com1_printf("[SHRINK] Registered %s\n", shrinker->name);
+}
+
+void unregister_shrinker(shrinker_t *shrinker) {
+  shrinker_t **link = &shrinkers;
+  while (*link) {
+    if (*link == shrinker) {
+      *link = shrinker->next;
+      shrinker->next = NULL;
+      return;
+    }
+    link = &(*link)->next;
+  }
+}
+
+unsigned long shrink_caches(unsigned long nr_pages, const char *reason) {
+  /* Freeing can land back in an allocator that is already out of memory;
+   * never recurse into the shrinkers from there. */
+  if (shrinking || disabled || nr_pages == 0) {
+    return 0;
+  }
+  shrinking = 1;
+
+  com1_printf("[SHRINK] %s: reclaiming %u pages\n", reason, (u32)nr_pages);
+  unsigned long total = 0;
+  for (shrinker_t *s = shrinkers; s && total < nr_pages; s = s->next) {
+    unsigned long available = s->count(s);
+    if (available == 0) {
+      continue;
+    }
+    unsigned long want = nr_pages - total;
+    unsigned long freed = s->scan(s, available < want ? available : want);
+    s->calls++;
+    s->freed += freed;
+    total += freed;
+    com1_printf("[SHRINK]   %s: %u reclaimable, freed %u\n", s->name,
+                (u32)available, (u32)freed);
+  }
+  com1_printf("[SHRINK] %s: freed %u of %u pages\n", reason, (u32)total,
+              (u32)nr_pages);
+
+  shrinking = 0;
+  return total;
+}
+
+void shrink_disable(void) { disabled++; }
+
+void shrink_enable(void) {
+  if (disabled) {
+    disabled--;
+  }
+}
+
+shrinker_t *shrinker_list(void) { return shrinkers; }
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SHRINKER_H
+#define SHRINKER_H
+
+#include <mlibc/mlibc.h>
+
+/*
+ * A cache that holds memory it can give back under pressure. Both callbacks
+ * work in 4KB pages: count reports what scan could free right now, scan frees
+ * up to nr and returns how many it freed. Callbacks run on an allocation
+ * failure path, so they must not allocate.
+ */
+typedef struct shrinker {
+  const char *name;
+  unsigned long (*count)(struct shrinker *shrinker);
+  unsigned long (*scan)(struct shrinker *shrinker, unsigned long nr);
+  unsigned long calls; /* times scan was invoked */
+  unsigned long freed; /* pages freed over all calls */
+  struct shrinker *next;
+} shrinker_t;
+
+void register_shrinker(shrinker_t *shrinker);
+void unregister_shrinker(shrinker_t *shrinker);
+
+/* Ask the registered shrinkers for nr_pages pages; returns pages freed.
+ * reason names the failing allocator in the trace. */
+unsigned long shrink_caches(unsigned long nr_pages, const char *reason);
+
+/* Allocations between these fail instead of reclaiming, for callers that
+ * cannot let shrinkers run (interrupt handlers). They nest. */
+void shrink_disable(void);
+void shrink_enable(void);
+
+shrinker_t *shrinker_list(void);
+
+#endif
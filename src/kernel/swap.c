@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <kernel/interrupts/idt.h>
+#include <kernel/mmu.h>
+#include <kernel/pmm.h>
+#include <kernel/posix/errno.h>
+#include <kernel/process.h>
+#include <kernel/shrinker.h>
+#include <kernel/swap.h>
+#include <lib/com1.h>
+#include <mlibc/memory.h>
+
+/* The hand stops after going round the process table this many times, so
+ * pages it found referenced on the first lap get looked at once more. */
+#define SWAP_CLOCK_LAPS 2
+
+typedef struct {
+  u64 cr3;
+  u64 vaddr;
+  u64 *pte;
+} swap_page_t;
+
+typedef struct {
+  swap_page_t pages[SWAP_BATCH];
+  u32 count;
+  u32 max;
+  u64 cr3; /* address space being scanned */
+} swap_batch_t;
+
+static disk_t *swap_disk = NULL;
+static u32 sectors_per_page = 0;
+static u8 *slot_refs = NULL; /* entries naming each slot, 0 when free */
+static u32 slot_cursor = 0;  /* next-fit start for batches */
+static swap_stats_t stats;
+
+/* Clock hand: process table slot and the address to resume from. */
+static u32 hand_slot = 0;
+static u64 hand_vaddr = 0;
+
+static u8 swap_bounce[SWAP_BATCH * PAGE_SIZE]
+    __attribute__((aligned(PAGE_SIZE)));
+static int swap_busy = 0; /* a swap-out owns swap_bounce */
+
+static u32 swap_slot_lba(u32 slot) {
+  return stats.start_lba + slot * sectors_per_page;
+}
+
+/* Up to *count free slots in a row, taken with one reference each. Returns
+ * the first; *count is how many were found, 0 when the area is full. */
+static u32 swap_alloc_run(u32 *count) {
+  u32 want = *count;
+  *count = 0;
+  for (u32 i = 0; i < stats.slots; i++) {
+    u32 first = (slot_cursor + i) % stats.slots;
+    if (slot_refs[first]) {
+      continue;
+    }
+    u32 n = 0;
+    while (n < want && first + n < stats.slots && !slot_refs[first + n]) {
+      slot_refs[first + n] = 1;
+      n++;
+    }
+    stats.used += n;
+    slot_cursor = (first + n) % stats.slots;
+    *count = n;
+    return first;
+  }
+  return 0;
+}
+
+static void swap_slot_put(u32 slot) {
+  if (slot >= stats.slots || !slot_refs[slot]) {
+    return;
+  }
+  if (--slot_refs[slot] == 0) {
+    stats.used--;
+  }
+}
+
+void swap_entry_dup(u64 entry) {
+  u32 slot = mmu_swap_slot(entry);
+  if (!mmu_is_swap_entry(entry) || slot >= stats.slots) {
+    return;
+  }
+  /* fork copies an entry at most once per process, so a slot never gets
+   * near the limit; saturate rather than wrap just in case. */
+  if (slot_refs[slot] < 0xFF) {
+    slot_refs[slot]++;
+  }
+}
+
+void swap_entry_free(u64 entry) {
+  if (mmu_is_swap_entry(entry)) {
+    swap_slot_put(mmu_swap_slot(entry));
+  }
+}
+
+/* Clock step over one present user page of an anonymous area. */
+static int swap_clock_page(u64 vaddr, u64 *pte, void *ctx) {
+  swap_batch_t *batch = (swap_batch_t *)ctx;
+  u64 frame = *pte & PTE_ADDR_MASK;
+  stats.scanned++;
+  if (frame == mmu_zero_page() || pmm_page_refcount(frame) != 1) {
+    return 0;
+  }
+  if (*pte & PTE_ACCESSED) {
+    /* No flush: a cached translation only keeps it looking idle longer. */
+    *pte &= ~(u64)PTE_ACCESSED;
+    stats.referenced++;
+    return 0;
+  }
+  swap_page_t *page = &batch->pages[batch->count++];
+  page->cr3 = batch->cr3;
+  page->vaddr = vaddr;
+  page->pte = pte;
+  return batch->count == batch->max;
+}
+
+/* First anonymous area of proc ending after vaddr, NULL when proc has none
+ * left or its pages are not its own to swap. */
+static vma_t *swap_clock_area(process_t *proc, u64 vaddr) {
+  if (proc->state == PROC_STATE_UNUSED || proc->state == PROC_STATE_EMBRYO ||
+      proc->state == PROC_STATE_ZOMBIE || !proc->owns_address_space ||
+      !proc->cr3) {
+    return NULL;
+  }
+  for (u32 i = 0; i < proc->vmas.count; i++) {
+    vma_t *area = &proc->vmas.vmas[i];
+    if (area->end > vaddr && (area->flags & VMA_ANON) &&
+        !(area->flags & VMA_HUGE)) {
+      return area;
+    }
+  }
+  return NULL;
+}
+
+/* Advance the hand until the batch is full or it has done its laps. */
+static void swap_clock_collect(swap_batch_t *batch, u32 *laps) {
+  while (batch->count < batch->max && *laps < SWAP_CLOCK_LAPS) {
+    process_t *proc = &process_table[hand_slot];
+    vma_t *area = swap_clock_area(proc, hand_vaddr);
+    if (!area) {
+      hand_vaddr = 0;
+      if (++hand_slot == MAX_PROCESSES) {
+        hand_slot = 0;
+        (*laps)++;
+      }
+      continue;
+    }
+    u64 start = hand_vaddr > area->start ? hand_vaddr : area->start;
+    batch->cr3 = proc->cr3;
+    hand_vaddr =
+        mmu_scan_user_ptes(proc->cr3, start, area->end, swap_clock_page, batch);
+  }
+}
+
+/* Copy the batch into consecutive slots with one write, then swap its
+ * entries for swap entries and free the frames. Returns frames freed. */
+static u32 swap_write_batch(swap_batch_t *batch) {
+  u32 count = batch->count;
+  u32 slot = swap_alloc_run(&count);
+  if (count == 0) {
+    return 0;
+  }
+
+  for (u32 i = 0; i < count; i++) {
+    memcpy(swap_bounce + i * PAGE_SIZE,
+           phys_to_virt(*batch->pages[i].pte & PTE_ADDR_MASK), PAGE_SIZE);
+  }
+  stats.writes++;
+  if (disk_write_sectors(swap_disk, swap_slot_lba(slot),
+                         count * sectors_per_page, swap_bounce) != 0) {
+    com1_printf("[SWAP] Error: write of %u pages at slot %u failed\n", count,
+                slot);
+    for (u32 i = 0; i < count; i++) {
+      swap_slot_put(slot + i);
+    }
+    stats.errors++;
+    return 0;
+  }
+
+  for (u32 i = 0; i < count; i++) {
+    swap_page_t *page = &batch->pages[i];
+    u64 frame = *page->pte & PTE_ADDR_MASK;
+    *page->pte = mmu_swap_entry(slot + i);
+    mmu_flush_user_page(page->cr3, page->vaddr);
+    pmm_page_put(frame);
+  }
+  stats.swapped_out += count;
+  return count;
+}
+
+unsigned long swap_out(unsigned long nr) {
+  /* Writes wait on the disk, and an interrupt may have landed in the middle
+   * of a page table update: process context only, one swap-out at a time. */
+  if (!swap_disk || swap_busy || in_irq()) {
+    return 0;
+  }
+  swap_busy = 1;
+  unsigned long freed = 0;
+  u32 laps = 0;
+  while (freed < nr && laps < SWAP_CLOCK_LAPS) {
+    swap_batch_t batch;
+    batch.count = 0;
+    batch.max = nr - freed < SWAP_BATCH ? (u32)(nr - freed) : SWAP_BATCH;
+    swap_clock_collect(&batch, &laps);
+    if (batch.count == 0) {
+      break;
+    }
+    u32 written = swap_write_batch(&batch);
+    if (written == 0) {
+      break;
+    }
+    freed += written;
+  }
+  swap_busy = 0;
+  return freed;
+}
+
+int swap_in(u64 vaddr, u64 flags) {
+  u64 page = vaddr & ~((u64)PAGE_SIZE - 1);
+  u64 entry = mmu_get_user_pte(mmu_read_cr3(), page);
+  if (!mmu_is_swap_entry(entry)) {
+    return 0;
+  }
+  u32 slot = mmu_swap_slot(entry);
+  if (!swap_disk || slot >= stats.slots) {
+    return -1;
+  }
+
+  u64 frame = pmm_alloc_frame();
+  if (!frame) {
+    com1_printf("[SWAP] Out of memory reading back %p\n", (void *)page);
+    return -1;
+  }
+  if (disk_read_sectors(swap_disk, swap_slot_lba(slot), sectors_per_page,
+                        (u8 *)phys_to_virt(frame)) != 0) {
+    com1_printf("[SWAP] Error: read of slot %u failed\n", slot);
+    pmm_free_frame(frame);
+    stats.errors++;
+    return -1;
+  }
+
+  mmu_map_page(page, frame, flags);
+  swap_slot_put(slot);
+  stats.swapped_in++;
+  return 1;
+}
+
+typedef struct {
+  unsigned long found;
+  unsigned long max;
+} swap_estimate_t;
+
+static int swap_count_page(u64 vaddr, u64 *pte, void *ctx) {
+  swap_estimate_t *est = (swap_estimate_t *)ctx;
+  u64 frame = *pte & PTE_ADDR_MASK;
+  (void)vaddr;
+  if (frame != mmu_zero_page() && pmm_page_refcount(frame) == 1) {
+    est->found++;
+  }
+  return est->found == est->max;
+}
+
+/* Pages the clock hand could write out, referenced or not, up to the free
+ * slots: the walk stops as soon as it has found that many. */
+static unsigned long swap_count(shrinker_t *shrinker) {
+  (void)shrinker;
+  if (swap_busy || in_irq()) {
+    return 0;
+  }
+  swap_estimate_t est;
+  est.found = 0;
+  est.max = stats.slots - stats.used;
+  for (u32 slot = 0; slot < MAX_PROCESSES && est.found < est.max; slot++) {
+    process_t *proc = &process_table[slot];
+    u64 vaddr = 0;
+    vma_t *area;
+    while (est.found < est.max &&
+           (area = swap_clock_area(proc, vaddr)) != NULL) {
+      u64 start = vaddr > area->start ? vaddr : area->start;
+      mmu_scan_user_ptes(proc->cr3, start, area->end, swap_count_page, &est);
+      vaddr = area->end;
+    }
+  }
+  return est.found;
+}
+
+static unsigned long swap_scan(shrinker_t *shrinker, unsigned long nr) {
+  (void)shrinker;
+  return swap_out(nr);
+}
+
+static shrinker_t swap_shrinker = {
+    .name = "swap",
+    .count = swap_count,
+    .scan = swap_scan,
+};
+
+int swap_on(disk_t *disk, u32 start_lba, u32 sectors) {
+  if (swap_disk) {
+    return -EBUSY;
+  }
+  if (!disk || !disk->sector_size || PAGE_SIZE % disk->sector_size != 0 ||
+      start_lba >= disk->total_sectors ||
+      sectors > disk->total_sectors - start_lba) {
+    return -EINVAL;
+  }
+  u32 per_page = PAGE_SIZE / disk->sector_size;
+  u32 slots = sectors / per_page;
+  if (slots == 0) {
+    return -EINVAL;
+  }
+
+  slot_refs = (u8 *)kcalloc_tagged(slots, 1, KMEM_TAG_MM);
+  if (!slot_refs) {
+    return -ENOMEM;
+  }
+  swap_disk = disk;
+  sectors_per_page = per_page;
+  slot_cursor = 0;
+  stats.disk = disk->name;
+  stats.start_lba = start_lba;
+  stats.slots = slots;
+  stats.used = 0;
+  register_shrinker(&swap_shrinker);
+
+  com1_printf("[SWAP] %u pages on %s, sectors %u..%u\n", slots, disk->name,
+              start_lba, start_lba + slots * per_page - 1);
+  return 0;
+}
+
+void swap_get_stats(swap_stats_t *out) { *out = stats; }
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <kernel/drivers/disk/disk.h>
+
+/*
+ * Swap area for anonymous mmap memory, a sector range of any registered
+ * disk. Under memory pressure the "swap" shrinker moves a clock hand over
+ * the VMA_ANON pages of every process: a page used since the hand last
+ * passed loses its accessed bit and is skipped, an idle one is written out.
+ * Idle pages are gathered into batches that go to consecutive slots in one
+ * multi-sector write, then their entries become swap entries (PTE_SWAP
+ * holding the slot) and the frames are freed. A fault on a swap entry reads
+ * the page back with swap_in. Only 4K pages mapped by a single address space
+ * are written out; the zero page, shared and 2MB pages stay resident.
+ */
+
+/* Pages per swap-out write (a 64KB bounce buffer). */
+#define SWAP_BATCH 16
+
+typedef struct {
+  const char *disk;   /* NULL until swap_on */
+  u32 start_lba;
+  u32 slots;          /* pages the area holds */
+  u32 used;           /* slots some entry still names */
+  u64 scanned;        /* pages the clock hand passed */
+  u64 referenced;     /* used since the last pass, given another round */
+  u64 swapped_out;    /* pages written out and freed */
+  u64 swapped_in;     /* pages read back on a fault */
+  u64 writes;         /* swap-out writes issued */
+  u64 errors;         /* failed reads or writes */
+} swap_stats_t;
+
+/* Use sectors [start_lba, start_lba + sectors) of disk as the swap area.
+ * There is one area: -EBUSY once it is set up, -EINVAL for a range the disk
+ * does not have or that holds no page, -ENOMEM without a slot map. */
+int swap_on(disk_t *disk, u32 start_lba, u32 sectors);
+
+/* A copied (fork) or dropped page table entry naming a slot; entries that
+ * are not swap entries are ignored. */
+void swap_entry_dup(u64 entry);
+void swap_entry_free(u64 entry);
+
+/* Not-present fault at vaddr of the current address space. If its entry is
+ * a swap entry the page is read back and mapped with flags: returns 1, or
+ * -1 when that fails. 0 when the entry is not a swap entry. */
+int swap_in(u64 vaddr, u64 flags);
+
+/* Write out up to nr idle pages; returns the frames freed. Does nothing
+ * from an interrupt handler or while another swap-out is running. */
+unsigned long swap_out(unsigned long nr);
+
+void swap_get_stats(swap_stats_t *out);
+
+#endif
@@ -116,6 +116,15 @@ void syscall_handler(registers_t *regs) {
   case SYS_MMAP:
     regs->rax = (u64)sys_mmap((const void *)arg1);
     break;
+  case SYS_MPROTECT:
+    regs->rax = (u64)sys_mprotect(arg1, arg2, (u32)arg3);
+    break;
+  case SYS_MUNMAP:
+    regs->rax = (u64)sys_munmap(arg1, arg2);
+    break;
+  case SYS_MREMAP:
+    regs->rax = sys_mremap((const void *)arg1);
+    break;
   case SYS_PIPE:
     regs->rax = (u64)sys_pipe((int *)arg1);
     break;
@@ -128,10 +137,17 @@ void syscall_handler(registers_t *regs) {
   case SYS_FORK:
     regs->rax = (u64)sys_fork(regs);
     break;
+  case SYS_VFORK:
+    regs->rax = (u64)sys_vfork(regs);
+    break;
   case SYS_EXECVE:
     regs->rax = (u64)sys_execve((const char *)arg1, (const char *const *)arg2,
                                 (const char *const *)arg3, regs);
     break;
+  case SYS_SPAWN:
+    regs->rax = (u64)sys_spawn((const char *)arg1, (const char *const *)arg2,
+                               (const char *const *)arg3);
+    break;
   case SYS_EXIT:
     process_exit((int)arg1);
     break;
@@ -36,14 +36,19 @@
 #define SYS_CLOSE 3
 #define SYS_LSEEK 8
 #define SYS_MMAP 9
+#define SYS_MPROTECT 10
+#define SYS_MUNMAP 11
 #define SYS_PIPE 22
+#define SYS_MREMAP 25
 #define SYS_CLONE 56
 #define SYS_FORK 57
+#define SYS_VFORK 58
 #define SYS_EXECVE 59
 #define SYS_EXIT 60
 #define SYS_WAIT 61
 #define SYS_KILL 62
 #define SYS_UNAME 63
+#define SYS_SPAWN 400 /* otsos-specific, no Linux counterpart */
 
 void syscall_init(void);
 void syscall_handler(registers_t *regs);
@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <kernel/vma.h>
+#include <mlibc/memory.h>
+
+#define VMA_MIN_CAPACITY 8
+
+/* Index of the first area ending above addr (count if none). */
+static u32 vma_lower_bound(vma_set_t *set, u64 addr) {
+  u32 lo = 0;
+  u32 hi = set->count;
+  while (lo < hi) {
+    u32 mid = lo + (hi - lo) / 2;
+    if (set->vmas[mid].end <= addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Make room for extra more areas so the edit that follows cannot fail. */
+static int vma_reserve(vma_set_t *set, u32 extra) {
+  if (set->count + extra <= set->capacity) {
+    return 0;
+  }
+  u32 capacity = set->capacity ? set->capacity * 2 : VMA_MIN_CAPACITY;
+  while (capacity < set->count + extra) {
+    capacity *= 2;
+  }
+  vma_t *vmas = (vma_t *)kmalloc_tagged(capacity * sizeof(vma_t), KMEM_TAG_MM);
+  if (!vmas) {
+    return -1;
+  }
+  if (set->vmas) {
+    memcpy(vmas, set->vmas, set->count * sizeof(vma_t));
+    kfree(set->vmas);
+  }
+  set->vmas = vmas;
+  set->capacity = capacity;
+  return 0;
+}
+
+static void vma_open_slot(vma_set_t *set, u32 index) {
+  for (u32 i = set->count; i > index; i--) {
+    set->vmas[i] = set->vmas[i - 1];
+  }
+  set->count++;
+}
+
+static void vma_close_slot(vma_set_t *set, u32 index) {
+  vma_file_put(set->vmas[index].file);
+  for (u32 i = index; i + 1 < set->count; i++) {
+    set->vmas[i] = set->vmas[i + 1];
+  }
+  set->count--;
+}
+
+/* Cut the area containing addr in two at addr. Needs one free slot. */
+static void vma_split(vma_set_t *set, u64 addr) {
+  u32 i = vma_lower_bound(set, addr);
+  if (i == set->count || set->vmas[i].start >= addr) {
+    return;
+  }
+  vma_open_slot(set, i + 1);
+  set->vmas[i + 1] = set->vmas[i];
+  set->vmas[i].end = addr;
+  set->vmas[i + 1].start = addr;
+  if (set->vmas[i + 1].file) {
+    set->vmas[i + 1].file->refs++;
+    set->vmas[i + 1].offset += addr - set->vmas[i].start;
+  }
+}
+
+/* Same flags, and for file areas the same file picking up where a ends. */
+static int vma_mergeable(const vma_t *a, const vma_t *b) {
+  return a->end == b->start && a->page_flags == b->page_flags &&
+         a->flags == b->flags && a->file == b->file &&
+         (!a->file || a->offset + (a->end - a->start) == b->offset);
+}
+
+/* Merge the areas in [first, last] with their neighbours where they touch
+ * and agree on flags. */
+static void vma_merge(vma_set_t *set, u32 first, u32 last) {
+  if (first > 0) {
+    first--;
+  }
+  u32 i = first;
+  while (i + 1 < set->count && i <= last) {
+    vma_t *a = &set->vmas[i];
+    vma_t *b = &set->vmas[i + 1];
+    if (vma_mergeable(a, b)) {
+      a->end = b->end;
+      vma_close_slot(set, i + 1);
+      if (last > 0) {
+        last--;
+      }
+    } else {
+      i++;
+    }
+  }
+}
+
+vma_t *vma_find(vma_set_t *set, u64 addr) {
+  u32 i = vma_lower_bound(set, addr);
+  if (i < set->count && set->vmas[i].start <= addr) {
+    return &set->vmas[i];
+  }
+  return NULL;
+}
+
+int vma_overlaps(vma_set_t *set, u64 start, u64 end) {
+  u32 i = vma_lower_bound(set, start);
+  return i < set->count && set->vmas[i].start < end;
+}
+
+int vma_covers(vma_set_t *set, u64 start, u64 end) {
+  u32 i = vma_lower_bound(set, start);
+  u64 pos = start;
+  while (pos < end) {
+    if (i == set->count || set->vmas[i].start > pos) {
+      return 0;
+    }
+    pos = set->vmas[i].end;
+    i++;
+  }
+  return 1;
+}
+
+static u64 vma_align_up(u64 addr, u64 align) {
+  return (addr + align - 1) & ~(align - 1);
+}
+
+static u64 vma_gap_from(vma_set_t *set, u64 from, u64 length, u64 align,
+                        u64 high) {
+  u64 addr = vma_align_up(from, align);
+  for (u32 i = vma_lower_bound(set, addr); i < set->count; i++) {
+    if (addr >= high || set->vmas[i].start >= addr + length) {
+      break;
+    }
+    if (set->vmas[i].end > addr) {
+      addr = vma_align_up(set->vmas[i].end, align);
+    }
+  }
+  if (addr >= high || high - addr < length) {
+    return 0;
+  }
+  return addr;
+}
+
+u64 vma_find_gap(vma_set_t *set, u64 hint, u64 length, u64 align, u64 low,
+                 u64 high) {
+  if (hint < low || hint >= high) {
+    hint = low;
+  }
+  u64 addr = vma_gap_from(set, hint, length, align, high);
+  if (!addr && hint > low) {
+    addr = vma_gap_from(set, low, length, align, hint);
+  }
+  return addr;
+}
+
+static int vma_insert_area(vma_set_t *set, const vma_t *area) {
+  if (vma_reserve(set, 1) != 0) {
+    return -1;
+  }
+  u32 i = vma_lower_bound(set, area->start);
+  vma_open_slot(set, i);
+  set->vmas[i] = *area;
+  if (area->file) {
+    area->file->refs++;
+  }
+  vma_merge(set, i, i);
+  return 0;
+}
+
+int vma_insert(vma_set_t *set, u64 start, u64 end, u64 page_flags, u32 flags) {
+  vma_t area = {start, end, page_flags, flags, NULL, 0};
+  return vma_insert_area(set, &area);
+}
+
+int vma_insert_file(vma_set_t *set, u64 start, u64 end, u64 page_flags,
+                    vma_file_t *file, u64 offset) {
+  vma_t area = {start, end, page_flags, VMA_FILE, file, offset};
+  return vma_insert_area(set, &area);
+}
+
+int vma_remove(vma_set_t *set, u64 start, u64 end) {
+  if (vma_reserve(set, 2) != 0) {
+    return -1;
+  }
+  vma_split(set, start);
+  vma_split(set, end);
+  u32 i = vma_lower_bound(set, start);
+  while (i < set->count && set->vmas[i].start < end) {
+    vma_close_slot(set, i);
+  }
+  return 0;
+}
+
+int vma_protect(vma_set_t *set, u64 start, u64 end, u64 page_flags) {
+  if (vma_reserve(set, 2) != 0) {
+    return -1;
+  }
+  vma_split(set, start);
+  vma_split(set, end);
+  u32 first = vma_lower_bound(set, start);
+  u32 last = first;
+  for (u32 i = first; i < set->count && set->vmas[i].start < end; i++) {
+    set->vmas[i].page_flags = page_flags;
+    last = i;
+  }
+  vma_merge(set, first, last);
+  return 0;
+}
+
+int vma_copy(vma_set_t *dst, const vma_set_t *src) {
+  dst->vmas = NULL;
+  dst->count = 0;
+  dst->capacity = 0;
+  if (src->count == 0) {
+    return 0;
+  }
+  if (vma_reserve(dst, src->count) != 0) {
+    return -1;
+  }
+  memcpy(dst->vmas, src->vmas, src->count * sizeof(vma_t));
+  dst->count = src->count;
+  for (u32 i = 0; i < dst->count; i++) {
+    if (dst->vmas[i].file) {
+      dst->vmas[i].file->refs++;
+    }
+  }
+  return 0;
+}
+
+void vma_release(vma_set_t *set) {
+  for (u32 i = 0; i < set->count; i++) {
+    vma_file_put(set->vmas[i].file);
+  }
+  if (set->vmas) {
+    kfree(set->vmas);
+  }
+  set->vmas = NULL;
+  set->count = 0;
+  set->capacity = 0;
+}
+
+vma_file_t *vma_file_create(const char *path, u32 size) {
+  unsigned long len = strlen(path);
+  vma_file_t *file =
+      (vma_file_t *)kmalloc_tagged(sizeof(vma_file_t) + len + 1, KMEM_TAG_MM);
+  if (!file) {
+    return NULL;
+  }
+  file->refs = 1;
+  file->size = size;
+  memcpy(file->path, path, len + 1);
+  return file;
+}
+
+void vma_file_put(vma_file_t *file) {
+  if (file && --file->refs == 0) {
+    kfree(file);
+  }
+}
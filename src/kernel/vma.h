@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef VMA_H
+#define VMA_H
+
+#include <mlibc/mlibc.h>
+
+/* Demand-zero: absent pages are filled in on first touch. */
+#define VMA_ANON 0x1
+/* Only ever mapped with 2MB pages (MAP_HUGETLB). */
+#define VMA_HUGE 0x2
+/* Pages are copies of a ChainFS file; clean ones can be dropped and read
+ * back in on the next fault. */
+#define VMA_FILE 0x4
+
+/* The file behind VMA_FILE areas, shared by the areas split or copied from
+ * one mapping. Bytes at or past size read as zero. */
+typedef struct {
+  u32 refs;
+  u32 size;
+  char path[];
+} vma_file_t;
+
+typedef struct {
+  u64 start;
+  u64 end;
+  u64 page_flags; /* PTE flags for a privately owned page of the area */
+  u32 flags;      /* VMA_* */
+  vma_file_t *file; /* VMA_FILE only */
+  u64 offset;       /* file offset of start */
+} vma_t;
+
+/* The mmap areas of one address space, sorted by address and never
+ * overlapping, so finding the area or the gap around an address is a binary
+ * search. Adjacent areas with the same flags are merged. */
+typedef struct {
+  vma_t *vmas;
+  u32 count;
+  u32 capacity;
+} vma_set_t;
+
+vma_t *vma_find(vma_set_t *set, u64 addr);
+int vma_overlaps(vma_set_t *set, u64 start, u64 end);
+/* 1 if every page of [start, end) belongs to some area. */
+int vma_covers(vma_set_t *set, u64 start, u64 end);
+
+/* First align-aligned gap of length bytes at or above hint and below high,
+ * falling back to [low, hint). Returns 0 if there is none. */
+u64 vma_find_gap(vma_set_t *set, u64 hint, u64 length, u64 align, u64 low,
+                 u64 high);
+
+/* These return -1 only when the array cannot grow, leaving the set as it
+ * was. vma_insert expects [start, end) to be free; vma_remove and
+ * vma_protect split the areas straddling the range. */
+int vma_insert(vma_set_t *set, u64 start, u64 end, u64 page_flags, u32 flags);
+/* A VMA_FILE area whose first page is file at offset; takes its own
+ * reference to file. */
+int vma_insert_file(vma_set_t *set, u64 start, u64 end, u64 page_flags,
+                    vma_file_t *file, u64 offset);
+int vma_remove(vma_set_t *set, u64 start, u64 end);
+int vma_protect(vma_set_t *set, u64 start, u64 end, u64 page_flags);
+
+int vma_copy(vma_set_t *dst, const vma_set_t *src);
+void vma_release(vma_set_t *set);
+
+/* One reference, dropped with vma_file_put. NULL when out of memory. */
+vma_file_t *vma_file_create(const char *path, u32 size);
+void vma_file_put(vma_file_t *file);
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <kernel/mmu.h>
+#include <kernel/pmm.h>
+#include <kernel/vmalloc.h>
+#include <lib/com1.h>
+#include <mlibc/kmem_cache.h>
+#include <mlibc/memory.h>
+
+/*
+ * vmalloc window: large buffers are built from single frames mapped back to
+ * back here, so they need neither physically contiguous memory nor heap space.
+ * Like the heap growth window, its PML4 entry is created before any process
+ * exists, so all address spaces see the same mappings.
+ */
+#define VMALLOC_BASE 0xFFFFFE8000000000ULL
+#define VMALLOC_SIZE (1ULL << 30)
+#define VMALLOC_LAZY_MAX 8192 /* freed pages held before a TLB flush */
+#define KVMALLOC_MIN (4 * PAGE_SIZE)
+
+/*
+ * Areas cover the window in address order. Each is followed by an unmapped
+ * guard page. vfree unmaps and frees the frames right away, but skips the TLB
+ * flush: the area stays on the list as lazy, so its addresses are not handed
+ * out again until one CR3 reload purges all lazy areas at once.
+ */
+typedef struct vmap_area {
+  u64 addr;
+  u64 pages; /* mapped pages, the guard page not included */
+  int lazy;
+  struct vmap_area *next;
+} vmap_area_t;
+
+static vmap_area_t *vmap_areas = NULL;
+static kmem_cache_t *vmap_area_cache = NULL;
+static int vmalloc_ready = 0;
+static vmalloc_stats_t vmalloc_stats;
+
+int vmalloc_init(void) {
+  if (!pmm_is_initialized()) {
+    com1_printf("[VMALLOC] Disabled: no frame allocator\n");
+    return -1;
+  }
+  if (mmu_share_kernel_region(VMALLOC_BASE) != 0) {
+    com1_printf("[VMALLOC] Disabled: cannot map window\n");
+    return -1;
+  }
+  vmap_area_cache =
+      kmem_cache_create("vmap_area", sizeof(vmap_area_t), 16, NULL);
+  if (!vmap_area_cache) {
+    return -1;
+  }
+  vmalloc_ready = 1;
+  com1_printf("[VMALLOC] Window at %p (%d MB)\n", (void *)VMALLOC_BASE,
+              (int)(VMALLOC_SIZE / (1024 * 1024)));
+  return 0;
+}
+
+static void vmalloc_purge_lazy(void) {
+  /* The window's pages are global and cached under every PCID. */
+  mmu_flush_tlb_all();
+  vmalloc_stats.flushes++;
+
+  vmap_area_t **link = &vmap_areas;
+  while (*link) {
+    vmap_area_t *area = *link;
+    if (area->lazy) {
+      *link = area->next;
+      kmem_cache_free(vmap_area_cache, area);
+    } else {
+      link = &area->next;
+    }
+  }
+  vmalloc_stats.lazy_pages = 0;
+}
+
+/* First fit over the gaps between areas; returns the link to insert at. */
+static vmap_area_t **vmalloc_find_gap(u64 span, u64 *addr) {
+  u64 cursor = VMALLOC_BASE;
+  vmap_area_t **link = &vmap_areas;
+  while (*link) {
+    vmap_area_t *area = *link;
+    if (area->addr - cursor >= span) {
+      break;
+    }
+    cursor = area->addr + (area->pages + 1) * PAGE_SIZE;
+    link = &area->next;
+  }
+  if (VMALLOC_BASE + VMALLOC_SIZE - cursor < span) {
+    return NULL;
+  }
+  *addr = cursor;
+  return link;
+}
+
+static void vmalloc_unmap(u64 addr, u64 pages) {
+  for (u64 i = 0; i < pages; i++) {
+    u64 pte = mmu_unmap_page_noflush(addr + i * PAGE_SIZE);
+    if (pte & PTE_PRESENT) {
+      pmm_free_frame(pte & PTE_ADDR_MASK);
+    }
+  }
+}
+
+static u64 vmalloc_frame(u64 index, void *ctx) {
+  (void)index;
+  return *(int *)ctx ? pmm_alloc_zeroed_frame() : pmm_alloc_frame();
+}
+
+static void *vmalloc_area(unsigned long size, int zero) {
+  if (!vmalloc_ready || size == 0) {
+    return NULL;
+  }
+
+  u64 pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+  u64 span = (pages + 1) * PAGE_SIZE;
+  u64 addr = 0;
+  vmap_area_t **link = vmalloc_find_gap(span, &addr);
+  if (!link && vmalloc_stats.lazy_pages) {
+    vmalloc_purge_lazy();
+    link = vmalloc_find_gap(span, &addr);
+  }
+  if (!link) {
+    com1_printf("[VMALLOC] Window exhausted, request %d pages\n", (int)pages);
+    return NULL;
+  }
+
+  vmap_area_t *area = (vmap_area_t *)kmem_cache_alloc(vmap_area_cache);
+  if (!area) {
+    return NULL;
+  }
+
+  if (mmu_map_range_frames(addr, pages * PAGE_SIZE,
+                           PTE_PRESENT | PTE_RW | PTE_NX, vmalloc_frame,
+                           &zero) != 0) {
+    /* Never handed out, so nothing can have cached these mappings. */
+    vmalloc_unmap(addr, pages);
+    kmem_cache_free(vmap_area_cache, area);
+    com1_printf("[VMALLOC] Out of frames, request %d pages\n", (int)pages);
+    return NULL;
+  }
+
+  area->addr = addr;
+  area->pages = pages;
+  area->lazy = 0;
+  area->next = *link;
+  *link = area;
+
+  vmalloc_stats.areas++;
+  vmalloc_stats.pages += pages;
+  return (void *)addr;
+}
+
+void *vmalloc(unsigned long size) { return vmalloc_area(size, 0); }
+
+void *vzalloc(unsigned long size) { return vmalloc_area(size, 1); }
+
+void vfree(void *addr) {
+  if (!addr) {
+    return;
+  }
+
+  vmap_area_t *area = vmap_areas;
+  while (area && (area->addr != (u64)addr || area->lazy)) {
+    area = area->next;
+  }
+  if (!area) {
+    com1_printf("[VMALLOC] vfree: invalid pointer %p\n", addr);
+    return;
+  }
+
+  vmalloc_unmap(area->addr, area->pages);
+  area->lazy = 1;
+  vmalloc_stats.areas--;
+  vmalloc_stats.pages -= area->pages;
+  vmalloc_stats.lazy_pages += area->pages + 1;
+  if (vmalloc_stats.lazy_pages > VMALLOC_LAZY_MAX) {
+    vmalloc_purge_lazy();
+  }
+}
+
+int is_vmalloc_addr(const void *addr) {
+  u64 va = (u64)addr;
+  return va >= VMALLOC_BASE && va < VMALLOC_BASE + VMALLOC_SIZE;
+}
+
+void vmalloc_get_stats(vmalloc_stats_t *out) { *out = vmalloc_stats; }
+
+void *kvmalloc(unsigned long size, int tag) {
+  if (size >= KVMALLOC_MIN && vmalloc_ready) {
+    void *ptr = vmalloc(size);
+    if (ptr) {
+      return ptr;
+    }
+  }
+  return kmalloc_tagged(size, tag);
+}
+
+void *kvzalloc(unsigned long size, int tag) {
+  if (size >= KVMALLOC_MIN && vmalloc_ready) {
+    void *ptr = vzalloc(size);
+    if (ptr) {
+      return ptr;
+    }
+  }
+  return kcalloc_tagged(size, 1, tag);
+}
+
+void kvfree(void *addr) {
+  if (is_vmalloc_addr(addr)) {
+    vfree(addr);
+  } else {
+    kfree(addr);
+  }
+}
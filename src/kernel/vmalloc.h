@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include <mlibc/mlibc.h>
+
+typedef struct {
+  u64 areas;      /* live allocations */
+  u64 pages;      /* frames mapped for them */
+  u64 lazy_pages; /* freed window pages waiting for a TLB flush */
+  u64 flushes;
+} vmalloc_stats_t;
+
+int vmalloc_init(void);
+
+/* Virtually contiguous kernel memory backed by scattered frames. vzalloc
+ * returns zeroed memory. Both return NULL on failure. */
+void *vmalloc(unsigned long size);
+void *vzalloc(unsigned long size);
+void vfree(void *addr);
+int is_vmalloc_addr(const void *addr);
+void vmalloc_get_stats(vmalloc_stats_t *out);
+
+/* Heap for small sizes, vmalloc above a few pages; kvfree takes either. */
+void *kvmalloc(unsigned long size, int tag);
+void *kvzalloc(unsigned long size, int tag);
+void kvfree(void *addr);
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <kernel/mmu.h>
+#include <kernel/pmm.h>
+#include <mlibc/arena.h>
+
+#define ARENA_PAGE_SIZE 4096UL
+
+typedef struct arena_chunk {
+  struct arena_chunk *next;
+  u32 order;
+} arena_chunk_t;
+
+/* Chunk header padded so the first allocation is 16-byte aligned. */
+#define ARENA_CHUNK_HEADER ((sizeof(arena_chunk_t) + 15) & ~15UL)
+
+void arena_init(arena_t *arena) {
+  arena->chunks = NULL;
+  arena->cur = NULL;
+  arena->end = NULL;
+}
+
+static void arena_use(arena_t *arena, arena_chunk_t *chunk) {
+  arena->cur = (u8 *)chunk + ARENA_CHUNK_HEADER;
+  arena->end = (u8 *)chunk + (ARENA_PAGE_SIZE << chunk->order);
+}
+
+static int arena_grow(arena_t *arena, unsigned long size) {
+  u32 order = 0;
+  while ((ARENA_PAGE_SIZE << order) - ARENA_CHUNK_HEADER < size) {
+    if (++order > PMM_MAX_ORDER) {
+      return -1;
+    }
+  }
+
+  u64 block = alloc_pages(order);
+  if (!block) {
+    return -1;
+  }
+  arena_chunk_t *chunk = phys_to_virt(block);
+  chunk->order = order;
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  arena_use(arena, chunk);
+  return 0;
+}
+
+void *arena_alloc(arena_t *arena, unsigned long size) {
+  size = (size + 15) & ~15UL;
+  if (size == 0) {
+    size = 16;
+  }
+  if ((unsigned long)(arena->end - arena->cur) < size &&
+      arena_grow(arena, size) != 0) {
+    return NULL;
+  }
+  void *ptr = arena->cur;
+  arena->cur += size;
+  return ptr;
+}
+
+char *arena_strndup(arena_t *arena, const char *s, unsigned long len) {
+  char *out = (char *)arena_alloc(arena, len + 1);
+  if (out) {
+    memcpy(out, s, len);
+    out[len] = '\0';
+  }
+  return out;
+}
+
+void arena_reset(arena_t *arena) {
+  arena_chunk_t *chunk = arena->chunks;
+  if (!chunk) {
+    return;
+  }
+  while (chunk->next) {
+    arena_chunk_t *next = chunk->next;
+    free_pages(virt_to_phys(chunk), chunk->order);
+    chunk = next;
+  }
+  arena->chunks = chunk;
+  arena_use(arena, chunk);
+}
+
+void arena_destroy(arena_t *arena) {
+  arena_chunk_t *chunk = arena->chunks;
+  while (chunk) {
+    arena_chunk_t *next = chunk->next;
+    free_pages(virt_to_phys(chunk), chunk->order);
+    chunk = next;
+  }
+  arena_init(arena);
+}
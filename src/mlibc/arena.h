@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <mlibc/mlibc.h>
+
+struct arena_chunk;
+
+/*
+ * Bump allocator for temporaries that all die together, such as the strings
+ * one syscall copies in. Memory comes from whole buddy blocks; there is no
+ * per-allocation free. arena_reset rewinds to the first block and keeps it,
+ * so an arena reused across calls stops touching the page allocator.
+ */
+typedef struct {
+  struct arena_chunk *chunks; /* newest first */
+  u8 *cur;
+  u8 *end;
+} arena_t;
+
+void arena_init(arena_t *arena);
+/* 16-byte aligned, not zeroed; NULL when out of pages. */
+void *arena_alloc(arena_t *arena, unsigned long size);
+char *arena_strndup(arena_t *arena, const char *s, unsigned long len);
+void arena_reset(arena_t *arena);
+/* Give every block back; the arena can be used again afterwards. */
+void arena_destroy(arena_t *arena);
+
+#endif
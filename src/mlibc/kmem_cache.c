@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <kernel/mmu.h>
+#include <kernel/pmm.h>
+#include <kernel/shrinker.h>
+#include <lib/com1.h>
+#include <mlibc/kmem_cache.h>
+#include <mlibc/memory.h>
+
+#define KMEM_PAGE_SIZE 4096UL
+#define KMEM_MIN_OBJECTS 8
+#define KMEM_MAX_SLAB_ORDER 5
+
+/*
+ * Slab descriptors live off-slab so page-sized objects (page tables) stay
+ * page-aligned without wasting a page per slab. The frames of a slab point
+ * back to the descriptor through their page_frame_t owner field. Free
+ * objects are tracked by index, never by writing into the object, which is
+ * what keeps constructed state intact. A bitmap of the same free objects,
+ * stored after the stack, catches double frees without searching it.
+ */
+typedef struct kmem_slab {
+  kmem_cache_t *cache;
+  u64 base; /* direct map address of the block */
+  u32 inuse;
+  u32 free_top;
+  u64 *free_map; /* bit set per free object */
+  struct kmem_slab *next;
+  struct kmem_slab *prev;
+  u16 free_stack[];
+} kmem_slab_t;
+
+/* Bytes of free_stack, rounded up so free_map that follows is aligned. */
+static unsigned long kmem_stack_bytes(kmem_cache_t *cache) {
+  return (cache->per_slab * sizeof(u16) + 7) & ~7UL;
+}
+
+static unsigned long kmem_map_words(kmem_cache_t *cache) {
+  return (cache->per_slab + 63) / 64;
+}
+
+static kmem_cache_t *cache_list = NULL;
+static shrinker_t kmem_shrinker;
+
+static void kmem_list_push(kmem_slab_t **list, kmem_slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list) {
+    (*list)->prev = slab;
+  }
+  *list = slab;
+}
+
+static void kmem_list_remove(kmem_slab_t **list, kmem_slab_t *slab) {
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    *list = slab->next;
+  }
+  if (slab->next) {
+    slab->next->prev = slab->prev;
+  }
+  slab->next = NULL;
+  slab->prev = NULL;
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, unsigned long size,
+                                unsigned long align, void (*ctor)(void *)) {
+  if (size == 0) {
+    return NULL;
+  }
+  if (align < 16) {
+    align = 16;
+  }
+  if (align > KMEM_PAGE_SIZE || (align & (align - 1)) != 0) {
+    com1_printf("[KMEM] Error: bad alignment %d for cache %s\n", (int)align,
+                name);
+    return NULL;
+  }
+
+  unsigned long object_size = (size + align - 1) & ~(align - 1);
+  u32 order = 0;
+  while (order < KMEM_MAX_SLAB_ORDER &&
+         ((KMEM_PAGE_SIZE << order) / object_size) < KMEM_MIN_OBJECTS) {
+    order++;
+  }
+  unsigned long per_slab = (KMEM_PAGE_SIZE << order) / object_size;
+  if (per_slab == 0) {
+    com1_printf("[KMEM] Error: object too large for cache %s\n", name);
+    return NULL;
+  }
+
+  kmem_cache_t *cache = (kmem_cache_t *)kcalloc_tagged(
+      1, sizeof(kmem_cache_t), KMEM_TAG_MM);
+  if (!cache) {
+    return NULL;
+  }
+
+  int i;
+  for (i = 0; i < KMEM_CACHE_NAME_LEN - 1 && name[i]; i++) {
+    cache->name[i] = name[i];
+  }
+  cache->name[i] = '\0';
+  cache->object_size = object_size;
+  cache->align = align;
+  cache->ctor = ctor;
+  cache->order = order;
+  cache->per_slab = (u32)per_slab;
+
+  if (!cache_list) {
+    register_shrinker(&kmem_shrinker);
+  }
+  cache->next = cache_list;
+  cache_list = cache;
+  return cache;
+}
+
+static kmem_slab_t *kmem_cache_grow(kmem_cache_t *cache) {
+  kmem_slab_t *slab = (kmem_slab_t *)kmalloc_tagged(
+      sizeof(kmem_slab_t) + kmem_stack_bytes(cache) +
+          kmem_map_words(cache) * sizeof(u64),
+      KMEM_TAG_MM);
+  if (!slab) {
+    return NULL;
+  }
+
+  u64 paddr = alloc_pages(cache->order);
+  if (!paddr) {
+    kfree(slab);
+    return NULL;
+  }
+  u64 base = (u64)phys_to_virt(paddr);
+
+  slab->cache = cache;
+  slab->base = base;
+  slab->inuse = 0;
+  slab->free_top = cache->per_slab;
+  slab->free_map = (u64 *)((u8 *)slab->free_stack + kmem_stack_bytes(cache));
+  for (u32 i = 0; i < kmem_map_words(cache); i++) {
+    slab->free_map[i] = 0;
+  }
+  for (u32 i = 0; i < cache->per_slab; i++) {
+    slab->free_map[i / 64] |= 1ULL << (i % 64);
+    /* Hand out low addresses first. */
+    slab->free_stack[i] = (u16)(cache->per_slab - 1 - i);
+    if (cache->ctor) {
+      cache->ctor((void *)(base + (u64)i * cache->object_size));
+    }
+  }
+  pmm_set_owner(paddr, cache->order, slab);
+
+  kmem_list_push(&cache->empty, slab);
+  cache->slabs++;
+  cache->empty_slabs++;
+  return slab;
+}
+
+static void kmem_cache_release(kmem_cache_t *cache, kmem_slab_t *slab) {
+  kmem_list_remove(&cache->empty, slab);
+  cache->slabs--;
+  cache->empty_slabs--;
+  free_pages(virt_to_phys((void *)slab->base), cache->order);
+  kfree(slab);
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+  if (!cache) {
+    return NULL;
+  }
+
+  kmem_slab_t *slab = cache->partial;
+  if (slab) {
+    cache->hits++;
+  } else if (cache->empty) {
+    slab = cache->empty;
+    kmem_list_remove(&cache->empty, slab);
+    kmem_list_push(&cache->partial, slab);
+    cache->empty_slabs--;
+    cache->hits++;
+  } else {
+    slab = kmem_cache_grow(cache);
+    if (!slab) {
+      com1_printf("[KMEM] Error: cache %s out of memory\n", cache->name);
+      return NULL;
+    }
+    kmem_list_remove(&cache->empty, slab);
+    kmem_list_push(&cache->partial, slab);
+    cache->empty_slabs--;
+    cache->misses++;
+  }
+
+  u32 index = slab->free_stack[--slab->free_top];
+  slab->free_map[index / 64] &= ~(1ULL << (index % 64));
+  slab->inuse++;
+  if (slab->free_top == 0) {
+    kmem_list_remove(&cache->partial, slab);
+    kmem_list_push(&cache->full, slab);
+  }
+  cache->active++;
+  return (void *)(slab->base + (u64)index * cache->object_size);
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+  if (!cache || !obj) {
+    return;
+  }
+
+  kmem_slab_t *slab = (kmem_slab_t *)pmm_get_owner(virt_to_phys(obj));
+  if (!slab || slab->cache != cache) {
+    com1_printf("[KMEM] Error: %p does not belong to cache %s\n", obj,
+                cache->name);
+    return;
+  }
+
+  u64 offset = (u64)obj - slab->base;
+  if (offset % cache->object_size != 0) {
+    com1_printf("[KMEM] Error: invalid pointer %p in cache %s\n", obj,
+                cache->name);
+    return;
+  }
+  u32 index = (u32)(offset / cache->object_size);
+  if (slab->free_map[index / 64] & (1ULL << (index % 64))) {
+    com1_printf("[KMEM] Error: double free of %p in cache %s\n", obj,
+                cache->name);
+    return;
+  }
+
+  if (slab->free_top == 0) {
+    kmem_list_remove(&cache->full, slab);
+    kmem_list_push(&cache->partial, slab);
+  }
+  slab->free_stack[slab->free_top++] = (u16)index;
+  slab->free_map[index / 64] |= 1ULL << (index % 64);
+  slab->inuse--;
+  cache->active--;
+  cache->frees++;
+
+  if (slab->inuse == 0) {
+    kmem_list_remove(&cache->partial, slab);
+    kmem_list_push(&cache->empty, slab);
+    cache->empty_slabs++;
+    /* Keep one empty slab around to absorb alloc/free churn. */
+    if (cache->empty_slabs > 1) {
+      kmem_cache_release(cache, slab);
+    }
+  }
+}
+
+kmem_cache_t *kmem_cache_list(void) { return cache_list; }
+
+unsigned long kmem_cache_shrink(kmem_cache_t *cache) {
+  unsigned long pages = 0;
+  while (cache && cache->empty) {
+    pages += 1UL << cache->order;
+    kmem_cache_release(cache, cache->empty);
+  }
+  return pages;
+}
+
+/* The empty slab each cache keeps for churn is the reclaimable part. */
+static unsigned long kmem_shrinker_count(shrinker_t *shrinker) {
+  (void)shrinker;
+  unsigned long pages = 0;
+  for (kmem_cache_t *cache = cache_list; cache; cache = cache->next) {
+    pages += cache->empty_slabs << cache->order;
+  }
+  return pages;
+}
+
+static unsigned long kmem_shrinker_scan(shrinker_t *shrinker,
+                                        unsigned long nr) {
+  (void)shrinker;
+  unsigned long freed = 0;
+  for (kmem_cache_t *cache = cache_list; cache && freed < nr;
+       cache = cache->next) {
+    freed += kmem_cache_shrink(cache);
+  }
+  return freed;
+}
+
+static shrinker_t kmem_shrinker = {.name = "kmem_cache",
+                                   .count = kmem_shrinker_count,
+                                   .scan = kmem_shrinker_scan};
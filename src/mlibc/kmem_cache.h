@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2026, otsos team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef KMEM_CACHE_H
+#define KMEM_CACHE_H
+
+#include <mlibc/mlibc.h>
+
+#define KMEM_CACHE_NAME_LEN 16
+
+struct kmem_slab;
+
+/*
+ * Object cache for one fixed-size type. Objects live in slabs taken from the
+ * buddy allocator; free objects keep their constructed state, so `ctor` only
+ * runs when a slab is created and callers must hand objects back in that
+ * state.
+ */
+typedef struct kmem_cache {
+  char name[KMEM_CACHE_NAME_LEN];
+  unsigned long object_size;
+  unsigned long align;
+  void (*ctor)(void *obj);
+  u32 order;    /* buddy order of one slab */
+  u32 per_slab; /* objects per slab */
+  struct kmem_slab *partial;
+  struct kmem_slab *full;
+  struct kmem_slab *empty;
+  unsigned long slabs;
+  unsigned long empty_slabs;
+  unsigned long active;
+  unsigned long hits;   /* served from an existing slab */
+  unsigned long misses; /* needed a new slab */
+  unsigned long frees;
+  struct kmem_cache *next;
+} kmem_cache_t;
+
+kmem_cache_t *kmem_cache_create(const char *name, unsigned long size,
+                                unsigned long align, void (*ctor)(void *));
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+/* Release every empty slab of the cache; returns pages given back. */
+unsigned long kmem_cache_shrink(kmem_cache_t *cache);
+
+/* All caches, most recently created first. */
+kmem_cache_t *kmem_cache_list(void);
+
+#endif
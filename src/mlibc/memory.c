@@ -24,6 +24,10 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <kernel/mmu.h>
+#include <kernel/kguard.h>
+#include <kernel/pmm.h>
+#include <kernel/shrinker.h>
 #include <lib/com1.h>
 #include <mlibc/memory.h>
 #include <mlibc/mlibc.h>
@@ -31,17 +35,69 @@
 extern char kernel_end;
 #define HEAP_SIZE (8 * 1024 * 1024)
 #define HEAP_MAGIC 0x48454150
+/* Redzones around every list block and poisoning on free cost a byte check
+ * and a memset per call, so they are a debug build option. Normal builds
+ * catch overflows and use after free with sampled guard slots instead
+ * (kernel/kguard.c). */
+#ifdef KHEAP_REDZONES
 #define HEAP_REDZONE_SIZE 16
+#else
+#define HEAP_REDZONE_SIZE 0
+#endif
 #define HEAP_REDZONE_PATTERN 0xCC
 #define HEAP_POISON_PATTERN 0xAA
 
+/*
+ * Once frames are available the heap grows on demand into a dedicated
+ * virtual window. Its PML4 entry is created in the kernel address space
+ * before any process exists, so every address space shares the mappings.
+ */
+#define HEAP_GROW_BASE 0xFFFFFF0000000000ULL
+#define HEAP_GROW_LIMIT (1UL << 30)
+#define HEAP_GROW_CHUNK (256 * 1024)
+#define HEAP_TRIM_KEEP (1024 * 1024) /* free tail kept mapped after a trim */
+
+#define SLAB_MAGIC 0x534C4142
+#define SLAB_FREE_MAGIC 0x5342465245454446ULL
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_MIN_SHIFT 4
+#define SLAB_CLASS_COUNT 8 /* 16, 32, ..., 2048 */
+#define SLAB_MAX_SIZE (1UL << (SLAB_MIN_SHIFT + SLAB_CLASS_COUNT - 1))
+#define SLAB_LARGE_CHUNK_PAGES 4
+#define SLAB_MAP_CLASS_MASK 0x0F
+#define SLAB_MAP_PAGE_SHIFT 4
+
 static char *heap_start = 0;
 static char *heap_end = 0;
+static char *heap_grow_end = 0;
+static int heap_can_grow = 0;
 static int heap_initialized = 0;
 
+/*
+ * Allocation profiling: every live allocation remembers the call site that
+ * made it (an index into heap_sites) and a subsystem tag, so heapstat can
+ * report who holds memory. Slot 0 collects sites that did not fit the table.
+ */
+#define HEAP_SITE_COUNT 128
+
+typedef struct {
+  unsigned short site;
+  unsigned short tag;
+} heap_ref_t;
+
+static kheap_stat_t heap_sites[HEAP_SITE_COUNT];
+static kheap_stat_t heap_tags[KMEM_TAG_COUNT];
+static kheap_stat_t heap_total;
+/* Allocations sampled by kguard, by guard slot. */
+static heap_ref_t heap_kguard_refs[KGUARD_SLOTS];
+
+static const char *heap_tag_names[KMEM_TAG_COUNT] = {"other", "mm",    "proc",
+                                                     "fs",    "video", "tty"};
+
 typedef struct header {
   unsigned int magic;
   unsigned int is_free;
+  heap_ref_t ref;
   unsigned long size;
   unsigned long payload_size;
   struct header *next;
@@ -50,8 +106,56 @@ typedef struct header {
 
 static header_t *heap_head = 0;
 
+/*
+ * Small allocations are served from per-size-class slabs. A slab is a chunk of
+ * one or more pages taken from the list allocator; it starts with a slab_t and
+ * one heap_ref_t per object, and the rest is carved into equal objects linked
+ * through a per-slab free list.
+ */
+typedef struct slab {
+  unsigned int magic;
+  unsigned short class_index;
+  unsigned short inuse;
+  unsigned short capacity;
+  unsigned short first; /* offset of the first object */
+  void *free_list;
+  struct slab *next;
+  struct slab *prev;
+} slab_t;
+
+typedef struct {
+  unsigned long object_size;
+  unsigned long chunk_pages;
+  slab_t *partial; /* slabs with at least one free object */
+  unsigned long empty_slabs;
+  unsigned long total_slabs;
+  unsigned long allocs;
+  unsigned long frees;
+} slab_class_t;
+
+static slab_class_t slab_classes[SLAB_CLASS_COUNT];
+
+/* One byte per heap page (initial region, then the growth window):
+ * (class + 1) | (page index inside chunk << 4). */
+static u8 slab_page_map[(HEAP_SIZE + HEAP_GROW_LIMIT) / SLAB_PAGE_SIZE];
+
 static unsigned long align16(unsigned long size) { return (size + 15) & ~15UL; }
 
+static void *heap_alloc_aligned(unsigned long size, unsigned long align);
+static shrinker_t heap_slab_shrinker;
+
+static char *heap_block_end(header_t *block) {
+  return (char *)block + sizeof(header_t) + block->size;
+}
+
+static int heap_contains(const void *ptr) {
+  const char *p = (const char *)ptr;
+  if (p >= heap_start && p < heap_end) {
+    return 1;
+  }
+  return heap_can_grow && p >= (char *)HEAP_GROW_BASE && p < heap_grow_end;
+}
+
 static void split_block(header_t *current, unsigned long size) {
   if (current->size >= size + sizeof(header_t) + 16) {
     header_t *new_block =
@@ -76,8 +180,11 @@ static header_t *coalesce(header_t *block) {
   if (!block || !block->is_free)
     return block;
 
+  /* The initial region and the growth window are not contiguous, so only
+   * merge blocks that really touch. */
   header_t *next = block->next;
-  if (next && next->is_free && next->magic == HEAP_MAGIC) {
+  if (next && next->is_free && next->magic == HEAP_MAGIC &&
+      heap_block_end(block) == (char *)next) {
     block->size += sizeof(header_t) + next->size;
     block->payload_size = 0;
     block->next = next->next;
@@ -87,7 +194,8 @@ static header_t *coalesce(header_t *block) {
   }
 
   header_t *prev = block->prev;
-  if (prev && prev->is_free && prev->magic == HEAP_MAGIC) {
+  if (prev && prev->is_free && prev->magic == HEAP_MAGIC &&
+      heap_block_end(prev) == (char *)block) {
     prev->size += sizeof(header_t) + block->size;
     prev->payload_size = 0;
     prev->next = block->next;
@@ -113,23 +221,108 @@ void init_heap() {
   heap_head->prev = 0;
   heap_head->is_free = 1;
 
+  memset(slab_page_map, 0, sizeof(slab_page_map));
+  for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+    slab_classes[i].object_size = 1UL << (SLAB_MIN_SHIFT + i);
+    slab_classes[i].chunk_pages =
+        slab_classes[i].object_size > 512 ? SLAB_LARGE_CHUNK_PAGES : 1;
+    slab_classes[i].partial = 0;
+    slab_classes[i].empty_slabs = 0;
+    slab_classes[i].total_slabs = 0;
+    slab_classes[i].allocs = 0;
+    slab_classes[i].frees = 0;
+  }
+
+  register_shrinker(&heap_slab_shrinker);
+
   com1_printf("Heap initialized at %p header size: %d\n", heap_start,
               (int)sizeof(header_t));
   com1_printf("free block size: %d\n", (int)heap_head->size);
   heap_initialized = 1;
 }
 
-void *kmalloc(unsigned long size) {
-  if (!heap_head)
-    init_heap();
+static u64 heap_grow_frame(u64 index, void *ctx) {
+  (void)index;
+  (void)ctx;
+  return pmm_alloc_frame();
+}
 
-  if (size == 0)
+/* Map fresh frames at the end of the growth window, extending the tail. */
+static int heap_grow(unsigned long min_bytes) {
+  if (!heap_can_grow) {
+    return -1;
+  }
+
+  unsigned long bytes = (min_bytes + sizeof(header_t) + SLAB_PAGE_SIZE - 1) &
+                        ~(unsigned long)(SLAB_PAGE_SIZE - 1);
+  if (bytes < HEAP_GROW_CHUNK) {
+    bytes = HEAP_GROW_CHUNK;
+  }
+  if (heap_grow_end + bytes > (char *)HEAP_GROW_BASE + HEAP_GROW_LIMIT) {
+    com1_printf("KMALLOC: heap window exhausted\n");
+    return -1;
+  }
+
+  if (mmu_map_range_frames((u64)heap_grow_end, bytes,
+                           PTE_PRESENT | PTE_RW | PTE_NX, heap_grow_frame,
+                           NULL) != 0) {
+    mmu_unmap_range((u64)heap_grow_end, bytes, 1);
+    return -1;
+  }
+
+  header_t *tail = heap_head;
+  while (tail->next) {
+    tail = tail->next;
+  }
+
+  char *old_end = heap_grow_end;
+  heap_grow_end += bytes;
+
+  if (tail->is_free && heap_block_end(tail) == old_end) {
+    tail->size += bytes;
     return 0;
+  }
 
-  size = align16(size);
-  unsigned long payload_size = size;
-  unsigned long total_size = payload_size + (2 * HEAP_REDZONE_SIZE);
+  header_t *block = (header_t *)old_end;
+  block->magic = HEAP_MAGIC;
+  block->is_free = 1;
+  block->size = bytes - sizeof(header_t);
+  block->payload_size = 0;
+  block->next = 0;
+  block->prev = tail;
+  tail->next = block;
+  return 0;
+}
+
+/* Give whole pages at the end of the growth window back to the frame
+ * allocator when the free tail block gets large. */
+static void heap_trim(header_t *block) {
+  if (!heap_can_grow || !block->is_free || block->next ||
+      heap_block_end(block) != heap_grow_end) {
+    return;
+  }
+
+  unsigned long keep_end =
+      ((unsigned long)block + sizeof(header_t) + HEAP_TRIM_KEEP +
+       SLAB_PAGE_SIZE - 1) &
+      ~(unsigned long)(SLAB_PAGE_SIZE - 1);
+  if (keep_end + HEAP_GROW_CHUNK > (unsigned long)heap_grow_end) {
+    return;
+  }
 
+  mmu_unmap_range(keep_end, (u64)heap_grow_end - keep_end, 1);
+
+  block->size = keep_end - (unsigned long)block - sizeof(header_t);
+  heap_grow_end = (char *)keep_end;
+}
+
+/* Ask the shrinkers for the pages behind a failed request. */
+static int heap_reclaim(unsigned long bytes) {
+  unsigned long pages = (bytes + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+  return shrink_caches(pages, "kmalloc") != 0;
+}
+
+static header_t *heap_find_free(unsigned long total_size) {
   header_t *current = heap_head;
   while (current) {
     if (current->magic != HEAP_MAGIC) {
@@ -138,32 +331,80 @@ void *kmalloc(unsigned long size) {
       return 0;
     }
     if (current->is_free && current->size >= total_size) {
-      split_block(current, total_size);
-      current->is_free = 0;
-      current->payload_size = payload_size;
-      u8 *base = (u8 *)current + sizeof(header_t);
-      memset(base, HEAP_REDZONE_PATTERN, HEAP_REDZONE_SIZE);
-      memset(base + HEAP_REDZONE_SIZE + payload_size, HEAP_REDZONE_PATTERN,
-             HEAP_REDZONE_SIZE);
-      return (void *)(base + HEAP_REDZONE_SIZE);
+      return current;
     }
     current = current->next;
   }
-
-  com1_printf("KMALLOC FAILED! request size: %d\n", (int)size);
   return 0;
 }
 
-void kfree(void *ptr) {
-  if (!ptr)
-    return;
-  if (!heap_start || !heap_end)
-    return;
+static void heap_redzone_fill(header_t *header) {
+#ifdef KHEAP_REDZONES
+  u8 *base = (u8 *)header + sizeof(header_t);
+  memset(base, HEAP_REDZONE_PATTERN, HEAP_REDZONE_SIZE);
+  memset(base + HEAP_REDZONE_SIZE + header->payload_size, HEAP_REDZONE_PATTERN,
+         HEAP_REDZONE_SIZE);
+#else
+  (void)header;
+#endif
+}
+
+static void heap_redzone_check(header_t *header, void *ptr) {
+#ifdef KHEAP_REDZONES
+  u8 *base = (u8 *)header + sizeof(header_t);
+  u8 *payload = base + HEAP_REDZONE_SIZE;
+  for (u32 i = 0; i < HEAP_REDZONE_SIZE; i++) {
+    if (base[i] != HEAP_REDZONE_PATTERN) {
+      com1_printf("KFREE: left redzone corrupted at %p\n", ptr);
+      break;
+    }
+  }
+  for (u32 i = 0; i < HEAP_REDZONE_SIZE; i++) {
+    if (payload[header->payload_size + i] != HEAP_REDZONE_PATTERN) {
+      com1_printf("KFREE: right redzone corrupted at %p\n", ptr);
+      break;
+    }
+  }
+
+  memset(payload, HEAP_POISON_PATTERN, header->payload_size);
+#else
+  (void)header;
+  (void)ptr;
+#endif
+}
+
+static void *heap_list_alloc(unsigned long size) {
+  size = align16(size);
+  unsigned long payload_size = size;
+  unsigned long total_size = payload_size + (2 * HEAP_REDZONE_SIZE);
+
+  header_t *current = heap_find_free(total_size);
+  if (!current && heap_grow(total_size) == 0) {
+    current = heap_find_free(total_size);
+  }
+  if (!current && heap_reclaim(total_size)) {
+    current = heap_find_free(total_size);
+    if (!current && heap_grow(total_size) == 0) {
+      current = heap_find_free(total_size);
+    }
+  }
+  if (!current) {
+    com1_printf("KMALLOC FAILED! request size: %d\n", (int)size);
+    return 0;
+  }
 
+  split_block(current, total_size);
+  current->is_free = 0;
+  current->payload_size = payload_size;
+  heap_redzone_fill(current);
+  return (void *)((u8 *)current + sizeof(header_t) + HEAP_REDZONE_SIZE);
+}
+
+static void heap_list_free(void *ptr) {
   header_t *header =
       (header_t *)((char *)ptr - HEAP_REDZONE_SIZE - sizeof(header_t));
 
-  if ((char *)header < heap_start || (char *)header >= heap_end) {
+  if (!heap_contains(header)) {
     com1_printf("KFREE: invalid pointer %p\n", ptr);
     return;
   }
@@ -178,49 +419,430 @@ void kfree(void *ptr) {
     return;
   }
 
-  u8 *base = (u8 *)header + sizeof(header_t);
-  u8 *payload = base + HEAP_REDZONE_SIZE;
-  for (u32 i = 0; i < HEAP_REDZONE_SIZE; i++) {
-    if (base[i] != HEAP_REDZONE_PATTERN) {
-      com1_printf("KFREE: left redzone corrupted at %p\n", ptr);
-      break;
+  heap_redzone_check(header, ptr);
+
+  header->payload_size = 0;
+  header->is_free = 1;
+  heap_trim(coalesce(header));
+}
+
+static int slab_page_index(const void *ptr) {
+  const char *p = (const char *)ptr;
+  if (p >= heap_start && p < heap_end) {
+    return (int)((unsigned long)(p - heap_start) / SLAB_PAGE_SIZE);
+  }
+  if (heap_can_grow && p >= (char *)HEAP_GROW_BASE && p < heap_grow_end) {
+    return (int)((HEAP_SIZE + (unsigned long)(p - (char *)HEAP_GROW_BASE)) /
+                 SLAB_PAGE_SIZE);
+  }
+  return -1;
+}
+
+static slab_t *slab_of(const void *ptr) {
+  int index = slab_page_index(ptr);
+  if (index < 0) {
+    return 0;
+  }
+  u8 entry = slab_page_map[index];
+  if (!(entry & SLAB_MAP_CLASS_MASK)) {
+    return 0;
+  }
+  unsigned long page = (unsigned long)ptr & ~(unsigned long)(SLAB_PAGE_SIZE - 1);
+  page -= (unsigned long)(entry >> SLAB_MAP_PAGE_SHIFT) * SLAB_PAGE_SIZE;
+  return (slab_t *)page;
+}
+
+static int slab_class_for(unsigned long size) {
+  if (size <= (1UL << SLAB_MIN_SHIFT)) {
+    return 0;
+  }
+  return (64 - __builtin_clzl(size - 1)) - SLAB_MIN_SHIFT;
+}
+
+static void slab_link(slab_class_t *cls, slab_t *slab) {
+  slab->prev = 0;
+  slab->next = cls->partial;
+  if (cls->partial) {
+    cls->partial->prev = slab;
+  }
+  cls->partial = slab;
+}
+
+static void slab_unlink(slab_class_t *cls, slab_t *slab) {
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    cls->partial = slab->next;
+  }
+  if (slab->next) {
+    slab->next->prev = slab->prev;
+  }
+  slab->next = 0;
+  slab->prev = 0;
+}
+
+static slab_t *slab_grow(int class_index) {
+  slab_class_t *cls = &slab_classes[class_index];
+  unsigned long chunk_size = cls->chunk_pages * SLAB_PAGE_SIZE;
+
+  slab_t *slab = (slab_t *)heap_alloc_aligned(chunk_size, SLAB_PAGE_SIZE);
+  if (!slab) {
+    return 0;
+  }
+
+  unsigned long refs = (chunk_size - align16(sizeof(slab_t))) /
+                       (cls->object_size + sizeof(heap_ref_t));
+  unsigned long first = align16(sizeof(slab_t) + refs * sizeof(heap_ref_t));
+  unsigned long capacity = (chunk_size - first) / cls->object_size;
+  slab->magic = SLAB_MAGIC;
+  slab->class_index = (unsigned short)class_index;
+  slab->inuse = 0;
+  slab->capacity = (unsigned short)(capacity < refs ? capacity : refs);
+  slab->first = (unsigned short)first;
+  slab->free_list = 0;
+
+  char *objects = (char *)slab + first;
+  for (int i = slab->capacity - 1; i >= 0; i--) {
+    u64 *obj = (u64 *)(objects + (unsigned long)i * cls->object_size);
+    obj[0] = (u64)slab->free_list;
+    obj[1] = SLAB_FREE_MAGIC;
+    slab->free_list = obj;
+  }
+
+  int index = slab_page_index(slab);
+  for (unsigned long i = 0; i < cls->chunk_pages; i++) {
+    slab_page_map[index + i] =
+        (u8)((class_index + 1) | (i << SLAB_MAP_PAGE_SHIFT));
+  }
+
+  slab_link(cls, slab);
+  cls->empty_slabs++;
+  cls->total_slabs++;
+  return slab;
+}
+
+static void slab_release(slab_class_t *cls, slab_t *slab) {
+  slab_unlink(cls, slab);
+  cls->empty_slabs--;
+  cls->total_slabs--;
+
+  int index = slab_page_index(slab);
+  for (unsigned long i = 0; i < cls->chunk_pages; i++) {
+    slab_page_map[index + i] = 0;
+  }
+  slab->magic = 0;
+  heap_list_free(slab);
+}
+
+/* Cached empty slabs are the heap's reclaimable memory. Releasing one frees
+ * its chunk in the list allocator, which may in turn trim the growth window. */
+static unsigned long heap_slab_count(shrinker_t *shrinker) {
+  (void)shrinker;
+  unsigned long pages = 0;
+  for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+    pages += slab_classes[i].empty_slabs * slab_classes[i].chunk_pages;
+  }
+  return pages;
+}
+
+static unsigned long heap_slab_scan(shrinker_t *shrinker, unsigned long nr) {
+  (void)shrinker;
+  unsigned long freed = 0;
+  for (int i = 0; i < SLAB_CLASS_COUNT && freed < nr; i++) {
+    slab_class_t *cls = &slab_classes[i];
+    slab_t *slab = cls->partial;
+    while (slab && freed < nr) {
+      slab_t *next = slab->next;
+      if (slab->inuse == 0) {
+        slab_release(cls, slab);
+        freed += cls->chunk_pages;
+      }
+      slab = next;
     }
   }
-  for (u32 i = 0; i < HEAP_REDZONE_SIZE; i++) {
-    if (payload[header->payload_size + i] != HEAP_REDZONE_PATTERN) {
-      com1_printf("KFREE: right redzone corrupted at %p\n", ptr);
-      break;
+  return freed;
+}
+
+static shrinker_t heap_slab_shrinker = {
+    .name = "kmalloc_slabs", .count = heap_slab_count, .scan = heap_slab_scan};
+
+static void *slab_alloc(int class_index) {
+  slab_class_t *cls = &slab_classes[class_index];
+  slab_t *slab = cls->partial;
+  if (!slab) {
+    slab = slab_grow(class_index);
+    if (!slab) {
+      return 0;
     }
   }
 
-  memset(payload, HEAP_POISON_PATTERN, header->payload_size);
+  u64 *obj = (u64 *)slab->free_list;
+  slab->free_list = (void *)obj[0];
+  obj[1] = 0;
+  if (slab->inuse++ == 0) {
+    cls->empty_slabs--;
+  }
+  if (!slab->free_list) {
+    slab_unlink(cls, slab);
+  }
+  cls->allocs++;
+  return obj;
+}
 
-  header->payload_size = 0;
-  header->is_free = 1;
-  coalesce(header);
+static void slab_free(slab_t *slab, void *ptr) {
+  if (slab->magic != SLAB_MAGIC) {
+    com1_printf("KFREE: slab corrupted for %p\n", ptr);
+    return;
+  }
+
+  slab_class_t *cls = &slab_classes[slab->class_index];
+  unsigned long first = slab->first;
+  unsigned long offset = (unsigned long)ptr - (unsigned long)slab;
+  if (offset < first || (offset - first) % cls->object_size != 0) {
+    com1_printf("KFREE: invalid pointer %p\n", ptr);
+    return;
+  }
+
+  u64 *obj = (u64 *)ptr;
+  if (obj[1] == SLAB_FREE_MAGIC) {
+    com1_printf("KFREE: double free in %p\n", ptr);
+    return;
+  }
+
+  if (!slab->free_list) {
+    slab_link(cls, slab);
+  }
+  obj[0] = (u64)slab->free_list;
+  obj[1] = SLAB_FREE_MAGIC;
+  slab->free_list = obj;
+  cls->frees++;
+
+  if (--slab->inuse == 0) {
+    cls->empty_slabs++;
+    /* Keep one empty slab per class around to absorb alloc/free churn. */
+    if (cls->empty_slabs > 1) {
+      slab_release(cls, slab);
+    }
+  }
 }
 
-void *kcalloc(unsigned long nmemb, unsigned long size) {
+static unsigned short heap_site_index(void *site) {
+  unsigned long hash = ((unsigned long)site >> 2) * 0x9E3779B97F4A7C15ULL;
+  unsigned int slot = (unsigned int)(hash >> 57);
+  for (int probe = 0; probe < HEAP_SITE_COUNT; probe++) {
+    unsigned int i = (slot + probe) & (HEAP_SITE_COUNT - 1);
+    if (i == 0) {
+      continue;
+    }
+    if (heap_sites[i].site == site) {
+      return (unsigned short)i;
+    }
+    if (!heap_sites[i].site) {
+      heap_sites[i].site = site;
+      return (unsigned short)i;
+    }
+  }
+  return 0;
+}
+
+/* Bookkeeping slot of a live allocation and the bytes charged for it. */
+static heap_ref_t *heap_ref_of(void *ptr, unsigned long *bytes) {
+  if (is_kguard_addr(ptr)) {
+    int slot = kguard_slot(ptr);
+    if (slot < 0) {
+      return 0;
+    }
+    *bytes = kguard_size(ptr);
+    return &heap_kguard_refs[slot];
+  }
+
+  slab_t *slab = slab_of(ptr);
+  if (slab) {
+    unsigned long object_size = slab_classes[slab->class_index].object_size;
+    unsigned long offset = (unsigned long)ptr - (unsigned long)slab;
+    if (slab->magic != SLAB_MAGIC || offset < slab->first ||
+        (offset - slab->first) % object_size != 0 ||
+        ((u64 *)ptr)[1] == SLAB_FREE_MAGIC) {
+      return 0;
+    }
+    *bytes = object_size;
+    heap_ref_t *refs = (heap_ref_t *)((char *)slab + sizeof(slab_t));
+    return &refs[(offset - slab->first) / object_size];
+  }
+
+  header_t *header =
+      (header_t *)((char *)ptr - HEAP_REDZONE_SIZE - sizeof(header_t));
+  if (!heap_contains(header) || header->magic != HEAP_MAGIC ||
+      header->is_free) {
+    return 0;
+  }
+  *bytes = header->payload_size;
+  return &header->ref;
+}
+
+static void heap_stat_add(kheap_stat_t *stat, unsigned long bytes) {
+  stat->live_bytes += bytes;
+  stat->live_count++;
+  stat->allocs++;
+  if (stat->live_bytes > stat->peak_bytes) {
+    stat->peak_bytes = stat->live_bytes;
+  }
+}
+
+static void heap_stat_sub(kheap_stat_t *stat, unsigned long bytes) {
+  stat->live_bytes -= bytes < stat->live_bytes ? bytes : stat->live_bytes;
+  if (stat->live_count) {
+    stat->live_count--;
+  }
+}
+
+static void heap_account_alloc(void *ptr, int tag, void *site) {
+  unsigned long bytes;
+  heap_ref_t *ref = heap_ref_of(ptr, &bytes);
+  if (!ref) {
+    return;
+  }
+  if (tag < 0 || tag >= KMEM_TAG_COUNT) {
+    tag = KMEM_TAG_OTHER;
+  }
+  ref->site = heap_site_index(site);
+  ref->tag = (unsigned short)tag;
+  if (heap_sites[ref->site].allocs == 0) {
+    heap_sites[ref->site].tag = (unsigned int)tag;
+  }
+  heap_stat_add(&heap_sites[ref->site], bytes);
+  heap_stat_add(&heap_tags[tag], bytes);
+  heap_stat_add(&heap_total, bytes);
+}
+
+static void heap_account_free(void *ptr) {
+  unsigned long bytes;
+  heap_ref_t *ref = heap_ref_of(ptr, &bytes);
+  if (!ref) {
+    return;
+  }
+  heap_stat_sub(&heap_sites[ref->site], bytes);
+  heap_stat_sub(&heap_tags[ref->tag], bytes);
+  heap_stat_sub(&heap_total, bytes);
+}
+
+static void *heap_alloc(unsigned long size, int tag, void *site) {
+  if (!heap_head)
+    init_heap();
+
+  if (size == 0)
+    return 0;
+
+  void *ptr = kguard_alloc(size, site);
+  if (!ptr && size <= SLAB_MAX_SIZE) {
+    ptr = slab_alloc(slab_class_for(size));
+  }
+  if (!ptr) {
+    ptr = heap_list_alloc(size);
+  }
+  if (ptr) {
+    heap_account_alloc(ptr, tag, site);
+  }
+  return ptr;
+}
+
+static void *heap_calloc(unsigned long nmemb, unsigned long size, int tag,
+                         void *site) {
   unsigned long total = nmemb * size;
   if (nmemb != 0 && total / nmemb != size)
     return 0;
 
-  void *ptr = kmalloc(total);
+  void *ptr = heap_alloc(total, tag, site);
   if (ptr) {
     memset(ptr, 0, total);
   }
   return ptr;
 }
 
+void *kmalloc(unsigned long size) {
+  return heap_alloc(size, KMEM_TAG_OTHER, __builtin_return_address(0));
+}
+
+void *kmalloc_tagged(unsigned long size, int tag) {
+  return heap_alloc(size, tag, __builtin_return_address(0));
+}
+
+void kfree(void *ptr) {
+  if (!ptr)
+    return;
+  if (is_kguard_addr(ptr)) {
+    heap_account_free(ptr);
+    kguard_free(ptr, __builtin_return_address(0));
+    return;
+  }
+  if (!heap_start || !heap_end)
+    return;
+
+  heap_account_free(ptr);
+
+  slab_t *slab = slab_of(ptr);
+  if (slab) {
+    slab_free(slab, ptr);
+    return;
+  }
+
+  heap_list_free(ptr);
+}
+
+void *kcalloc(unsigned long nmemb, unsigned long size) {
+  return heap_calloc(nmemb, size, KMEM_TAG_OTHER,
+                     __builtin_return_address(0));
+}
+
+void *kcalloc_tagged(unsigned long nmemb, unsigned long size, int tag) {
+  return heap_calloc(nmemb, size, tag, __builtin_return_address(0));
+}
+
 void *krealloc(void *ptr, unsigned long size) {
+  void *site = __builtin_return_address(0);
   if (!ptr)
-    return kmalloc(size);
+    return heap_alloc(size, KMEM_TAG_OTHER, site);
   if (size == 0) {
     kfree(ptr);
     return 0;
   }
 
-  header_t *header = (header_t *)((char *)ptr - sizeof(header_t));
+  unsigned long bytes;
+  heap_ref_t *ref = heap_ref_of(ptr, &bytes);
+  int tag = ref ? ref->tag : KMEM_TAG_OTHER;
+
+  if (is_kguard_addr(ptr)) {
+    unsigned long old_size = kguard_size(ptr);
+    if (old_size >= size) {
+      return ptr;
+    }
+    void *new_ptr = old_size ? heap_alloc(size, tag, site) : 0;
+    if (new_ptr) {
+      memcpy(new_ptr, ptr, old_size);
+    }
+    if (new_ptr || !old_size) {
+      heap_account_free(ptr);
+      kguard_free(ptr, site);
+    }
+    return new_ptr;
+  }
+
+  slab_t *slab = slab_of(ptr);
+  if (slab) {
+    unsigned long object_size = slab_classes[slab->class_index].object_size;
+    if (size <= object_size) {
+      return ptr;
+    }
+    void *new_ptr = heap_alloc(size, tag, site);
+    if (!new_ptr)
+      return 0;
+    memcpy(new_ptr, ptr, object_size);
+    kfree(ptr);
+    return new_ptr;
+  }
+
+  header_t *header =
+      (header_t *)((char *)ptr - HEAP_REDZONE_SIZE - sizeof(header_t));
   if (header->magic != HEAP_MAGIC)
     return 0;
 
@@ -229,9 +851,10 @@ void *krealloc(void *ptr, unsigned long size) {
   }
 
   header_t *next = header->next;
-  if (next && next->is_free &&
+  if (next && next->is_free && heap_block_end(header) == (char *)next &&
       (header->size + sizeof(header_t) + next->size) >=
           (align16(size) + (2 * HEAP_REDZONE_SIZE))) {
+    heap_account_free(ptr);
     header->size += sizeof(header_t) + next->size;
     header->next = next->next;
     if (header->next) {
@@ -239,10 +862,12 @@ void *krealloc(void *ptr, unsigned long size) {
     }
     header->payload_size = align16(size);
     split_block(header, header->payload_size + (2 * HEAP_REDZONE_SIZE));
+    heap_redzone_fill(header);
+    heap_account_alloc(ptr, tag, site);
     return ptr;
   }
 
-  void *new_ptr = kmalloc(size);
+  void *new_ptr = heap_alloc(size, tag, site);
   if (!new_ptr)
     return 0;
 
@@ -260,6 +885,13 @@ unsigned long kget_free_memory() {
     }
     current = current->next;
   }
+  for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+    slab_class_t *cls = &slab_classes[i];
+    for (slab_t *slab = cls->partial; slab; slab = slab->next) {
+      free_mem += (unsigned long)(slab->capacity - slab->inuse) *
+                  cls->object_size;
+    }
+  }
   return free_mem;
 }
 
@@ -273,6 +905,30 @@ int kheap_is_initialized(void) {
   return 1;
 }
 
+void kheap_enable_growth(void) {
+  if (!pmm_is_initialized()) {
+    com1_printf("[HEAP] Growth disabled: no frame allocator\n");
+    return;
+  }
+  if (mmu_share_kernel_region(HEAP_GROW_BASE) != 0) {
+    com1_printf("[HEAP] Growth disabled: cannot map window\n");
+    return;
+  }
+  heap_grow_end = (char *)HEAP_GROW_BASE;
+  heap_can_grow = 1;
+  com1_printf("[HEAP] Growth window at %p (%d MB max)\n",
+              (void *)HEAP_GROW_BASE, (int)(HEAP_GROW_LIMIT / (1024 * 1024)));
+}
+
+void kheap_get_range(unsigned long *start, unsigned long *end) {
+  if (start) {
+    *start = (unsigned long)heap_start;
+  }
+  if (end) {
+    *end = (unsigned long)heap_end;
+  }
+}
+
 void kheap_dump() {
   com1_printf("--- HEAP DUMP ---\n");
   header_t *current = heap_head;
@@ -283,22 +939,84 @@ void kheap_dump() {
                 current->next, current->prev);
     current = current->next;
   }
+  for (int k = 0; k < SLAB_CLASS_COUNT; k++) {
+    slab_class_t *cls = &slab_classes[k];
+    com1_printf("Slab %d: slabs=%d empty=%d allocs=%d frees=%d\n",
+                (int)cls->object_size, (int)cls->total_slabs,
+                (int)cls->empty_slabs, (int)cls->allocs, (int)cls->frees);
+  }
+  if (heap_can_grow) {
+    com1_printf("Grown: %d KB\n",
+                (int)((heap_grow_end - (char *)HEAP_GROW_BASE) / 1024));
+  }
   com1_printf("Total free: %d\n", (int)kget_free_memory());
   com1_printf("-----------------\n");
 }
 
+const char *kheap_tag_name(int tag) {
+  if (tag < 0 || tag >= KMEM_TAG_COUNT) {
+    return "?";
+  }
+  return heap_tag_names[tag];
+}
+
+int kheap_site_stat(int index, kheap_stat_t *out) {
+  if (index < 0 || index >= HEAP_SITE_COUNT) {
+    return -1;
+  }
+  *out = heap_sites[index];
+  return 0;
+}
+
+int kheap_tag_stat(int tag, kheap_stat_t *out) {
+  if (tag < 0 || tag >= KMEM_TAG_COUNT) {
+    return -1;
+  }
+  *out = heap_tags[tag];
+  out->tag = (unsigned int)tag;
+  return 0;
+}
+
+void kheap_stat_total(kheap_stat_t *out) { *out = heap_total; }
+
+void kheap_stat_reset_peaks(void) {
+  for (int i = 0; i < HEAP_SITE_COUNT; i++) {
+    heap_sites[i].peak_bytes = heap_sites[i].live_bytes;
+  }
+  for (int i = 0; i < KMEM_TAG_COUNT; i++) {
+    heap_tags[i].peak_bytes = heap_tags[i].live_bytes;
+  }
+  heap_total.peak_bytes = heap_total.live_bytes;
+}
+
+int kheap_fragmentation(unsigned long *free_bytes, unsigned long *largest) {
+  unsigned long total = 0;
+  unsigned long max = 0;
+  for (header_t *current = heap_head; current; current = current->next) {
+    if (current->is_free) {
+      total += current->size;
+      if (current->size > max) {
+        max = current->size;
+      }
+    }
+  }
+  if (free_bytes) {
+    *free_bytes = total;
+  }
+  if (largest) {
+    *largest = max;
+  }
+  if (total == 0) {
+    return 0;
+  }
+  return (int)(100 - (max * 100) / total);
+}
+
 /*
  * kmalloc_aligned: Allocates memory with a specific alignment.
  * Useful for DMA, Page Tables, etc.
  */
-void *kmalloc_aligned(unsigned long size, unsigned long align) {
-  if (!heap_head)
-    init_heap();
-  if (size == 0)
-    return 0;
-  if (align <= 16)
-    return kmalloc(size);
-
+static void *heap_aligned_alloc(unsigned long size, unsigned long align) {
   unsigned long payload_size = align16(size);
   unsigned long total_size = payload_size + (2 * HEAP_REDZONE_SIZE);
   header_t *current = heap_head;
@@ -311,6 +1029,10 @@ void *kmalloc_aligned(unsigned long size, unsigned long align) {
       unsigned long aligned_header =
           aligned_payload - HEAP_REDZONE_SIZE - sizeof(header_t);
       unsigned long padding = aligned_header - (unsigned long)current;
+      if (padding != 0 && padding < sizeof(header_t) + 16) {
+        /* Too small to split off: use the next aligned slot instead. */
+        padding += align;
+      }
 
       if (padding + total_size <= current->size) {
         if (padding >= sizeof(header_t) + 16) {
@@ -340,25 +1062,62 @@ void *kmalloc_aligned(unsigned long size, unsigned long align) {
           split_block(current, total_size);
           current->is_free = 0;
           current->payload_size = payload_size;
-          u8 *base = (u8 *)current + sizeof(header_t);
-          memset(base, HEAP_REDZONE_PATTERN, HEAP_REDZONE_SIZE);
-          memset(base + HEAP_REDZONE_SIZE + current->payload_size,
-                 HEAP_REDZONE_PATTERN, HEAP_REDZONE_SIZE);
-          return (void *)(base + HEAP_REDZONE_SIZE);
+          heap_redzone_fill(current);
+          return (void *)((u8 *)current + sizeof(header_t) +
+                          HEAP_REDZONE_SIZE);
         }
       }
     }
     current = current->next;
   }
 
-  com1_printf("KMALLOC_ALIGNED FAILED! size: %d, align: %d\n", (int)size,
-              (int)align);
   return 0;
 }
 
+static void *heap_alloc_aligned(unsigned long size, unsigned long align) {
+  unsigned long worst = align16(size) + (2 * HEAP_REDZONE_SIZE) + align +
+                        sizeof(header_t) + 16;
+  void *ptr = heap_aligned_alloc(size, align);
+  if (!ptr && heap_grow(worst) == 0) {
+    ptr = heap_aligned_alloc(size, align);
+  }
+  if (!ptr && heap_reclaim(worst)) {
+    ptr = heap_aligned_alloc(size, align);
+    if (!ptr && heap_grow(worst) == 0) {
+      ptr = heap_aligned_alloc(size, align);
+    }
+  }
+  if (!ptr) {
+    com1_printf("KMALLOC_ALIGNED FAILED! size: %d, align: %d\n", (int)size,
+                (int)align);
+  }
+  return ptr;
+}
+
+void *kmalloc_aligned(unsigned long size, unsigned long align) {
+  void *site = __builtin_return_address(0);
+  if (!heap_head)
+    init_heap();
+  if (size == 0)
+    return 0;
+  if (align <= 16)
+    return heap_alloc(size, KMEM_TAG_OTHER, site);
+
+  void *ptr = heap_alloc_aligned(size, align);
+  if (ptr) {
+    heap_account_alloc(ptr, KMEM_TAG_OTHER, site);
+  }
+  return ptr;
+}
+
 unsigned long kmalloc_usable_size(void *ptr) {
   if (!ptr)
     return 0;
+  if (is_kguard_addr(ptr))
+    return kguard_size(ptr);
+  slab_t *slab = slab_of(ptr);
+  if (slab)
+    return slab_classes[slab->class_index].object_size;
   header_t *header =
       (header_t *)((char *)ptr - HEAP_REDZONE_SIZE - sizeof(header_t));
   if (header->magic != HEAP_MAGIC)
@@ -26,15 +26,50 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+/* Subsystem tags for heap accounting, reported by heapstat. */
+enum {
+  KMEM_TAG_OTHER = 0,
+  KMEM_TAG_MM,
+  KMEM_TAG_PROC,
+  KMEM_TAG_FS,
+  KMEM_TAG_VIDEO,
+  KMEM_TAG_TTY,
+  KMEM_TAG_COUNT
+};
+
+/* Live/peak usage of one allocation site, one tag or the whole heap. Bytes
+ * are what the allocator handed out (slab object or list payload size). */
+typedef struct {
+  void *site; /* return address of the allocating call, NULL for slot 0 */
+  unsigned int tag;
+  unsigned long live_bytes;
+  unsigned long live_count;
+  unsigned long allocs;
+  unsigned long peak_bytes;
+} kheap_stat_t;
+
 void *kmalloc(unsigned long size);
 void kfree(void *ptr);
 void *kcalloc(unsigned long nmemb, unsigned long size);
 void *krealloc(void *ptr, unsigned long size);
 void *kmalloc_aligned(unsigned long size, unsigned long align);
 unsigned long kmalloc_usable_size(void *ptr);
+void *kmalloc_tagged(unsigned long size, int tag);
+void *kcalloc_tagged(unsigned long nmemb, unsigned long size, int tag);
 unsigned long kget_free_memory();
 int kheap_is_initialized(void);
+void kheap_enable_growth(void);
+void kheap_get_range(unsigned long *start, unsigned long *end);
 void kheap_dump();
+
+const char *kheap_tag_name(int tag);
+int kheap_site_stat(int index, kheap_stat_t *out);
+int kheap_tag_stat(int tag, kheap_stat_t *out);
+void kheap_stat_total(kheap_stat_t *out);
+void kheap_stat_reset_peaks(void);
+/* 0 when all free list memory is one block, approaching 100 as it splinters
+ * into many small ones (100 - largest free block * 100 / total free). */
+int kheap_fragmentation(unsigned long *free_bytes, unsigned long *largest);
 void init_heap();
 
 #endif
@@ -106,9 +106,15 @@ pub const elf_info_t = extern struct {
 };
 
 extern fn com1_printf(fmt: [*:0]const u8, ...) void;
-extern fn kmalloc_aligned(size: usize, alignment: usize) ?*anyopaque;
-extern fn memset(s: *anyopaque, c: c_int, n: usize) *anyopaque;
+extern fn pmm_alloc_zeroed_frame() u64;
 extern fn mmu_map_page(vaddr: u64, paddr: u64, flags: u64) void;
+extern fn mmu_map_range_frames(
+    vaddr: u64,
+    length: u64,
+    flags: u64,
+    frame: *const fn (index: u64, ctx: ?*anyopaque) callconv(.c) u64,
+    ctx: ?*anyopaque,
+) c_int;
 extern fn mmu_virt_to_phys(vaddr: u64) u64;
 extern fn mmu_get_pte_flags(vaddr: u64) u64;
 
@@ -124,6 +130,12 @@ inline fn data_as_bytes(data: *anyopaque) [*]u8 {
     return @ptrCast(data);
 }
 
+fn elf_segment_frame(index: u64, ctx: ?*anyopaque) callconv(.c) u64 {
+    _ = index;
+    _ = ctx;
+    return pmm_alloc_zeroed_frame();
+}
+
 pub export fn elf_strerror(result: elf_result_t) [*:0]const u8 {
     return switch (result) {
         .ELF_OK => "OK",
@@ -232,6 +244,11 @@ pub export fn elf_load(data: *anyopaque, size: u64) u64 {
         u64_to_ptr(info.load_addr_max),
     );
 
+    // End of the user pages mapped so far. PT_LOAD segments come in address
+    // order, so only a page a segment shares with the one before it needs
+    // its existing flags merged; the rest is mapped with one range call.
+    var mapped_end: u64 = 0;
+
     var i: u16 = 0;
     while (i < info.header.e_phnum) : (i += 1) {
         const phdr = &info.phdrs[i];
@@ -262,8 +279,10 @@ pub export fn elf_load(data: *anyopaque, size: u64) u64 {
         const page_start = vaddr & ~page_mask;
         const page_end = (vaddr + memsz + PAGE_SIZE - 1) & ~page_mask;
 
+        const fresh_start = if (page_start > mapped_end) page_start else @min(mapped_end, page_end);
+
         var page = page_start;
-        while (page < page_end) : (page += PAGE_SIZE) {
+        while (page < fresh_start) : (page += PAGE_SIZE) {
             const existing_phys = mmu_virt_to_phys(page);
             if (existing_phys != 0) {
                 const existing_flags = mmu_get_pte_flags(page);
@@ -278,14 +297,23 @@ pub export fn elf_load(data: *anyopaque, size: u64) u64 {
                 }
             }
 
-            const phys_page = kmalloc_aligned(u64_to_usize(PAGE_SIZE), u64_to_usize(PAGE_SIZE));
-            if (phys_page == null) {
+            const phys_page = pmm_alloc_zeroed_frame();
+            if (phys_page == 0) {
                 com1_printf("[ELF] Error: Failed to allocate page at %p\n", u64_to_ptr(page));
                 return 0;
             }
-            _ = memset(phys_page.?, 0, u64_to_usize(PAGE_SIZE));
 
-            mmu_map_page(page, @as(u64, @intFromPtr(phys_page.?)), page_flags);
+            mmu_map_page(page, phys_page, page_flags);
+        }
+
+        if (fresh_start < page_end) {
+            if (mmu_map_range_frames(fresh_start, page_end - fresh_start, page_flags, &elf_segment_frame, null) != 0) {
+                com1_printf("[ELF] Error: Failed to map segment at %p\n", u64_to_ptr(fresh_start));
+                return 0;
+            }
+        }
+        if (page_end > mapped_end) {
+            mapped_end = page_end;
         }
 
         const base = data_as_bytes(data);
@@ -301,24 +329,6 @@ pub export fn elf_load(data: *anyopaque, size: u64) u64 {
         while (j < memsz) : (j += 1) {
             dst[u64_to_usize(j)] = 0;
         }
-
-        page = page_start;
-        while (page < page_end) : (page += PAGE_SIZE) {
-            const phys = mmu_virt_to_phys(page);
-            if (phys == 0) {
-                continue;
-            }
-            const existing_flags = mmu_get_pte_flags(page);
-
-            var combined_flags = existing_flags | (page_flags & (PTE_PRESENT | PTE_USER | PTE_RW));
-            const exec_ok = ((existing_flags & PTE_NX) == 0) or ((phdr.p_flags & PF_X) != 0);
-            if (exec_ok) {
-                combined_flags &= ~PTE_NX;
-            } else {
-                combined_flags |= PTE_NX;
-            }
-            mmu_map_page(page, phys, combined_flags);
-        }
     }
 
     com1_printf("[ELF] Load complete, entry point: %p\n", u64_to_ptr(info.entry_point));
@@ -27,6 +27,7 @@
 #include <kernel/gdt.h>
 #include <kernel/drivers/vga.h>
 #include <kernel/mmu.h>
+#include <kernel/pmm.h>
 #include <kernel/process.h>
 #include <lib/com1.h>
 #include <mlibc/mlibc.h>
@@ -55,6 +56,10 @@ void userspace_init(void) {
   gdt_init();
   status_line("gdt", gdt_is_initialized());
 
+  /* The boot GDT was the last thing the kernel used below the higher half;
+   * address spaces created from here on start without the identity map. */
+  mmu_drop_identity_map();
+
   /* Initialize process subsystem */
   process_init();
   status_line("process", process_is_initialized());
@@ -62,6 +67,12 @@ void userspace_init(void) {
   com1_printf("[USERSPACE] Userspace ready\n");
 }
 
+static u64 user_stack_frame(u64 index, void *ctx) {
+  (void)index;
+  (void)ctx;
+  return pmm_alloc_zeroed_frame();
+}
+
 /* Allocate and map user stack */
 static u64 allocate_user_stack(void) {
   /* Allocate stack pages */
@@ -71,24 +82,12 @@ static u64 allocate_user_stack(void) {
   com1_printf("[USERSPACE] Allocating user stack: %d pages at %p\n",
               (int)stack_pages, (void *)stack_bottom);
 
-  for (u64 i = 0; i < stack_pages; i++) {
-    void *page = kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
-    if (!page) {
-      com1_printf("[USERSPACE] Error: Failed to allocate stack page\n");
-      for (u64 j = 0; j < i; j++) {
-        u64 vaddr = stack_bottom + (j * PAGE_SIZE);
-        u64 paddr = mmu_virt_to_phys(vaddr);
-        mmu_unmap_page(vaddr);
-        if (paddr) {
-          kfree((void *)paddr);
-        }
-      }
-      return 0;
-    }
-    memset(page, 0, PAGE_SIZE);
-
-    u64 vaddr = stack_bottom + (i * PAGE_SIZE);
-    mmu_map_page(vaddr, (u64)page, PTE_PRESENT | PTE_RW | PTE_USER | PTE_NX);
+  if (mmu_map_range_frames(stack_bottom, stack_pages * PAGE_SIZE,
+                           PTE_PRESENT | PTE_RW | PTE_USER | PTE_NX,
+                           user_stack_frame, NULL) != 0) {
+    com1_printf("[USERSPACE] Error: Failed to allocate stack page\n");
+    mmu_unmap_range(stack_bottom, stack_pages * PAGE_SIZE, 1);
+    return 0;
   }
 
   /* Return top of stack (stack grows downward) */
@@ -105,7 +104,7 @@ process_t *userspace_load_elf(const char *name, void *elf_data, u64 elf_size) {
     return NULL;
   }
 
-  u64 old_cr3 = mmu_read_cr3();
+  u64 old_cr3 = mmu_read_cr3() & PTE_ADDR_MASK;
   mmu_write_cr3(new_cr3);
 
   /* Validate and load ELF */
@@ -113,8 +112,7 @@ process_t *userspace_load_elf(const char *name, void *elf_data, u64 elf_size) {
   if (entry == 0) {
     com1_printf("[USERSPACE] Error: Failed to load ELF\n");
     mmu_write_cr3(old_cr3);
-    mmu_free_user_space(new_cr3);
-    kfree((void *)(new_cr3 & PTE_ADDR_MASK));
+    mmu_destroy_address_space(new_cr3);
     return NULL;
   }
 
@@ -126,20 +124,18 @@ process_t *userspace_load_elf(const char *name, void *elf_data, u64 elf_size) {
   }
 
   /* Allocate kernel stack */
-  u8 *kstack = (u8 *)kmalloc_aligned(KERNEL_STACK_SIZE, 16);
-  if (!kstack) {
+  u64 kstack_top = process_alloc_kernel_stack();
+  if (!kstack_top) {
     com1_printf("[USERSPACE] Error: Failed to allocate kernel stack\n");
     return NULL;
   }
-  memset(kstack, 0, KERNEL_STACK_SIZE);
 
   /* Allocate user stack */
   u64 user_stack = allocate_user_stack();
   if (user_stack == 0) {
-    kfree(kstack);
+    process_free_kernel_stack(kstack_top);
     mmu_write_cr3(old_cr3);
-    mmu_free_user_space(new_cr3);
-    kfree((void *)(new_cr3 & PTE_ADDR_MASK));
+    mmu_destroy_address_space(new_cr3);
     return NULL;
   }
 
@@ -150,10 +146,9 @@ process_t *userspace_load_elf(const char *name, void *elf_data, u64 elf_size) {
 
   if (!new_proc) {
     com1_printf("[USERSPACE] Error: No free process slots\n");
-    kfree(kstack);
+    process_free_kernel_stack(kstack_top);
     /* TODO: free user stack pages */
-    mmu_free_user_space(new_cr3);
-    kfree((void *)(new_cr3 & PTE_ADDR_MASK));
+    mmu_destroy_address_space(new_cr3);
     return NULL;
   }
 
@@ -174,7 +169,7 @@ process_t *userspace_load_elf(const char *name, void *elf_data, u64 elf_size) {
   new_proc->entry_point = entry;
 
   /* Stacks */
-  new_proc->kernel_stack = (u64)(kstack + KERNEL_STACK_SIZE);
+  new_proc->kernel_stack = kstack_top;
   new_proc->user_stack = user_stack;
 
   /* Initialize context for userspace execution */
@@ -188,6 +183,8 @@ process_t *userspace_load_elf(const char *name, void *elf_data, u64 elf_size) {
   new_proc->exit_code = 0;
   new_proc->owns_address_space = 1;
   new_proc->mmap_base = MMAP_BASE;
+  memset(&new_proc->vmas, 0, sizeof(new_proc->vmas));
+  memset(&new_proc->faults, 0, sizeof(new_proc->faults));
   posix_init_process(new_proc);
   new_proc->next = NULL;
 